@@ -41,6 +41,80 @@ static inline void lfs_cache_zero(lfs_t *lfs, lfs_cache_t *pcache) {
     pcache->block = LFS_BLOCK_NULL;
 }
 
+static inline const uint8_t *lfs_bd_map(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off) {
+    // only valid in direct-mapped mode, block/off must already be checked
+    return (const uint8_t*)lfs->cfg->direct_map
+            + (size_t)block*lfs->cfg->block_size + off;
+}
+
+static inline bool lfs_bd_ismapped(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_block_t block) {
+    // mapped memory is only up to date if nothing is pending in pcache
+    return lfs->cfg->direct_map && (!pcache || pcache->block != block);
+}
+
+static int lfs_bd_mapsync(lfs_t *lfs, lfs_block_t block) {
+    // the block device may hold back programs to the block it was last
+    // programmed until sync, which mapped reads of that block must wait for
+    if (block != lfs->unsynced) {
+        return 0;
+    }
+
+    lfs->unsynced = LFS_BLOCK_NULL;
+    int err = lfs->cfg->sync(lfs->cfg);
+    LFS_ASSERT(err <= 0);
+    return err;
+}
+
+static inline uint32_t lfs_rslot_rank(lfs_t *lfs, const lfs_rslot_t *slot) {
+    // eviction order, lowest first: empty slots, least recently used
+    // slots, and only then slots pinned by rcache_pin
+    if (slot->cache.block == LFS_BLOCK_NULL) {
+        return 0;
+    }
+
+    uint32_t age = lfs->rslot_clock - slot->used;
+    bool pinned = lfs->cfg->rcache_pin &&
+            (slot->cache.block == lfs->root[0] ||
+             slot->cache.block == lfs->root[1]);
+    return 0x7fffffff - lfs_min(age, 0x7ffffffe) + (pinned ? 0x80000000 : 0);
+}
+
+static lfs_cache_t *lfs_rslot_find(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off) {
+    // find the slot holding off, or else the slot to load it into
+    lfs_rslot_t *victim = &lfs->rslots[0];
+    for (lfs_size_t i = 0; i < lfs->cfg->rcache_slots; i++) {
+        lfs_rslot_t *slot = &lfs->rslots[i];
+        if (block == slot->cache.block &&
+                off >= slot->cache.off &&
+                off < slot->cache.off + slot->cache.size) {
+            slot->used = ++lfs->rslot_clock;
+            lfs->rcache_hits += 1;
+            return &slot->cache;
+        }
+
+        if (lfs_rslot_rank(lfs, slot) < lfs_rslot_rank(lfs, victim)) {
+            victim = slot;
+        }
+    }
+
+    victim->used = ++lfs->rslot_clock;
+    return &victim->cache;
+}
+
+#ifndef LFS_READONLY
+static void lfs_rslot_drop(lfs_t *lfs, lfs_block_t block) {
+    // block is being programmed or erased, drop any slots holding it
+    for (lfs_size_t i = 0; lfs->rslots && i < lfs->cfg->rcache_slots; i++) {
+        if (lfs->rslots[i].cache.block == block) {
+            lfs_cache_drop(lfs, &lfs->rslots[i].cache);
+        }
+    }
+}
+#endif
+
 static int lfs_bd_read(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
@@ -51,6 +125,13 @@ static int lfs_bd_read(lfs_t *lfs,
         return LFS_ERR_CORRUPT;
     }
 
+    if (lfs->cfg->direct_map) {
+        int err = lfs_bd_mapsync(lfs, block);
+        if (err) {
+            return err;
+        }
+    }
+
     while (size > 0) {
         lfs_size_t diff = size;
 
@@ -71,12 +152,31 @@ static int lfs_bd_read(lfs_t *lfs,
             diff = lfs_min(diff, pcache->off-off);
         }
 
-        if (block == rcache->block &&
-                off < rcache->off + rcache->size) {
-            if (off >= rcache->off) {
+        if (lfs->cfg->direct_map) {
+            // directly mapped? read straight from memory, no need for rcache
+            memcpy(data, lfs_bd_map(lfs, block, off), diff);
+
+            data += diff;
+            off += diff;
+            size -= diff;
+            continue;
+        }
+
+        lfs_cache_t *rc = rcache;
+        lfs_size_t rc_size = lfs->cfg->cache_size;
+        if (rcache == &lfs->rcache && lfs->rslots) {
+            // metadata reads go through the read cache slots, leaving
+            // lfs->rcache free to be borrowed by lfs_file_flush
+            rc = lfs_rslot_find(lfs, block, off);
+            rc_size = lfs->rslot_size;
+        }
+
+        if (block == rc->block &&
+                off < rc->off + rc->size) {
+            if (off >= rc->off) {
                 // is already in rcache?
-                diff = lfs_min(diff, rcache->size - (off-rcache->off));
-                memcpy(data, &rcache->buffer[off-rcache->off], diff);
+                diff = lfs_min(diff, rc->size - (off-rc->off));
+                memcpy(data, &rc->buffer[off-rc->off], diff);
 
                 data += diff;
                 off += diff;
@@ -85,7 +185,7 @@ static int lfs_bd_read(lfs_t *lfs,
             }
 
             // rcache takes priority
-            diff = lfs_min(diff, rcache->off-off);
+            diff = lfs_min(diff, rc->off-off);
         }
 
         if (size >= hint && off % lfs->cfg->read_size == 0 &&
@@ -105,18 +205,22 @@ static int lfs_bd_read(lfs_t *lfs,
 
         // load to cache, first condition can no longer fail
         LFS_ASSERT(block < lfs->cfg->block_count);
-        rcache->block = block;
-        rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
-        rcache->size = lfs_min(
+        rc->block = block;
+        rc->off = lfs_aligndown(off, lfs->cfg->read_size);
+        rc->size = lfs_min(
                 lfs_min(
                     lfs_alignup(off+hint, lfs->cfg->read_size),
                     lfs->cfg->block_size)
-                - rcache->off,
-                lfs->cfg->cache_size);
-        int err = lfs->cfg->read(lfs->cfg, rcache->block,
-                rcache->off, rcache->buffer, rcache->size);
+                - rc->off,
+                rc_size);
+        if (rc != rcache) {
+            lfs->rcache_misses += 1;
+        }
+        int err = lfs->cfg->read(lfs->cfg, rc->block,
+                rc->off, rc->buffer, rc->size);
         LFS_ASSERT(err <= 0);
         if (err) {
+            lfs_cache_drop(lfs, rc);
             return err;
         }
     }
@@ -131,6 +235,26 @@ static int lfs_bd_cmp(lfs_t *lfs,
     const uint8_t *data = buffer;
     lfs_size_t diff = 0;
 
+    if (lfs_bd_ismapped(lfs, pcache, block)) {
+        if (block >= lfs->cfg->block_count ||
+                off+size > lfs->cfg->block_size) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        int err = lfs_bd_mapsync(lfs, block);
+        if (err) {
+            return err;
+        }
+
+        // compare in place
+        int res = memcmp(lfs_bd_map(lfs, block, off), data, size);
+        if (res) {
+            return res < 0 ? LFS_CMP_LT : LFS_CMP_GT;
+        }
+
+        return LFS_CMP_EQ;
+    }
+
     for (lfs_off_t i = 0; i < size; i += diff) {
         uint8_t dat[8];
 
@@ -151,6 +275,44 @@ static int lfs_bd_cmp(lfs_t *lfs,
     return LFS_CMP_EQ;
 }
 
+static int lfs_bd_crc(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
+        lfs_block_t block, lfs_off_t off, lfs_size_t size, uint32_t *crc) {
+    lfs_size_t diff = 0;
+
+    if (lfs_bd_ismapped(lfs, pcache, block)) {
+        if (block >= lfs->cfg->block_count ||
+                off+size > lfs->cfg->block_size) {
+            return LFS_ERR_CORRUPT;
+        }
+
+        int err = lfs_bd_mapsync(lfs, block);
+        if (err) {
+            return err;
+        }
+
+        // crc in place
+        *crc = lfs_crc(*crc, lfs_bd_map(lfs, block, off), size);
+        return 0;
+    }
+
+    for (lfs_off_t i = 0; i < size; i += diff) {
+        uint8_t dat[8];
+
+        diff = lfs_min(size-i, sizeof(dat));
+        int err = lfs_bd_read(lfs,
+                pcache, rcache, hint-i,
+                block, off+i, &dat, diff);
+        if (err) {
+            return err;
+        }
+
+        *crc = lfs_crc(*crc, &dat, diff);
+    }
+
+    return 0;
+}
+
 #ifndef LFS_READONLY
 static int lfs_bd_flush(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache, bool validate) {
@@ -160,9 +322,11 @@ static int lfs_bd_flush(lfs_t *lfs,
         int err = lfs->cfg->prog(lfs->cfg, pcache->block,
                 pcache->off, pcache->buffer, diff);
         LFS_ASSERT(err <= 0);
+        lfs_rslot_drop(lfs, pcache->block);
         if (err) {
             return err;
         }
+        lfs->unsynced = pcache->block;
 
         if (validate) {
             // check data on disk
@@ -198,6 +362,7 @@ static int lfs_bd_sync(lfs_t *lfs,
 
     err = lfs->cfg->sync(lfs->cfg);
     LFS_ASSERT(err <= 0);
+    lfs->unsynced = LFS_BLOCK_NULL;
     return err;
 }
 #endif
@@ -253,8 +418,20 @@ static int lfs_bd_prog(lfs_t *lfs,
 #ifndef LFS_READONLY
 static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
     LFS_ASSERT(block < lfs->cfg->block_count);
+    lfs_rslot_drop(lfs, block);
     int err = lfs->cfg->erase(lfs->cfg, block);
     LFS_ASSERT(err <= 0);
+
+    // count the erase, the counts are little-endian 16-bit values so they
+    // can be committed as they are
+    if (!err && lfs->wear) {
+        uint8_t *count = &lfs->wear[2*block];
+        if (count[0] != 0xff || count[1] != 0xff) {
+            count[0] += 1;
+            count[1] += (count[0] == 0);
+        }
+        lfs->wear_erases += 1;
+    }
     return err;
 }
 #endif
@@ -279,14 +456,12 @@ static inline int lfs_pair_cmp(
              paira[0] == pairb[1] || paira[1] == pairb[0]);
 }
 
-#ifndef LFS_READONLY
 static inline bool lfs_pair_sync(
         const lfs_block_t paira[2],
         const lfs_block_t pairb[2]) {
     return (paira[0] == pairb[0] && paira[1] == pairb[1]) ||
            (paira[0] == pairb[1] && paira[1] == pairb[0]);
 }
-#endif
 
 static inline void lfs_pair_fromle32(lfs_block_t pair[2]) {
     pair[0] = lfs_fromle32(pair[0]);
@@ -349,12 +524,8 @@ static inline lfs_size_t lfs_tag_dsize(lfs_tag_t tag) {
     return sizeof(tag) + lfs_tag_size(tag + lfs_tag_isdelete(tag));
 }
 
-// operations on attributes in attribute lists
-struct lfs_mattr {
-    lfs_tag_t tag;
-    const void *buffer;
-};
-
+// operations on attributes in attribute lists, struct lfs_mattr is in lfs.h
+// for transactions
 struct lfs_diskoff {
     lfs_block_t block;
     lfs_off_t off;
@@ -446,6 +617,33 @@ static inline void lfs_superblock_tole32(lfs_superblock_t *superblock) {
 }
 #endif
 
+// mount checkpoint, a metadata pair as it was fetched, the checkpoint
+// attribute is an lfs_gstate_t followed by one of these for each pair
+struct lfs_checkpoint {
+    lfs_block_t pair[2];
+    uint32_t rev;
+    lfs_off_t off;
+    lfs_tag_t etag;
+};
+
+static inline void lfs_checkpoint_fromle32(struct lfs_checkpoint *ckpt) {
+    ckpt->pair[0] = lfs_fromle32(ckpt->pair[0]);
+    ckpt->pair[1] = lfs_fromle32(ckpt->pair[1]);
+    ckpt->rev     = lfs_fromle32(ckpt->rev);
+    ckpt->off     = lfs_fromle32(ckpt->off);
+    ckpt->etag    = lfs_fromle32(ckpt->etag);
+}
+
+#ifndef LFS_READONLY
+static inline void lfs_checkpoint_tole32(struct lfs_checkpoint *ckpt) {
+    ckpt->pair[0] = lfs_tole32(ckpt->pair[0]);
+    ckpt->pair[1] = lfs_tole32(ckpt->pair[1]);
+    ckpt->rev     = lfs_tole32(ckpt->rev);
+    ckpt->off     = lfs_tole32(ckpt->off);
+    ckpt->etag    = lfs_tole32(ckpt->etag);
+}
+#endif
+
 #ifndef LFS_NO_ASSERT
 static bool lfs_mlist_isopen(struct lfs_mlist *head,
         struct lfs_mlist *node) {
@@ -498,6 +696,7 @@ static int lfs_fs_pred(lfs_t *lfs, const lfs_block_t dir[2],
 static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_mdir_t *parent);
 static int lfs_fs_forceconsistency(lfs_t *lfs);
+static int lfs_fs_rawcheckpoint(lfs_t *lfs);
 #endif
 
 #ifdef LFS_MIGRATE
@@ -538,11 +737,60 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
 }
 #endif
 
+#ifndef LFS_READONLY
+// with free_bitmap the lookahead buffer holds an exact bitmap of blocks in
+// use, indexed by block, followed by a bitmap of blocks allocated since the
+// last ack, which may not be referenced by the filesystem yet
+static inline lfs_size_t lfs_alloc_words(lfs_t *lfs) {
+    return (lfs->cfg->block_count + 31) / 32;
+}
+
+static inline uint32_t *lfs_alloc_pending(lfs_t *lfs) {
+    return &lfs->free.buffer[lfs_alloc_words(lfs)];
+}
+
+static int lfs_alloc_mark(void *p, lfs_block_t block) {
+    lfs_t *lfs = (lfs_t*)p;
+    if (block < lfs->cfg->block_count &&
+            !(lfs->free.buffer[block / 32] & (1U << (block % 32)))) {
+        lfs->free.buffer[block / 32] |= 1U << (block % 32);
+        lfs->free.used += 1;
+    }
+
+    return 0;
+}
+
+static int lfs_alloc_release(void *p, lfs_block_t block) {
+    lfs_t *lfs = (lfs_t*)p;
+    // blocks allocated since the last ack stay in use, they may have been
+    // handed out again after the commit that released them
+    if (lfs->cfg->free_bitmap && lfs->free.size &&
+            block < lfs->cfg->block_count &&
+            (lfs->free.buffer[block / 32] & (1U << (block % 32))) &&
+            !(lfs_alloc_pending(lfs)[block / 32] & (1U << (block % 32)))) {
+        lfs->free.buffer[block / 32] &= ~(1U << (block % 32));
+        lfs->free.used -= 1;
+    }
+
+    return 0;
+}
+
+static void lfs_alloc_releasepair(lfs_t *lfs, const lfs_block_t pair[2]) {
+    lfs_alloc_release(lfs, pair[0]);
+    lfs_alloc_release(lfs, pair[1]);
+}
+#endif
+
 // indicate allocated blocks have been committed into the filesystem, this
 // is to prevent blocks from being garbage collected in the middle of a
 // commit operation
 static void lfs_alloc_ack(lfs_t *lfs) {
     lfs->free.ack = lfs->cfg->block_count;
+#ifndef LFS_READONLY
+    if (lfs->cfg->free_bitmap) {
+        memset(lfs_alloc_pending(lfs), 0, 4*lfs_alloc_words(lfs));
+    }
+#endif
 }
 
 // drop the lookahead buffer, this is done during mounting and failed
@@ -550,11 +798,143 @@ static void lfs_alloc_ack(lfs_t *lfs) {
 static void lfs_alloc_drop(lfs_t *lfs) {
     lfs->free.size = 0;
     lfs->free.i = 0;
-    lfs_alloc_ack(lfs);
+    // note blocks allocated since the last ack are still in flight
+    lfs->free.ack = lfs->cfg->block_count;
+}
+
+#ifndef LFS_READONLY
+static int lfs_alloc_scan(lfs_t *lfs) {
+    if (lfs->cfg->free_bitmap) {
+        // rebuild the free bitmap, reclaiming any blocks that were released
+        // without being cleared, blocks allocated since the last ack are
+        // still in flight
+        memset(lfs->free.buffer, 0, 4*lfs_alloc_words(lfs));
+        lfs->free.size = 0;
+        lfs->free.used = 0;
+        int err = lfs_fs_rawtraverse(lfs, lfs_alloc_mark, lfs, true);
+        if (err) {
+            lfs_alloc_drop(lfs);
+            return err;
+        }
+
+        const uint32_t *pending = lfs_alloc_pending(lfs);
+        for (lfs_block_t b = 0; b < lfs->cfg->block_count; b++) {
+            if (pending[b / 32] & (1U << (b % 32))) {
+                lfs_alloc_mark(lfs, b);
+            }
+        }
+        lfs->free.size = lfs->cfg->block_count;
+        return 0;
+    }
+
+    // move lookahead window past the blocks we have already looked at
+    lfs->free.off = (lfs->free.off + lfs->free.size)
+            % lfs->cfg->block_count;
+    lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size, lfs->free.ack);
+    lfs->free.i = 0;
+
+    // find mask of free blocks from tree
+    memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
+    int err = lfs_fs_rawtraverse(lfs, lfs_alloc_lookahead, lfs, true);
+    if (err) {
+        lfs_alloc_drop(lfs);
+        return err;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static inline uint16_t lfs_alloc_wear(lfs_t *lfs, lfs_block_t block) {
+    return lfs->wear[2*block] | (uint16_t)lfs->wear[2*block+1] << 8;
+}
+
+// with erase counts, find the free block to allocate between offsets begin
+// and end of the free bitmap, counting from free.off, skipping the blocks in
+// skip, returns end if there isn't one
+//
+// hot data takes the least worn block, and cold data the most worn, which
+// it then rests until the cold data is rewritten. Ties go to the first block
+// for hot data, and the last for cold data.
+static lfs_block_t lfs_alloc_pick(lfs_t *lfs,
+        lfs_block_t begin, lfs_block_t end,
+        const lfs_block_t *skip, lfs_size_t skipcount, bool cold) {
+    lfs_block_t best = end;
+    uint16_t bestwear = 0;
+    for (lfs_block_t off = begin; off < end; off++) {
+        lfs_block_t b = (lfs->free.off + off) % lfs->cfg->block_count;
+        if (lfs->free.buffer[b / 32] & (1U << (b % 32))) {
+            continue;
+        }
+
+        uint16_t wear = lfs_alloc_wear(lfs, b);
+        if (best != end && ((cold) ? wear < bestwear : wear >= bestwear)) {
+            continue;
+        }
+
+        bool skipped = false;
+        for (lfs_size_t i = 0; i < skipcount; i++) {
+            skipped = skipped || (skip[i] == b);
+        }
+
+        if (!skipped) {
+            best = off;
+            bestwear = wear;
+        }
+    }
+
+    return best;
+}
+
+static int lfs_alloc_exact(lfs_t *lfs, lfs_block_t *block, bool cold) {
+    // free.off is the next block to consider, allocating round-robin
+    // keeps wear spread across the device
+    bool scanned = false;
+    while (true) {
+        lfs_block_t first = 0;
+        if (lfs->wear) {
+            // or the least worn, round-robin between equally worn blocks,
+            // cold data takes the most worn and leaves the cursor alone
+            first = lfs_alloc_pick(lfs, 0, lfs->free.size, NULL, 0, cold);
+        }
+
+        for (lfs_block_t i = first; i < lfs->free.size; i++) {
+            lfs_block_t b = (lfs->free.off + i) % lfs->cfg->block_count;
+            if (!(lfs->free.buffer[b / 32] & (1U << (b % 32)))) {
+                // found a free block
+                lfs_alloc_mark(lfs, b);
+                lfs_alloc_pending(lfs)[b / 32] |= 1U << (b % 32);
+                if (!lfs->wear || !cold) {
+                    lfs->free.off = (b + 1) % lfs->cfg->block_count;
+                }
+                *block = b;
+                return 0;
+            }
+        }
+
+        // only traverse the filesystem if the bitmap isn't built yet, or
+        // to reclaim blocks that were released without being cleared
+        if (scanned) {
+            LFS_ERROR("No more free space %"PRIu32, lfs->free.off);
+            return LFS_ERR_NOSPC;
+        }
+
+        int err = lfs_alloc_scan(lfs);
+        if (err) {
+            return err;
+        }
+        scanned = true;
+    }
 }
+#endif
 
 #ifndef LFS_READONLY
-static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+static int lfs_alloc(lfs_t *lfs, lfs_block_t *block, bool cold) {
+    if (lfs->cfg->free_bitmap) {
+        return lfs_alloc_exact(lfs, block, cold);
+    }
+
     while (true) {
         while (lfs->free.i != lfs->free.size) {
             lfs_block_t off = lfs->free.i;
@@ -585,19 +965,85 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
             return LFS_ERR_NOSPC;
         }
 
-        lfs->free.off = (lfs->free.off + lfs->free.size)
-                % lfs->cfg->block_count;
-        lfs->free.size = lfs_min(8*lfs->cfg->lookahead_size, lfs->free.ack);
-        lfs->free.i = 0;
+        int err = lfs_alloc_scan(lfs);
+        if (err) {
+            return err;
+        }
+    }
+}
+#endif
 
-        // find mask of free blocks from tree
-        memset(lfs->free.buffer, 0, lfs->cfg->lookahead_size);
-        int err = lfs_fs_rawtraverse(lfs, lfs_alloc_lookahead, lfs, true);
+#ifndef LFS_READONLY
+// with erase counts, blocks are handed out least worn first, the order for
+// hot data
+static lfs_ssize_t lfs_alloc_peekworn(lfs_t *lfs,
+        lfs_block_t *blocks, lfs_size_t count) {
+    lfs_size_t n = 0;
+    while (n < count) {
+        lfs_block_t off = lfs_alloc_pick(lfs,
+                0, lfs->free.size, blocks, n, false);
+        if (off == lfs->free.size) {
+            break;
+        }
+
+        blocks[n] = (lfs->free.off + off) % lfs->cfg->block_count;
+        n += 1;
+    }
+
+    return n;
+}
+
+static lfs_ssize_t lfs_alloc_peek(lfs_t *lfs,
+        lfs_block_t *blocks, lfs_size_t count) {
+    if (lfs->cfg->free_bitmap) {
+        if (!lfs->free.size) {
+            int err = lfs_alloc_scan(lfs);
+            if (err) {
+                return err;
+            }
+        }
+
+        if (lfs->wear) {
+            return lfs_alloc_peekworn(lfs, blocks, count);
+        }
+
+        lfs_size_t n = 0;
+        for (lfs_block_t i = 0; i < lfs->free.size && n < count; i++) {
+            lfs_block_t b = (lfs->free.off + i) % lfs->cfg->block_count;
+            if (!(lfs->free.buffer[b / 32] & (1U << (b % 32)))) {
+                blocks[n] = b;
+                n += 1;
+            }
+        }
+
+        return n;
+    }
+
+    if (lfs->free.i == lfs->free.size) {
+        // nothing left in the lookahead window, but only refill it if
+        // lfs_alloc would be allowed to
+        if (lfs->free.ack == 0) {
+            return 0;
+        }
+
+        int err = lfs_alloc_scan(lfs);
         if (err) {
-            lfs_alloc_drop(lfs);
             return err;
         }
     }
+
+    // report free blocks in the order lfs_alloc will hand them out, these
+    // have not been allocated since the window was scanned
+    lfs_size_t n = 0;
+    for (lfs_block_t off = lfs->free.i;
+            off < lfs->free.size && n < count; off++) {
+        if (!(lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
+            blocks[n] = (lfs->free.off + off) % lfs->cfg->block_count;
+            n += 1;
+        }
+    }
+
+    return n;
 }
 #endif
 
@@ -1119,20 +1565,16 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
             }
 
             // crc the entry first, hopefully leaving it in the cache
-            for (lfs_off_t j = sizeof(tag); j < lfs_tag_dsize(tag); j++) {
-                uint8_t dat;
-                err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
-                        dir->pair[0], off+j, &dat, 1);
-                if (err) {
-                    if (err == LFS_ERR_CORRUPT) {
-                        dir->erased = false;
-                        break;
-                    }
-                    return err;
+            err = lfs_bd_crc(lfs,
+                    NULL, &lfs->rcache, lfs->cfg->block_size,
+                    dir->pair[0], off+sizeof(tag),
+                    lfs_tag_dsize(tag)-sizeof(tag), &crc);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    dir->erased = false;
+                    break;
                 }
-
-                crc = lfs_crc(crc, &dat, 1);
+                return err;
             }
 
             // directory modification tags?
@@ -1320,11 +1762,97 @@ static int lfs_dir_find_match(void *data,
     return LFS_CMP_EQ;
 }
 
-static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
-        const char **path, uint16_t *id) {
-    // we reduce path to a single name if we can find it
-    const char *name = *path;
-    if (id) {
+// dentry cache
+static uint32_t lfs_dcache_hash(const lfs_block_t pair[2],
+        const char *name, lfs_size_t namelen) {
+    // FNV-1a over the pair, smallest block first, and the name
+    lfs_block_t p[2] = {lfs_min(pair[0], pair[1]), lfs_max(pair[0], pair[1])};
+    const uint8_t *data = (const uint8_t*)p;
+    uint32_t hash = 0x811c9dc5;
+    for (lfs_size_t i = 0; i < sizeof(p); i++) {
+        hash = (hash ^ data[i]) * 0x01000193;
+    }
+    for (lfs_size_t i = 0; i < namelen; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+static lfs_dentry_t *lfs_dcache_find(lfs_t *lfs, const lfs_block_t pair[2],
+        const char *name, lfs_size_t namelen) {
+    uint32_t hash = lfs_dcache_hash(pair, name, namelen);
+    uint32_t crc = lfs_crc(0xffffffff, name, namelen);
+    for (lfs_size_t i = 0; lfs->dcache && i < lfs->cfg->dcache_size; i++) {
+        lfs_dentry_t *dent = &lfs->dcache[i];
+        if (dent->m.pair[0] != LFS_BLOCK_NULL &&
+                dent->hash == hash && dent->crc == crc &&
+                // a pending move hides the entry, which only fetch knows
+                !lfs_gstate_hasmovehere(&lfs->gdisk, dent->m.pair)) {
+            dent->used = ++lfs->dcache_clock;
+            lfs->dcache_hits += 1;
+            return dent;
+        }
+    }
+
+    lfs->dcache_misses += 1;
+    return NULL;
+}
+
+static lfs_dentry_t *lfs_dcache_insert(lfs_t *lfs, const lfs_block_t pair[2],
+        const char *name, lfs_size_t namelen,
+        const lfs_mdir_t *dir, lfs_stag_t tag, uint16_t id) {
+    if (!lfs->dcache) {
+        return NULL;
+    }
+
+    // replace an unused entry, or else the least recently used
+    lfs_dentry_t *dent = &lfs->dcache[0];
+    for (lfs_size_t i = 0; i < lfs->cfg->dcache_size; i++) {
+        if (lfs->dcache[i].m.pair[0] == LFS_BLOCK_NULL) {
+            dent = &lfs->dcache[i];
+            break;
+        }
+
+        if (lfs->dcache_clock - lfs->dcache[i].used >
+                lfs->dcache_clock - dent->used) {
+            dent = &lfs->dcache[i];
+        }
+    }
+
+    dent->hash = lfs_dcache_hash(pair, name, namelen);
+    dent->crc = lfs_crc(0xffffffff, name, namelen);
+    dent->tag = tag;
+    dent->id = id;
+    dent->used = ++lfs->dcache_clock;
+    dent->child[0] = LFS_BLOCK_NULL;
+    dent->child[1] = LFS_BLOCK_NULL;
+    dent->m = *dir;
+    return dent;
+}
+
+#ifndef LFS_READONLY
+static void lfs_dcache_drop(lfs_t *lfs, const lfs_block_t pair[2]) {
+    // pair is being committed to, drop the entries it holds
+    for (lfs_size_t i = 0; lfs->dcache && i < lfs->cfg->dcache_size; i++) {
+        if (lfs_pair_cmp(lfs->dcache[i].m.pair, pair) == 0) {
+            lfs->dcache[i].m.pair[0] = LFS_BLOCK_NULL;
+        }
+    }
+}
+#endif
+
+static void lfs_dcache_clear(lfs_t *lfs) {
+    // directories moved or went away, entries may be keyed by stale pairs
+    for (lfs_size_t i = 0; lfs->dcache && i < lfs->cfg->dcache_size; i++) {
+        lfs->dcache[i].m.pair[0] = LFS_BLOCK_NULL;
+    }
+}
+
+static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
+        const char **path, uint16_t *id) {
+    // we reduce path to a single name if we can find it
+    const char *name = *path;
+    if (id) {
         *id = 0x3ff;
     }
 
@@ -1332,6 +1860,7 @@ static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
     lfs_stag_t tag = LFS_MKTAG(LFS_TYPE_DIR, 0x3ff, 0);
     dir->tail[0] = lfs->root[0];
     dir->tail[1] = lfs->root[1];
+    lfs_dentry_t *dent = NULL;
 
     while (true) {
 nextname:
@@ -1384,37 +1913,74 @@ nextname:
         }
 
         // grab the entry data
-        if (lfs_tag_id(tag) != 0x3ff) {
+        if (lfs_tag_id(tag) != 0x3ff && dent && dent->child[0] != LFS_BLOCK_NULL) {
+            dir->tail[0] = dent->child[0];
+            dir->tail[1] = dent->child[1];
+        } else if (lfs_tag_id(tag) != 0x3ff) {
             lfs_stag_t res = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
                     LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), dir->tail);
             if (res < 0) {
                 return res;
             }
             lfs_pair_fromle32(dir->tail);
+
+            if (dent) {
+                dent->child[0] = dir->tail[0];
+                dent->child[1] = dir->tail[1];
+            }
+        }
+
+        // are we last name?
+        bool last = (strchr(name, '/') == NULL);
+
+        // already looked up?
+        dent = lfs_dcache_find(lfs, dir->tail, name, namelen);
+        if (dent) {
+            *dir = dent->m;
+            tag = dent->tag;
+            if (last && id) {
+                *id = dent->id;
+            }
+
+            if (tag == LFS_ERR_NOENT) {
+                return LFS_ERR_NOENT;
+            }
+
+            name += namelen;
+            continue;
         }
 
         // find entry matching name
+        lfs_block_t parent[2] = {dir->tail[0], dir->tail[1]};
+        uint16_t nid = 0x3ff;
         while (true) {
             tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
                     LFS_MKTAG(0x780, 0, 0),
                     LFS_MKTAG(LFS_TYPE_NAME, 0, namelen),
-                     // are we last name?
-                    (strchr(name, '/') == NULL) ? id : NULL,
+                    &nid,
                     lfs_dir_find_match, &(struct lfs_dir_find_match){
                         lfs, name, namelen});
-            if (tag < 0) {
+            if (tag < 0 && tag != LFS_ERR_NOENT) {
                 return tag;
             }
 
-            if (tag) {
-                break;
+            if (last && id) {
+                *id = nid;
             }
 
-            if (!dir->split) {
+            if (tag == LFS_ERR_NOENT || (!tag && !dir->split)) {
+                lfs_dcache_insert(lfs, parent, name, namelen,
+                        dir, LFS_ERR_NOENT, nid);
                 return LFS_ERR_NOENT;
             }
+
+            if (tag) {
+                break;
+            }
         }
 
+        dent = lfs_dcache_insert(lfs, parent, name, namelen, dir, tag, nid);
+
         // to next name
         name += namelen;
     }
@@ -1473,6 +2039,29 @@ static int lfs_dir_commitattr(lfs_t *lfs, struct lfs_commit *commit,
     } else {
         // from disk
         const struct lfs_diskoff *disk = buffer;
+        if (lfs_bd_ismapped(lfs, NULL, disk->block)) {
+            // directly mapped? copy straight out of memory
+            if (disk->block >= lfs->cfg->block_count ||
+                    disk->off+dsize-sizeof(tag) > lfs->cfg->block_size) {
+                return LFS_ERR_CORRUPT;
+            }
+
+            err = lfs_bd_mapsync(lfs, disk->block);
+            if (err) {
+                return err;
+            }
+
+            err = lfs_dir_commitprog(lfs, commit,
+                    lfs_bd_map(lfs, disk->block, disk->off),
+                    dsize-sizeof(tag));
+            if (err) {
+                return err;
+            }
+
+            commit->ptag = tag & 0x7fffffff;
+            return 0;
+        }
+
         for (lfs_off_t i = 0; i < dsize-sizeof(tag); i++) {
             // rely on caching to make this efficient
             uint8_t dat;
@@ -1561,23 +2150,29 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
     lfs_off_t noff = off1;
     while (off < end) {
         uint32_t crc = 0xffffffff;
-        for (lfs_off_t i = off; i < noff+sizeof(uint32_t); i++) {
+        if (off1 >= off && off1 < noff+sizeof(uint32_t)) {
             // check against written crc, may catch blocks that
             // become readonly and match our commit size exactly
-            if (i == off1 && crc != crc1) {
-                return LFS_ERR_CORRUPT;
-            }
-
-            // leave it up to caching to make this efficient
-            uint8_t dat;
-            err = lfs_bd_read(lfs,
-                    NULL, &lfs->rcache, noff+sizeof(uint32_t)-i,
-                    commit->block, i, &dat, 1);
+            err = lfs_bd_crc(lfs,
+                    NULL, &lfs->rcache, noff+sizeof(uint32_t)-off,
+                    commit->block, off, off1-off, &crc);
             if (err) {
                 return err;
             }
 
-            crc = lfs_crc(crc, &dat, 1);
+            if (crc != crc1) {
+                return LFS_ERR_CORRUPT;
+            }
+
+            off = off1;
+        }
+
+        // leave it up to caching to make this efficient
+        err = lfs_bd_crc(lfs,
+                NULL, &lfs->rcache, noff+sizeof(uint32_t)-off,
+                commit->block, off, noff+sizeof(uint32_t)-off, &crc);
+        if (err) {
+            return err;
         }
 
         // detected write error?
@@ -1601,7 +2196,7 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
 static int lfs_dir_alloc(lfs_t *lfs, lfs_mdir_t *dir) {
     // allocate pair of dir blocks (backwards, so we write block 1 first)
     for (int i = 0; i < 2; i++) {
-        int err = lfs_alloc(lfs, &dir->pair[(i+1)%2]);
+        int err = lfs_alloc(lfs, &dir->pair[(i+1)%2], false);
         if (err) {
             return err;
         }
@@ -1658,6 +2253,11 @@ static int lfs_dir_drop(lfs_t *lfs, lfs_mdir_t *dir, lfs_mdir_t *tail) {
         return err;
     }
 
+    // tail is no longer referenced
+    lfs_dcache_clear(lfs);
+    lfs->gc_pair[0] = 0;
+    lfs->gc_pair[1] = 1;
+    lfs_alloc_releasepair(lfs, tail->pair);
     return 0;
 }
 #endif
@@ -1894,7 +2494,7 @@ relocate:
         }
 
         // relocate half of pair
-        int err = lfs_alloc(lfs, &dir->pair[1]);
+        int err = lfs_alloc(lfs, &dir->pair[1], false);
         if (err && (err != LFS_ERR_NOSPC || !tired)) {
             return err;
         }
@@ -1932,15 +2532,14 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
             }
 
             // space is complicated, we need room for tail, crc, gstate,
-            // cleanup delete, and we cap at half a block to give room
-            // for metadata updates.
+            // cleanup delete, and we cap at half of metadata_max to give
+            // room for metadata updates.
+            lfs_size_t metadata_max = (lfs->cfg->metadata_max)
+                    ? lfs->cfg->metadata_max
+                    : lfs->cfg->block_size;
             if (end - split < 0xff
-                    && size <= lfs_min(lfs->cfg->block_size - 36,
-                        lfs_alignup(
-                            (lfs->cfg->metadata_max
-                                ? lfs->cfg->metadata_max
-                                : lfs->cfg->block_size)/2,
-                            lfs->cfg->prog_size))) {
+                    && size <= lfs_min(metadata_max - 36,
+                        lfs_alignup(metadata_max/2, lfs->cfg->prog_size))) {
                 break;
             }
 
@@ -2010,6 +2609,10 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
         lfs_mdir_t *pdir) {
     int state = 0;
 
+    // cached lookups into this mdir go stale, and so does the checkpoint
+    lfs_dcache_drop(lfs, dir->pair);
+    lfs->checkpoint_stale = true;
+
     // calculate changes to the directory
     bool hasdelete = false;
     for (int i = 0; i < attrcount; i++) {
@@ -2126,6 +2729,12 @@ compact:
     goto fixmlist;
 
 fixmlist:;
+    if (state == LFS_OK_RELOCATED || state == LFS_OK_DROPPED) {
+        lfs_dcache_clear(lfs);
+        lfs->gc_pair[0] = 0;
+        lfs->gc_pair[1] = 1;
+    }
+
     // this complicated bit of logic is for fixing up any active
     // metadata-pairs that we may have affected
     //
@@ -2159,8 +2768,9 @@ fixmlist:;
                 }
             }
 
-            while (d->id >= d->m.count && d->m.split) {
-                // we split and id is on tail now
+            while (!lfs_pair_isnull(d->m.pair) &&
+                    d->id >= d->m.count && d->m.split) {
+                // we split and id is on tail now, unless it was deleted
                 d->id -= d->m.count;
                 int err = lfs_dir_fetch(lfs, &d->m, d->m.tail);
                 if (err) {
@@ -2235,17 +2845,30 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
             return state;
         }
 
+        // dropped dir is no longer referenced
+        lfs_alloc_releasepair(lfs, dir->pair);
         ldir = pdir;
     }
 
     // need to relocate?
     bool orphans = false;
+    lfs_block_t rpair[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
+    lfs_block_t npair[2];
     while (state == LFS_OK_RELOCATED) {
         LFS_DEBUG("Relocating {0x%"PRIx32", 0x%"PRIx32"} "
                     "-> {0x%"PRIx32", 0x%"PRIx32"}",
                 lpair[0], lpair[1], ldir.pair[0], ldir.pair[1]);
         state = 0;
 
+        // remember the first relocation, its old blocks can be released
+        // once the parent and pred have been updated
+        if (rpair[0] == LFS_BLOCK_NULL) {
+            rpair[0] = lpair[0];
+            rpair[1] = lpair[1];
+            npair[0] = ldir.pair[0];
+            npair[1] = ldir.pair[1];
+        }
+
         // update internal root
         if (lfs_pair_cmp(lpair, lfs->root) == 0) {
             lfs->root[0] = ldir.pair[0];
@@ -2363,6 +2986,16 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
         }
     }
 
+    if (rpair[0] != LFS_BLOCK_NULL && !orphans) {
+        // nested relocations leave orphans, which still reference the old
+        // blocks until deorphaned, those are left for a rebuild to reclaim
+        for (int i = 0; i < 2; i++) {
+            if (rpair[i] != npair[0] && rpair[i] != npair[1]) {
+                lfs_alloc_release(lfs, rpair[i]);
+            }
+        }
+    }
+
     return orphans ? LFS_OK_ORPHANED : 0;
 }
 #endif
@@ -2653,10 +3286,32 @@ static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     return i;
 }
 
+static void lfs_ctz_indexput(lfs_ctz_point_t *index, lfs_size_t index_size,
+        lfs_off_t current, lfs_block_t block) {
+    // entries are direct mapped by block index
+    if (index_size) {
+        index[current % index_size].index = current;
+        index[current % index_size].block = block;
+    }
+}
+
+#ifndef LFS_READONLY
+static void lfs_ctz_indexdrop(lfs_ctz_point_t *index, lfs_size_t index_size,
+        lfs_off_t current) {
+    // blocks from current on are being replaced
+    for (lfs_size_t i = 0; i < index_size; i++) {
+        if (index[i].index >= current) {
+            index[i].index = (lfs_off_t)-1;
+        }
+    }
+}
+#endif
+
 static int lfs_ctz_find(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
-        lfs_size_t pos, lfs_block_t *block, lfs_off_t *off) {
+        lfs_size_t pos, lfs_block_t *block, lfs_off_t *off,
+        lfs_ctz_point_t *index, lfs_size_t index_size) {
     if (size == 0) {
         *block = LFS_BLOCK_NULL;
         *off = 0;
@@ -2666,6 +3321,16 @@ static int lfs_ctz_find(lfs_t *lfs,
     lfs_off_t current = lfs_ctz_index(lfs, &(lfs_off_t){size-1});
     lfs_off_t target = lfs_ctz_index(lfs, &pos);
 
+    // start from the closest indexed block at or after target, the
+    // skip-list only points backwards, unused entries are never before
+    // current
+    for (lfs_size_t i = 0; i < index_size; i++) {
+        if (index[i].index >= target && index[i].index < current) {
+            current = index[i].index;
+            head = index[i].block;
+        }
+    }
+
     while (current > target) {
         lfs_size_t skip = lfs_min(
                 lfs_npw2(current-target+1) - 1,
@@ -2680,6 +3345,7 @@ static int lfs_ctz_find(lfs_t *lfs,
         }
 
         current -= 1 << skip;
+        lfs_ctz_indexput(index, index_size, current, head);
     }
 
     *block = head;
@@ -2690,12 +3356,12 @@ static int lfs_ctz_find(lfs_t *lfs,
 #ifndef LFS_READONLY
 static int lfs_ctz_extend(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache,
-        lfs_block_t head, lfs_size_t size,
+        lfs_block_t head, lfs_size_t size, bool cold,
         lfs_block_t *block, lfs_off_t *off) {
     while (true) {
         // go ahead and grab a block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_alloc(lfs, &nblock, cold);
         if (err) {
             return err;
         }
@@ -2831,6 +3497,112 @@ static int lfs_ctz_traverse(lfs_t *lfs,
 }
 
 
+#ifndef LFS_READONLY
+static void lfs_alloc_releasectz(lfs_t *lfs, lfs_stag_t tag,
+        const struct lfs_ctz *ctz) {
+    // called after a commit has replaced or removed this ctz list
+    if (!lfs->cfg->free_bitmap || !lfs->free.size || tag < 0 ||
+            lfs_tag_type3(tag) != LFS_TYPE_CTZSTRUCT) {
+        return;
+    }
+
+    int err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
+            ctz->head, ctz->size, lfs_alloc_release, lfs);
+
+    // open files may share blocks with the released list, rewriting a file
+    // keeps the blocks before the rewrite, and so may other open handles
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f && !err; f = f->next) {
+        if (f->type != LFS_TYPE_REG || (f->flags & LFS_F_INLINE)) {
+            continue;
+        }
+
+        err = lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
+                f->ctz.head, f->ctz.size, lfs_alloc_mark, lfs);
+        if (!err && (f->flags & LFS_F_WRITING)) {
+            err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
+                    f->block, f->pos, lfs_alloc_mark, lfs);
+        }
+    }
+
+    if (err) {
+        // bitmap can't be trusted, rebuild it on the next allocation
+        lfs_alloc_drop(lfs);
+    }
+}
+#endif
+
+
+#ifndef LFS_READONLY
+static int lfs_ctz_prev(lfs_t *lfs, lfs_block_t *block) {
+    // the first pointer in a ctz block is to the block before it
+    int err = lfs_bd_read(lfs, NULL, &lfs->rcache, sizeof(*block),
+            *block, 0, block, sizeof(*block));
+    *block = lfs_fromle32(*block);
+    return err;
+}
+
+static void lfs_alloc_releasefile(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_ctz *octz) {
+    // file's ctz list has replaced octz without a commit, blocks of octz
+    // past file->committed were allocated since the file was last
+    // committed, so nothing else references them, release them down to
+    // where the new list starts sharing octz
+    if (!lfs->cfg->free_bitmap || !lfs->free.size ||
+            octz->head == LFS_BLOCK_INLINE || octz->size == 0) {
+        return;
+    }
+
+    lfs_off_t off = octz->size - 1;
+    lfs_off_t oi = lfs_ctz_index(lfs, &off);
+    lfs_block_t oblock = octz->head;
+    lfs_off_t ni = 0;
+    lfs_block_t nblock = file->ctz.head;
+    if (file->ctz.size > 0) {
+        off = file->ctz.size - 1;
+        ni = lfs_ctz_index(lfs, &off);
+    } else {
+        nblock = LFS_BLOCK_NULL;
+    }
+
+    lfs_size_t shared = 0;
+    while (true) {
+        int err = 0;
+        while (nblock != LFS_BLOCK_NULL && ni > oi && !err) {
+            err = lfs_ctz_prev(lfs, &nblock);
+            ni -= 1;
+        }
+
+        if (err) {
+            // bitmap can't be trusted, rebuild it on the next allocation
+            lfs_alloc_drop(lfs);
+            return;
+        }
+
+        if (nblock == oblock && ni == oi) {
+            shared = oi + 1;
+            break;
+        }
+
+        if (oi >= file->committed) {
+            lfs_alloc_release(lfs, oblock);
+        }
+
+        if (oi == 0) {
+            break;
+        }
+
+        err = lfs_ctz_prev(lfs, &oblock);
+        oi -= 1;
+        if (err) {
+            lfs_alloc_drop(lfs);
+            return;
+        }
+    }
+
+    file->committed = lfs_min(file->committed, shared);
+}
+#endif
+
 /// Top level file operations ///
 static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags,
@@ -2853,7 +3625,18 @@ static int lfs_file_rawopencfg(lfs_t *lfs, lfs_file_t *file,
     file->flags = flags;
     file->pos = 0;
     file->off = 0;
+    file->committed = (lfs_size_t)-1;
     file->cache.buffer = NULL;
+    file->index = cfg->ctz_index;
+    file->index_size = cfg->ctz_index ? cfg->ctz_index_size : 0;
+    for (lfs_size_t i = 0; i < file->index_size; i++) {
+        file->index[i].index = (lfs_off_t)-1;
+    }
+    LFS_ASSERT(cfg->readahead_size % lfs->cfg->read_size == 0);
+    file->ra.buffer = (cfg->readahead_size) ? cfg->readahead_buffer : NULL;
+    lfs_cache_drop(lfs, &file->ra);
+    file->ra_next = 0;
+    file->ra_streak = 0;
 
     // allocate entry for file if it doesn't exist
     lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
@@ -3025,11 +3808,24 @@ static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file) {
 
 
 #ifndef LFS_READONLY
+static void lfs_file_indexput(lfs_t *lfs, lfs_file_t *file) {
+    // file->block is a new block, replacing the blocks from its index on,
+    // pos is the next block's first byte if file->block is full
+    lfs_off_t off = file->pos;
+    lfs_off_t current = lfs_ctz_index(lfs, &off);
+    if (off != file->off) {
+        current -= 1;
+    }
+
+    lfs_ctz_indexdrop(file->index, file->index_size, current);
+    lfs_ctz_indexput(file->index, file->index_size, current, file->block);
+}
+
 static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
     while (true) {
         // just relocate what exists into new block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_alloc(lfs, &nblock, file->flags & LFS_O_COLD);
         if (err) {
             return err;
         }
@@ -3084,6 +3880,7 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
 
         file->block = nblock;
         file->flags |= LFS_F_WRITING;
+        lfs_file_indexput(lfs, file);
         return 0;
 
 relocate:
@@ -3113,6 +3910,7 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
     if (file->flags & LFS_F_READING) {
         if (!(file->flags & LFS_F_INLINE)) {
             lfs_cache_drop(lfs, &file->cache);
+            lfs_cache_drop(lfs, &file->ra);
         }
         file->flags &= ~LFS_F_READING;
     }
@@ -3146,7 +3944,8 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
                     return res;
                 }
 
-                // keep our reference to the rcache in sync
+                // keep our reference to the rcache in sync, with read
+                // cache slots metadata reads leave lfs->rcache alone
                 if (lfs->rcache.block != LFS_BLOCK_NULL) {
                     lfs_cache_drop(lfs, &orig.cache);
                     lfs_cache_drop(lfs, &lfs->rcache);
@@ -3177,12 +3976,14 @@ relocate:
         }
 
         // actual file updates
+        struct lfs_ctz octz = file->ctz;
         file->ctz.head = file->block;
         file->ctz.size = file->pos;
         file->flags &= ~LFS_F_WRITING;
         file->flags |= LFS_F_DIRTY;
 
         file->pos = pos;
+        lfs_alloc_releasefile(lfs, file, &octz);
     }
 #endif
 
@@ -3225,6 +4026,15 @@ static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file) {
             size = sizeof(ctz);
         }
 
+        // find the ctz list we are replacing
+        struct lfs_ctz octz;
+        lfs_stag_t otag = LFS_ERR_NOENT;
+        if (lfs->cfg->free_bitmap) {
+            otag = lfs_dir_get(lfs, &file->m, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, file->id, sizeof(octz)), &octz);
+            lfs_ctz_fromle32(&octz);
+        }
+
         // commit file data and attributes
         err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
                 {LFS_MKTAG(type, file->id, size), buffer},
@@ -3236,12 +4046,48 @@ static int lfs_file_rawsync(lfs_t *lfs, lfs_file_t *file) {
         }
 
         file->flags &= ~LFS_F_DIRTY;
+        file->committed = (lfs_size_t)-1;
+        lfs_alloc_releasectz(lfs, otag, &octz);
     }
 
     return 0;
 }
 #endif
 
+// sequential reads in a row before a file's reads are read ahead
+#define LFS_READAHEAD_STREAK 2
+
+// copy from the readahead buffer, first filling it from the current block
+// if it doesn't hold the file's position, returns the bytes copied
+static lfs_ssize_t lfs_file_readahead(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    lfs_cache_t *ra = &file->ra;
+    if (ra->block != file->block || file->off < ra->off ||
+            file->off >= ra->off + ra->size) {
+        // read ahead to the end of the block, or of the file
+        lfs_off_t end = file->off + (file->ctz.size - file->pos);
+        ra->block = file->block;
+        ra->off = lfs_aligndown(file->off, lfs->cfg->read_size);
+        ra->size = lfs_min(
+                lfs_min(
+                    lfs_alignup(end, lfs->cfg->read_size),
+                    lfs->cfg->block_size)
+                - ra->off,
+                file->cfg->readahead_size);
+        LFS_ASSERT(ra->block < lfs->cfg->block_count);
+        int err = lfs->cfg->read(lfs->cfg, ra->block, ra->off,
+                ra->buffer, ra->size);
+        if (err) {
+            lfs_cache_drop(lfs, ra);
+            return err;
+        }
+    }
+
+    size = lfs_min(size, ra->off + ra->size - file->off);
+    memcpy(buffer, &ra->buffer[file->off - ra->off], size);
+    return size;
+}
+
 static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
@@ -3252,7 +4098,19 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
         return 0;
     }
 
+    // a read continuing where the last one stopped is sequential, after a
+    // few of those small reads are served from a readahead of the block,
+    // reads of at least cache_size don't need it
+    if (file->pos == file->ra_next) {
+        file->ra_streak += (file->ra_streak < LFS_READAHEAD_STREAK);
+    } else {
+        file->ra_streak = 0;
+    }
+
     size = lfs_min(size, file->ctz.size - file->pos);
+    bool readahead = file->ra.buffer && !lfs->cfg->direct_map &&
+            file->ra_streak >= LFS_READAHEAD_STREAK &&
+            size < lfs->cfg->cache_size;
     nsize = size;
 
     while (nsize > 0) {
@@ -3262,7 +4120,8 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
             if (!(file->flags & LFS_F_INLINE)) {
                 int err = lfs_ctz_find(lfs, NULL, &file->cache,
                         file->ctz.head, file->ctz.size,
-                        file->pos, &file->block, &file->off);
+                        file->pos, &file->block, &file->off,
+                        file->index, file->index_size);
                 if (err) {
                     return err;
                 }
@@ -3285,9 +4144,20 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
             if (err) {
                 return err;
             }
+        } else if (readahead) {
+            lfs_ssize_t res = lfs_file_readahead(lfs, file, data, diff);
+            if (res < 0) {
+                return res;
+            }
+            diff = res;
         } else {
+            // reads of at least cache_size go straight into the caller's
+            // buffer, bypassing the file's cache
             int err = lfs_bd_read(lfs,
-                    NULL, &file->cache, lfs->cfg->block_size,
+                    NULL, &file->cache,
+                    (diff >= lfs->cfg->cache_size)
+                        ? lfs->cfg->cache_size
+                        : lfs->cfg->block_size,
                     file->block, file->off, data, diff);
             if (err) {
                 return err;
@@ -3300,6 +4170,7 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
         nsize -= diff;
     }
 
+    file->ra_next = file->pos;
     return size;
 }
 
@@ -3322,18 +4193,25 @@ static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
 
 
 #ifndef LFS_READONLY
+// largest file kept inline in its directory entry
+static inline lfs_size_t lfs_inline_max(lfs_t *lfs) {
+    return lfs_min(0x3fe, lfs_min(
+            lfs->cfg->cache_size,
+            (lfs->cfg->metadata_max ?
+                lfs->cfg->metadata_max : lfs->cfg->block_size) / 8));
+}
+
 static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
     const uint8_t *data = buffer;
     lfs_size_t nsize = size;
 
     if ((file->flags & LFS_F_INLINE) &&
-            lfs_max(file->pos+nsize, file->ctz.size) >
-            lfs_min(0x3fe, lfs_min(
-                lfs->cfg->cache_size,
-                (lfs->cfg->metadata_max ?
-                    lfs->cfg->metadata_max : lfs->cfg->block_size) / 8))) {
-        // inline file doesn't fit anymore
+            (((file->flags & (LFS_O_COLD | LFS_O_LOG)) && nsize > 0) ||
+             lfs_max(file->pos+nsize, file->ctz.size) >
+                lfs_inline_max(lfs))) {
+        // inline file doesn't fit anymore, or is cold data that every
+        // compaction of the directory would copy, or a log appended in place
         int err = lfs_file_outline(lfs, file);
         if (err) {
             file->flags |= LFS_F_ERRED;
@@ -3350,7 +4228,8 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
                     // find out which block we're extending from
                     int err = lfs_ctz_find(lfs, NULL, &file->cache,
                             file->ctz.head, file->ctz.size,
-                            file->pos-1, &file->block, &file->off);
+                            file->pos-1, &file->block, &file->off,
+                            file->index, file->index_size);
                     if (err) {
                         file->flags |= LFS_F_ERRED;
                         return err;
@@ -3360,14 +4239,29 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
                     lfs_cache_zero(lfs, &file->cache);
                 }
 
-                // extend file with new blocks
-                lfs_alloc_ack(lfs);
-                int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
-                        file->block, file->pos,
-                        &file->block, &file->off);
-                if (err) {
-                    file->flags |= LFS_F_ERRED;
-                    return err;
+                if ((file->flags & LFS_O_LOG) &&
+                        !(file->flags & LFS_F_WRITING) &&
+                        file->pos > 0 && file->pos == file->ctz.size &&
+                        file->off+1 < lfs->cfg->block_size &&
+                        (file->off+1) % lfs->cfg->prog_size == 0) {
+                    // log appends continue in the erased rest of the tail
+                    // block instead of copying it to a new block, past the
+                    // committed size nothing references these bytes. A
+                    // power loss may have programmed some of them, then the
+                    // validated program fails and the tail block relocates
+                    file->off += 1;
+                } else {
+                    // extend file with new blocks
+                    lfs_alloc_ack(lfs);
+                    int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
+                            file->block, file->pos, file->flags & LFS_O_COLD,
+                            &file->block, &file->off);
+                    if (err) {
+                        file->flags |= LFS_F_ERRED;
+                        return err;
+                    }
+
+                    lfs_file_indexput(lfs, file);
                 }
             } else {
                 file->block = LFS_BLOCK_INLINE;
@@ -3382,6 +4276,11 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         while (true) {
             int err = lfs_bd_prog(lfs, &file->cache, &lfs->rcache, true,
                     file->block, file->off, data, diff);
+            if (!err && file->off+diff == lfs->cfg->block_size) {
+                // an append in place may have started the cache part way
+                // through, flush it before moving on to the next block
+                err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
+            }
             if (err) {
                 if (err == LFS_ERR_CORRUPT) {
                     goto relocate;
@@ -3534,20 +4433,29 @@ static int lfs_file_rawtruncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
             return err;
         }
 
-        // lookup new head in ctz skip list
+        // lookup new head in ctz skip list, the head is the block holding
+        // the last byte, not the byte after it, when size is on a block
+        // boundary
         err = lfs_ctz_find(lfs, NULL, &file->cache,
                 file->ctz.head, file->ctz.size,
-                size, &file->block, &file->off);
+                size ? size-1 : 0, &file->block, &file->off,
+                file->index, file->index_size);
         if (err) {
             return err;
         }
 
+        // blocks past the new end go away
+        lfs_ctz_indexdrop(file->index, file->index_size,
+                size ? lfs_ctz_index(lfs, &(lfs_off_t){size-1}) + 1 : 0);
+
         // need to set pos/block/off consistently so seeking back to
         // the old position does not get confused
+        struct lfs_ctz octz = file->ctz;
         file->pos = size;
         file->ctz.head = file->block;
         file->ctz.size = size;
         file->flags |= LFS_F_DIRTY | LFS_F_READING;
+        lfs_alloc_releasefile(lfs, file, &octz);
     } else if (size > oldsize) {
         // flush+seek if not already at end
         lfs_soff_t res = lfs_file_rawseek(lfs, file, 0, LFS_SEEK_END);
@@ -3660,6 +4568,16 @@ static int lfs_rawremove(lfs_t *lfs, const char *path) {
         lfs->mlist = &dir;
     }
 
+    // find the ctz list we are removing
+    struct lfs_ctz ctz;
+    lfs_stag_t ctztag = LFS_ERR_NOENT;
+    if (lfs->cfg->free_bitmap && lfs_tag_type3(tag) == LFS_TYPE_REG) {
+        ctztag = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), sizeof(ctz)),
+                &ctz);
+        lfs_ctz_fromle32(&ctz);
+    }
+
     // delete the entry
     err = lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
             {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(tag), 0), NULL}));
@@ -3669,6 +4587,7 @@ static int lfs_rawremove(lfs_t *lfs, const char *path) {
     }
 
     lfs->mlist = dir.next;
+    lfs_alloc_releasectz(lfs, ctztag, &ctz);
     if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
         // fix orphan
         err = lfs_fs_preporphans(lfs, -1);
@@ -3772,6 +4691,16 @@ static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         lfs->mlist = &prevdir;
     }
 
+    // find the ctz list of a file we are replacing
+    struct lfs_ctz prevctz;
+    lfs_stag_t prevctztag = LFS_ERR_NOENT;
+    if (lfs->cfg->free_bitmap && prevtag != LFS_ERR_NOENT &&
+            lfs_tag_type3(prevtag) == LFS_TYPE_REG) {
+        prevctztag = lfs_dir_get(lfs, &newcwd, LFS_MKTAG(0x700, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_STRUCT, newid, sizeof(prevctz)), &prevctz);
+        lfs_ctz_fromle32(&prevctz);
+    }
+
     if (!samepair) {
         lfs_fs_prepmove(lfs, newoldid, oldcwd.pair);
     }
@@ -3804,6 +4733,7 @@ static int lfs_rawrename(lfs_t *lfs, const char *oldpath, const char *newpath) {
     }
 
     lfs->mlist = prevdir.next;
+    lfs_alloc_releasectz(lfs, prevctztag, &prevctz);
     if (prevtag != LFS_ERR_NOENT
             && lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
         // fix orphan
@@ -3902,66 +4832,529 @@ static int lfs_rawremoveattr(lfs_t *lfs, const char *path, uint8_t type) {
 #endif
 
 
-/// Filesystem operations ///
-static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
-    lfs->cfg = cfg;
-    int err = 0;
-
-    // validate that the lfs-cfg sizes were initiated properly before
-    // performing any arithmetic logics with them
-    LFS_ASSERT(lfs->cfg->read_size != 0);
-    LFS_ASSERT(lfs->cfg->prog_size != 0);
-    LFS_ASSERT(lfs->cfg->cache_size != 0);
+/// Transactions ///
+#ifdef LFS_TXN
+#ifndef LFS_READONLY
+// staged operations, removing an attribute is LFS_TXN_SETATTR with size 0x3ff
+enum {
+    LFS_TXN_WRITE   = 1,
+    LFS_TXN_FILE    = 2,
+    LFS_TXN_SETATTR = 3,
+    LFS_TXN_REMOVE  = 4,
+};
 
-    // check that block size is a multiple of cache size is a multiple
-    // of prog and read sizes
-    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->read_size == 0);
-    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->prog_size == 0);
-    LFS_ASSERT(lfs->cfg->block_size % lfs->cfg->cache_size == 0);
+// state of an entry, kept in the first operation on it
+enum {
+    LFS_TXN_EXISTS   = 0x01,    // entry exists after the operations so far
+    LFS_TXN_DELETED  = 0x02,    // entry that was there before is removed
+    LFS_TXN_CREATED  = 0x04,    // entry's create is in the attribute list
+    LFS_TXN_REPLACED = 0x08,    // entry's data is replaced
+    LFS_TXN_SYNCED   = 0x10,    // file operation's struct is committed
+};
 
-    // check that the block size is large enough to fit ctz pointers
-    LFS_ASSERT(4*lfs_npw2(0xffffffff / (lfs->cfg->block_size-2*4))
-            <= lfs->cfg->block_size);
+static int lfs_txn_stage(lfs_txn_t *txn, uint8_t type, const char *path,
+        uint8_t attr, const void *buffer, lfs_size_t size) {
+    if (txn->count == LFS_TXN_MAX) {
+        return LFS_ERR_NOMEM;
+    }
 
-    // block_cycles = 0 is no longer supported.
-    //
-    // block_cycles is the number of erase cycles before littlefs evicts
-    // metadata logs as a part of wear leveling. Suggested values are in the
-    // range of 100-1000, or set block_cycles to -1 to disable block-level
-    // wear-leveling.
-    LFS_ASSERT(lfs->cfg->block_cycles != 0);
+    struct lfs_txn_op *op = &txn->ops[txn->count];
+    op->type = type;
+    op->attr = attr;
+    op->path = path;
+    op->buffer = buffer;
+    op->size = size;
+    txn->count += 1;
+    return 0;
+}
 
+static int lfs_txn_rawbegin(lfs_t *lfs, lfs_txn_t *txn) {
+    (void)lfs;
+    txn->count = 0;
+    return 0;
+}
 
-    // setup read cache
-    if (lfs->cfg->read_buffer) {
-        lfs->rcache.buffer = lfs->cfg->read_buffer;
-    } else {
-        lfs->rcache.buffer = lfs_malloc(lfs->cfg->cache_size);
-        if (!lfs->rcache.buffer) {
-            err = LFS_ERR_NOMEM;
-            goto cleanup;
-        }
+static int lfs_txn_rawwrite(lfs_t *lfs, lfs_txn_t *txn,
+        const char *path, const void *buffer, lfs_size_t size) {
+    if (size > lfs_inline_max(lfs)) {
+        return LFS_ERR_FBIG;
     }
 
-    // setup program cache
-    if (lfs->cfg->prog_buffer) {
-        lfs->pcache.buffer = lfs->cfg->prog_buffer;
-    } else {
-        lfs->pcache.buffer = lfs_malloc(lfs->cfg->cache_size);
-        if (!lfs->pcache.buffer) {
-            err = LFS_ERR_NOMEM;
-            goto cleanup;
-        }
+    return lfs_txn_stage(txn, LFS_TXN_WRITE, path, 0, buffer, size);
+}
+
+static int lfs_txn_rawfile(lfs_t *lfs, lfs_txn_t *txn, lfs_file_t *file) {
+    (void)lfs;
+    if ((file->flags & LFS_O_WRONLY) != LFS_O_WRONLY) {
+        return LFS_ERR_BADF;
     }
 
-    // zero to avoid information leaks
-    lfs_cache_zero(lfs, &lfs->rcache);
-    lfs_cache_zero(lfs, &lfs->pcache);
+    return lfs_txn_stage(txn, LFS_TXN_FILE, NULL, 0, file, 0);
+}
 
-    // setup lookahead, must be multiple of 64-bits, 32-bit aligned
-    LFS_ASSERT(lfs->cfg->lookahead_size > 0);
-    LFS_ASSERT(lfs->cfg->lookahead_size % 8 == 0 &&
-            (uintptr_t)lfs->cfg->lookahead_buffer % 4 == 0);
+static int lfs_txn_rawsetattr(lfs_t *lfs, lfs_txn_t *txn, const char *path,
+        uint8_t type, const void *buffer, lfs_size_t size) {
+    if (size > lfs->attr_max) {
+        return LFS_ERR_NOSPC;
+    }
+
+    return lfs_txn_stage(txn, LFS_TXN_SETATTR, path, type, buffer, size);
+}
+
+static int lfs_txn_rawremoveattr(lfs_t *lfs, lfs_txn_t *txn,
+        const char *path, uint8_t type) {
+    (void)lfs;
+    return lfs_txn_stage(txn, LFS_TXN_SETATTR, path, type, NULL, 0x3ff);
+}
+
+static int lfs_txn_rawremove(lfs_t *lfs, lfs_txn_t *txn, const char *path) {
+    (void)lfs;
+    return lfs_txn_stage(txn, LFS_TXN_REMOVE, path, 0, NULL, 0);
+}
+
+// does lfs_dir_find_match find name a greater than name b, a new name is
+// created before the first name that is greater than it
+static bool lfs_txn_namegt(const char *a, const char *b) {
+    lfs_size_t alen = strlen(a);
+    lfs_size_t blen = strlen(b);
+    int res = memcmp(a, b, lfs_min(alen, blen));
+    return (res != 0) ? res > 0 : blen > alen;
+}
+
+// has a later operation undone operation i, by removing its entry, or
+// replacing its data or attribute
+static bool lfs_txn_islast(const lfs_txn_t *txn, lfs_size_t i) {
+    const struct lfs_txn_op *op = &txn->ops[i];
+    for (lfs_size_t j = i+1; j < txn->count; j++) {
+        const struct lfs_txn_op *later = &txn->ops[j];
+        if (later->item != op->item) {
+            continue;
+        }
+
+        if (later->type == LFS_TXN_REMOVE ||
+                ((op->type == LFS_TXN_SETATTR)
+                    ? (later->type == LFS_TXN_SETATTR &&
+                        later->attr == op->attr)
+                    : (later->type == LFS_TXN_WRITE ||
+                        later->type == LFS_TXN_FILE))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// move the ids of the other entries past a create or delete in the
+// attribute list, as lfs_dir_relocatingcommit moves open files
+static void lfs_txn_shift(lfs_txn_t *txn, lfs_size_t item,
+        const char *name, lfs_tag_t tag) {
+    uint16_t id = lfs_tag_id(tag);
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        struct lfs_txn_op *other = &txn->ops[i];
+        if (other->item != i || i == item) {
+            continue;
+        }
+
+        // names not created yet stay where they sort
+        bool pending = other->tag < 0 && !(other->flags & LFS_TXN_CREATED);
+        if (lfs_tag_type3(tag) == LFS_TYPE_DELETE) {
+            if (other->id > id) {
+                other->id -= 1;
+            }
+        } else if (other->id > id || (other->id == id &&
+                (!pending || !lfs_txn_namegt(name, other->path)))) {
+            other->id += 1;
+        }
+    }
+}
+
+static int lfs_txn_commitops(lfs_t *lfs, lfs_txn_t *txn) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // write out the data of staged files, they stay open and dirty so their
+    // new blocks stay in use until the ctz lists are committed
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        if (txn->ops[i].type != LFS_TXN_FILE) {
+            continue;
+        }
+
+        lfs_file_t *file = (lfs_file_t*)txn->ops[i].buffer;
+        if (file->flags & LFS_F_ERRED) {
+            // a file that has failed can't be committed
+            return LFS_ERR_INVAL;
+        }
+
+        err = lfs_file_flush(lfs, file);
+        if (err) {
+            file->flags |= LFS_F_ERRED;
+            return err;
+        }
+    }
+
+    // find the entries as they are before the commit, they must all be in
+    // the same metadata pair
+    lfs_mdir_t cwd;
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        struct lfs_txn_op *op = &txn->ops[i];
+        lfs_mdir_t m;
+        if (op->type == LFS_TXN_FILE) {
+            const lfs_file_t *file = op->buffer;
+            if (lfs_pair_isnull(file->m.pair)) {
+                return LFS_ERR_NOENT;
+            }
+
+            m = file->m;
+            op->tag = LFS_MKTAG(LFS_TYPE_REG, file->id, 0);
+            op->id = file->id;
+        } else {
+            op->tag = lfs_dir_find(lfs, &m, &op->path, &op->id);
+            if (op->tag < 0 &&
+                    !(op->tag == LFS_ERR_NOENT && op->id != 0x3ff)) {
+                return op->tag;
+            } else if (op->tag >= 0 && lfs_tag_id(op->tag) == 0x3ff) {
+                // not root
+                return LFS_ERR_INVAL;
+            } else if (op->tag < 0 && strlen(op->path) > lfs->name_max) {
+                return LFS_ERR_NAMETOOLONG;
+            }
+
+            if (op->tag >= 0) {
+                op->id = lfs_tag_id(op->tag);
+            }
+        }
+
+        if (i == 0) {
+            cwd = m;
+        } else if (lfs_pair_cmp(m.pair, cwd.pair) != 0) {
+            return LFS_ERR_INVAL;
+        }
+
+        // operations on the same entry share its first operation's state
+        op->item = i;
+        op->flags = 0;
+        for (lfs_size_t j = 0; j < i; j++) {
+            const struct lfs_txn_op *other = &txn->ops[j];
+            if (other->item == j && ((op->tag >= 0)
+                    ? (other->tag >= 0 &&
+                        lfs_tag_id(other->tag) == lfs_tag_id(op->tag))
+                    : (other->tag < 0 &&
+                        strcmp(other->path, op->path) == 0))) {
+                op->item = j;
+                break;
+            }
+        }
+
+        if (op->item == i && op->tag >= 0) {
+            op->flags = LFS_TXN_EXISTS;
+
+            // find the ctz list the commit may replace or remove
+            op->otag = LFS_ERR_NOENT;
+            if (lfs->cfg->free_bitmap &&
+                    lfs_tag_type3(op->tag) == LFS_TYPE_REG) {
+                struct lfs_ctz octz;
+                op->otag = lfs_dir_get(lfs, &m, LFS_MKTAG(0x700, 0x3ff, 0),
+                        LFS_MKTAG(LFS_TYPE_STRUCT, op->id, sizeof(octz)),
+                        &octz);
+                lfs_ctz_fromle32(&octz);
+                op->ohead = octz.head;
+                op->osize = octz.size;
+            }
+        }
+    }
+
+    // check the operations in order
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        const struct lfs_txn_op *op = &txn->ops[i];
+        struct lfs_txn_op *item = &txn->ops[op->item];
+        bool isdir = item->tag >= 0 &&
+                lfs_tag_type3(item->tag) == LFS_TYPE_DIR;
+        if (op->type != LFS_TXN_WRITE && !(item->flags & LFS_TXN_EXISTS)) {
+            return LFS_ERR_NOENT;
+        } else if (op->type == LFS_TXN_FILE &&
+                (item->flags & LFS_TXN_DELETED)) {
+            return LFS_ERR_NOENT;
+        } else if ((op->type == LFS_TXN_WRITE ||
+                op->type == LFS_TXN_REMOVE) && isdir) {
+            return LFS_ERR_ISDIR;
+        }
+
+        if (op->type == LFS_TXN_WRITE) {
+            item->flags |= LFS_TXN_EXISTS;
+        } else if (op->type == LFS_TXN_REMOVE) {
+            item->flags &= ~LFS_TXN_EXISTS;
+            if (item->tag >= 0) {
+                item->flags |= LFS_TXN_DELETED;
+            }
+        }
+    }
+
+    // build the attribute list, entry by entry, each entry's id is where
+    // the creates and deletes before it in the list leave it
+    lfs_size_t count = 0;
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        struct lfs_txn_op *item = &txn->ops[i];
+        if (item->item != i) {
+            continue;
+        }
+
+        const char *name = NULL;
+        for (lfs_size_t j = i; j < txn->count; j++) {
+            if (txn->ops[j].item == i && txn->ops[j].type == LFS_TXN_WRITE) {
+                name = txn->ops[j].path;
+            }
+        }
+
+        if (item->flags & LFS_TXN_DELETED) {
+            txn->attrs[count++] = (struct lfs_mattr){
+                    LFS_MKTAG(LFS_TYPE_DELETE, item->id, 0), NULL};
+            lfs_txn_shift(txn, i, name, txn->attrs[count-1].tag);
+        }
+
+        if (!(item->flags & LFS_TXN_EXISTS)) {
+            continue;
+        }
+
+        bool create = item->tag < 0 || (item->flags & LFS_TXN_DELETED);
+        if (create) {
+            item->flags |= LFS_TXN_CREATED;
+            txn->attrs[count++] = (struct lfs_mattr){
+                    LFS_MKTAG(LFS_TYPE_CREATE, item->id, 0), NULL};
+            lfs_txn_shift(txn, i, name, txn->attrs[count-1].tag);
+            txn->attrs[count++] = (struct lfs_mattr){
+                    LFS_MKTAG(LFS_TYPE_REG, item->id, strlen(name)), name};
+        }
+
+        bool data = false;
+        for (lfs_size_t j = i; j < txn->count; j++) {
+            struct lfs_txn_op *op = &txn->ops[j];
+            if (op->item != i || !lfs_txn_islast(txn, j)) {
+                continue;
+            }
+
+            if (op->type == LFS_TXN_WRITE) {
+                txn->attrs[count++] = (struct lfs_mattr){
+                        LFS_MKTAG(LFS_TYPE_INLINESTRUCT, item->id, op->size),
+                        op->buffer};
+                data = true;
+            } else if (op->type == LFS_TXN_FILE) {
+                const lfs_file_t *file = op->buffer;
+                if (!(file->flags & LFS_F_DIRTY)) {
+                    continue;
+                }
+
+                // the file's struct and attributes, as lfs_file_rawsync
+                // commits them
+                if (file->flags & LFS_F_INLINE) {
+                    txn->attrs[count++] = (struct lfs_mattr){
+                            LFS_MKTAG(LFS_TYPE_INLINESTRUCT, item->id,
+                                file->ctz.size),
+                            file->cache.buffer};
+                } else {
+                    op->ctz[0] = lfs_tole32(file->ctz.head);
+                    op->ctz[1] = lfs_tole32(file->ctz.size);
+                    txn->attrs[count++] = (struct lfs_mattr){
+                            LFS_MKTAG(LFS_TYPE_CTZSTRUCT, item->id,
+                                sizeof(op->ctz)),
+                            op->ctz};
+                }
+                txn->attrs[count++] = (struct lfs_mattr){
+                        LFS_MKTAG(LFS_FROM_USERATTRS, item->id,
+                            file->cfg->attr_count),
+                        file->cfg->attrs};
+                op->flags |= LFS_TXN_SYNCED;
+                data = true;
+            } else if (op->type == LFS_TXN_SETATTR) {
+                txn->attrs[count++] = (struct lfs_mattr){
+                        LFS_MKTAG(LFS_TYPE_USERATTR + op->attr, item->id,
+                            op->size),
+                        op->buffer};
+            }
+        }
+
+        if (data) {
+            item->flags |= LFS_TXN_REPLACED;
+        } else if (create) {
+            txn->attrs[count++] = (struct lfs_mattr){
+                    LFS_MKTAG(LFS_TYPE_INLINESTRUCT, item->id, 0), NULL};
+        }
+    }
+    LFS_ASSERT(count <= 4*LFS_TXN_MAX);
+
+    // one commit for everything
+    if (count > 0) {
+        err = lfs_dir_commit(lfs, &cwd, txn->attrs, count);
+        if (err) {
+            for (lfs_size_t i = 0; i < txn->count; i++) {
+                if (txn->ops[i].flags & LFS_TXN_SYNCED) {
+                    ((lfs_file_t*)txn->ops[i].buffer)->flags |= LFS_F_ERRED;
+                }
+            }
+            return err;
+        }
+    }
+
+    // committed files are clean, and replaced or removed ctz lists free
+    for (lfs_size_t i = 0; i < txn->count; i++) {
+        struct lfs_txn_op *op = &txn->ops[i];
+        if (op->flags & LFS_TXN_SYNCED) {
+            lfs_file_t *file = (lfs_file_t*)op->buffer;
+            file->flags &= ~LFS_F_DIRTY;
+            file->committed = (lfs_size_t)-1;
+        }
+
+        if (op->item == i && op->tag >= 0 &&
+                (op->flags & (LFS_TXN_DELETED | LFS_TXN_REPLACED))) {
+            lfs_alloc_releasectz(lfs, op->otag,
+                    &(struct lfs_ctz){op->ohead, op->osize});
+        }
+    }
+
+    return 0;
+}
+
+static int lfs_txn_rawcommit(lfs_t *lfs, lfs_txn_t *txn) {
+    // the operations are used up either way, paths have been reduced to
+    // names and entries found
+    int err = lfs_txn_commitops(lfs, txn);
+    txn->count = 0;
+    return err;
+}
+#endif
+#endif
+
+
+/// Filesystem operations ///
+static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
+    lfs->cfg = cfg;
+    int err = 0;
+
+    // validate that the lfs-cfg sizes were initiated properly before
+    // performing any arithmetic logics with them
+    LFS_ASSERT(lfs->cfg->read_size != 0);
+    LFS_ASSERT(lfs->cfg->prog_size != 0);
+    LFS_ASSERT(lfs->cfg->cache_size != 0);
+
+    // check that block size is a multiple of cache size is a multiple
+    // of prog and read sizes
+    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->read_size == 0);
+    LFS_ASSERT(lfs->cfg->cache_size % lfs->cfg->prog_size == 0);
+    LFS_ASSERT(lfs->cfg->block_size % lfs->cfg->cache_size == 0);
+
+    // check that the block size is large enough to fit ctz pointers
+    LFS_ASSERT(4*lfs_npw2(0xffffffff / (lfs->cfg->block_size-2*4))
+            <= lfs->cfg->block_size);
+
+    // block_cycles = 0 is no longer supported.
+    //
+    // block_cycles is the number of erase cycles before littlefs evicts
+    // metadata logs as a part of wear leveling. Suggested values are in the
+    // range of 100-1000, or set block_cycles to -1 to disable block-level
+    // wear-leveling.
+    LFS_ASSERT(lfs->cfg->block_cycles != 0);
+
+
+    // setup read cache
+    if (lfs->cfg->read_buffer) {
+        lfs->rcache.buffer = lfs->cfg->read_buffer;
+    } else {
+        lfs->rcache.buffer = lfs_malloc(lfs->cfg->cache_size);
+        if (!lfs->rcache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // setup program cache
+    if (lfs->cfg->prog_buffer) {
+        lfs->pcache.buffer = lfs->cfg->prog_buffer;
+    } else {
+        lfs->pcache.buffer = lfs_malloc(lfs->cfg->cache_size);
+        if (!lfs->pcache.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+
+    // zero to avoid information leaks
+    lfs_cache_zero(lfs, &lfs->rcache);
+    lfs_cache_zero(lfs, &lfs->pcache);
+
+    // setup read cache slots, slot data follows the slot array
+    lfs->rslots = NULL;
+    lfs->rslot_clock = 0;
+    lfs->rcache_hits = 0;
+    lfs->rcache_misses = 0;
+    if (lfs->cfg->rcache_slots) {
+        lfs->rslot_size = lfs->cfg->rcache_size;
+        if (!lfs->rslot_size) {
+            lfs->rslot_size = lfs->cfg->cache_size;
+        }
+        LFS_ASSERT(lfs->rslot_size % lfs->cfg->read_size == 0);
+        LFS_ASSERT((uintptr_t)lfs->cfg->rcache_buffer % 4 == 0);
+
+        if (lfs->cfg->rcache_buffer) {
+            lfs->rslots = lfs->cfg->rcache_buffer;
+        } else {
+            lfs->rslots = lfs_malloc(LFS_RCACHE_BUFFER_SIZE(
+                    lfs->cfg->rcache_slots, lfs->rslot_size));
+            if (!lfs->rslots) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        uint8_t *buffer = (uint8_t*)&lfs->rslots[lfs->cfg->rcache_slots];
+        for (lfs_size_t i = 0; i < lfs->cfg->rcache_slots; i++) {
+            lfs->rslots[i].cache.buffer = &buffer[i*lfs->rslot_size];
+            lfs->rslots[i].used = 0;
+            lfs_cache_drop(lfs, &lfs->rslots[i].cache);
+        }
+    }
+
+    // setup dentry cache
+    lfs->dcache = NULL;
+    lfs->dcache_clock = 0;
+    lfs->dcache_hits = 0;
+    lfs->dcache_misses = 0;
+
+    // no mount checkpoint yet
+    lfs->checkpoint_stale = true;
+    lfs->checkpoint_used = false;
+
+    // no erase counts yet, lfs_mount loads them
+    lfs->wear = NULL;
+    lfs->wear_erases = 0;
+
+    // nothing programmed yet
+    lfs->unsynced = LFS_BLOCK_NULL;
+
+    // garbage collection starts at the superblock pair
+    lfs->gc_pair[0] = 0;
+    lfs->gc_pair[1] = 1;
+    if (lfs->cfg->dcache_size) {
+        LFS_ASSERT((uintptr_t)lfs->cfg->dcache_buffer % 4 == 0);
+        if (lfs->cfg->dcache_buffer) {
+            lfs->dcache = lfs->cfg->dcache_buffer;
+        } else {
+            lfs->dcache = lfs_malloc(
+                    lfs->cfg->dcache_size*sizeof(lfs_dentry_t));
+            if (!lfs->dcache) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        lfs_dcache_clear(lfs);
+    }
+
+    // setup lookahead, must be multiple of 64-bits, 32-bit aligned
+    LFS_ASSERT(lfs->cfg->lookahead_size > 0);
+    LFS_ASSERT(lfs->cfg->lookahead_size % 8 == 0 &&
+            (uintptr_t)lfs->cfg->lookahead_buffer % 4 == 0);
     if (lfs->cfg->lookahead_buffer) {
         lfs->free.buffer = lfs->cfg->lookahead_buffer;
     } else {
@@ -3972,6 +5365,29 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
+#ifndef LFS_READONLY
+    // setup erase counts, picking the least worn block needs the free
+    // bitmap, a lookahead window only sees part of the device
+    if (lfs->cfg->wear_type) {
+        if (!lfs->cfg->free_bitmap) {
+            err = LFS_ERR_INVAL;
+            goto cleanup;
+        }
+
+        if (lfs->cfg->wear_buffer) {
+            lfs->wear = lfs->cfg->wear_buffer;
+        } else {
+            lfs->wear = lfs_malloc(2*lfs->cfg->block_count);
+            if (!lfs->wear) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+        }
+
+        memset(lfs->wear, 0, 2*lfs->cfg->block_count);
+    }
+#endif
+
     // check that the size limits are sane
     LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
     lfs->name_max = lfs->cfg->name_max;
@@ -3993,6 +5409,10 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
 
     LFS_ASSERT(lfs->cfg->metadata_max <= lfs->cfg->block_size);
 
+    // free bitmap and pending bitmap must both fit in the lookahead buffer
+    LFS_ASSERT(!lfs->cfg->free_bitmap ||
+            lfs->cfg->lookahead_size >= 8*((lfs->cfg->block_count+31)/32));
+
     // setup default state
     lfs->root[0] = LFS_BLOCK_NULL;
     lfs->root[1] = LFS_BLOCK_NULL;
@@ -4022,10 +5442,22 @@ static int lfs_deinit(lfs_t *lfs) {
         lfs_free(lfs->pcache.buffer);
     }
 
+    if (!lfs->cfg->rcache_buffer) {
+        lfs_free(lfs->rslots);
+    }
+
+    if (!lfs->cfg->dcache_buffer) {
+        lfs_free(lfs->dcache);
+    }
+
     if (!lfs->cfg->lookahead_buffer) {
         lfs_free(lfs->free.buffer);
     }
 
+    if (!lfs->cfg->wear_buffer) {
+        lfs_free(lfs->wear);
+    }
+
     return 0;
 }
 
@@ -4095,6 +5527,85 @@ cleanup:
 }
 #endif
 
+// check the mount checkpoint against the metadata pairs after the superblock
+// pair, returns true and adds in their gstate if none of them have changed
+static int lfs_checkpoint_trust(lfs_t *lfs, const lfs_mdir_t *root) {
+    lfs_gstate_t gstate;
+    lfs_stag_t tag = lfs_dir_getslice(lfs, root, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_USERATTR + lfs->cfg->checkpoint_type, 0, 0),
+            0, &gstate, sizeof(gstate));
+    if (tag < 0) {
+        return (tag == LFS_ERR_NOENT) ? false : tag;
+    }
+
+    lfs_size_t size = lfs_tag_size(tag);
+    if (size < sizeof(gstate) ||
+            (size - sizeof(gstate)) % sizeof(struct lfs_checkpoint) != 0) {
+        return false;
+    }
+    lfs_gstate_fromle32(&gstate);
+
+    // the tail list must still start where it did, pairs after that can
+    // only be unlinked or relocated by committing to the pair before them
+    lfs_size_t count = (size - sizeof(gstate)) / sizeof(struct lfs_checkpoint);
+    for (lfs_size_t i = 0; i < count; i++) {
+        struct lfs_checkpoint ckpt;
+        tag = lfs_dir_getslice(lfs, root, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_USERATTR + lfs->cfg->checkpoint_type, 0, 0),
+                sizeof(gstate) + i*sizeof(ckpt), &ckpt, sizeof(ckpt));
+        if (tag < 0) {
+            return tag;
+        }
+        lfs_checkpoint_fromle32(&ckpt);
+
+        if ((i == 0 && !lfs_pair_sync(root->tail, ckpt.pair)) ||
+                ckpt.pair[0] >= lfs->cfg->block_count ||
+                ckpt.pair[1] >= lfs->cfg->block_count ||
+                ckpt.off < sizeof(uint32_t) ||
+                ckpt.off > lfs->cfg->block_size) {
+            return false;
+        }
+
+        // compacted since? the revision count changes
+        uint32_t revs[2];
+        for (int j = 0; j < 2; j++) {
+            int err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, sizeof(revs[j]),
+                    ckpt.pair[j], 0, &revs[j], sizeof(revs[j]));
+            if (err) {
+                return err;
+            }
+            revs[j] = lfs_fromle32(revs[j]);
+        }
+
+        if (revs[0] != ckpt.rev || lfs_scmp(revs[1], revs[0]) >= 0) {
+            return false;
+        }
+
+        // committed to since? a valid tag follows the last commit
+        if (ckpt.off + sizeof(lfs_tag_t) <= lfs->cfg->block_size) {
+            lfs_tag_t ntag;
+            int err = lfs_bd_read(lfs,
+                    NULL, &lfs->rcache, sizeof(ntag),
+                    ckpt.pair[0], ckpt.off, &ntag, sizeof(ntag));
+            if (err) {
+                return err;
+            }
+
+            if (lfs_tag_isvalid(lfs_frombe32(ntag) ^ ckpt.etag)) {
+                return false;
+            }
+        }
+    }
+
+    if (!count && !lfs_pair_isnull(root->tail)) {
+        return false;
+    }
+
+    lfs_gstate_xor(&lfs->gstate, &gstate);
+    return true;
+}
+
 static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
     int err = lfs_init(lfs, cfg);
     if (err) {
@@ -4199,6 +5710,18 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
                 err = LFS_ERR_INVAL;
                 goto cleanup;
             }
+
+            // erase counts, zero if they haven't been saved yet
+            if (lfs->wear) {
+                tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+                        LFS_MKTAG(LFS_TYPE_USERATTR + lfs->cfg->wear_type,
+                            0, 2*lfs->cfg->block_count),
+                        lfs->wear);
+                if (tag < 0 && tag != LFS_ERR_NOENT) {
+                    err = tag;
+                    goto cleanup;
+                }
+            }
         }
 
         // has gstate?
@@ -4206,6 +5729,22 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
         if (err) {
             goto cleanup;
         }
+
+        // the rest of the metadata unchanged since the checkpoint?
+        if (cycle == 1 && lfs->cfg->checkpoint_type &&
+                !lfs_pair_isnull(lfs->root)) {
+            int res = lfs_checkpoint_trust(lfs, &dir);
+            if (res < 0) {
+                err = res;
+                goto cleanup;
+            }
+
+            if (res) {
+                lfs->checkpoint_stale = false;
+                lfs->checkpoint_used = true;
+                break;
+            }
+        }
     }
 
     // found superblock?
@@ -4228,15 +5767,25 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
     // boots, we start the allocator at a random location
     lfs->free.off = lfs->seed % lfs->cfg->block_count;
     lfs_alloc_drop(lfs);
+    lfs_alloc_ack(lfs);
 
     return 0;
 
 cleanup:
-    lfs_rawunmount(lfs);
+    lfs_deinit(lfs);
     return err;
 }
 
 static int lfs_rawunmount(lfs_t *lfs) {
+#ifndef LFS_READONLY
+    // let the next mount skip the metadata scan
+    int err = lfs_fs_rawcheckpoint(lfs);
+    if (err) {
+        lfs_deinit(lfs);
+        return err;
+    }
+#endif
+
     return lfs_deinit(lfs);
 }
 
@@ -4319,7 +5868,12 @@ int lfs_fs_rawtraverse(lfs_t *lfs,
             continue;
         }
 
-        if ((f->flags & LFS_F_DIRTY) && !(f->flags & LFS_F_INLINE)) {
+        // the file's ctz may no longer be on disk, if the file was removed,
+        // renamed over, or synced through another handle, yet this handle
+        // still reads it and builds on it when rewriting, a file outlined
+        // since its last flush still holds its inline struct, which has no
+        // blocks
+        if (!(f->flags & LFS_F_INLINE) && f->ctz.head != LFS_BLOCK_INLINE) {
             int err = lfs_ctz_traverse(lfs, &f->cache, &lfs->rcache,
                     f->ctz.head, f->ctz.size, cb, data);
             if (err) {
@@ -4558,66 +6112,292 @@ restart:
                                 "-> {0x%"PRIx32", 0x%"PRIx32"}",
                                 pdir.tail[0], pdir.tail[1], pair[0], pair[1]);
 
-                        // fix pending move in this pair? this looks like an
-                        // optimization but is in fact _required_ since
-                        // relocating may outdate the move.
-                        uint16_t moveid = 0x3ff;
-                        if (lfs_gstate_hasmovehere(&lfs->gstate, pdir.pair)) {
-                            moveid = lfs_tag_id(lfs->gstate.tag);
-                            LFS_DEBUG("Fixing move while fixing orphans "
-                                    "{0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16"\n",
-                                    pdir.pair[0], pdir.pair[1], moveid);
-                            lfs_fs_prepmove(lfs, 0x3ff, NULL);
-                        }
+                        // fix pending move in this pair? this looks like an
+                        // optimization but is in fact _required_ since
+                        // relocating may outdate the move.
+                        uint16_t moveid = 0x3ff;
+                        if (lfs_gstate_hasmovehere(&lfs->gstate, pdir.pair)) {
+                            moveid = lfs_tag_id(lfs->gstate.tag);
+                            LFS_DEBUG("Fixing move while fixing orphans "
+                                    "{0x%"PRIx32", 0x%"PRIx32"} 0x%"PRIx16"\n",
+                                    pdir.pair[0], pdir.pair[1], moveid);
+                            lfs_fs_prepmove(lfs, 0x3ff, NULL);
+                        }
+
+                        lfs_pair_tole32(pair);
+                        state = lfs_dir_orphaningcommit(lfs, &pdir, LFS_MKATTRS(
+                                {LFS_MKTAG_IF(moveid != 0x3ff,
+                                    LFS_TYPE_DELETE, moveid, 0), NULL},
+                                {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8),
+                                    pair}));
+                        lfs_pair_fromle32(pair);
+                        if (state < 0) {
+                            return state;
+                        }
+
+                        found += 1;
+
+                        // did our commit create more orphans?
+                        if (state == LFS_OK_ORPHANED) {
+                            goto restart;
+                        }
+
+                        // refetch tail
+                        continue;
+                    }
+                }
+            }
+
+            pdir = dir;
+        }
+    }
+
+    // mark orphans as fixed
+    return lfs_fs_preporphans(lfs, -lfs_min(
+            lfs_gstate_getorphans(&lfs->gstate),
+            found));
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_forceconsistency(lfs_t *lfs) {
+    int err = lfs_fs_demove(lfs);
+    if (err) {
+        return err;
+    }
+
+    err = lfs_fs_deorphan(lfs, true);
+    if (err) {
+        return err;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_rawmkconsistent(lfs_t *lfs) {
+    // lfs_fs_forceconsistency does most of the work here
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // do we have any pending gstate?
+    lfs_gstate_t delta = {0};
+    lfs_gstate_xor(&delta, &lfs->gdisk);
+    lfs_gstate_xor(&delta, &lfs->gstate);
+    if (!lfs_gstate_iszero(&delta)) {
+        // lfs_dir_commit will implicitly write out any pending gstate
+        lfs_mdir_t root;
+        err = lfs_dir_fetch(lfs, &root, lfs->root);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+// metadata logs past this are compacted in the background, see compact_thresh
+static lfs_size_t lfs_fs_compactthresh(lfs_t *lfs) {
+    if (lfs->cfg->compact_thresh) {
+        return lfs->cfg->compact_thresh;
+    }
+
+    lfs_size_t size = (lfs->cfg->metadata_max)
+            ? lfs->cfg->metadata_max
+            : lfs->cfg->block_size;
+    return size - size/8;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_rawcheckpoint(lfs_t *lfs) {
+    // keep to a small part of the superblock pair, which can't relocate
+    lfs_size_t limit = lfs_min(lfs->attr_max, ((lfs->cfg->metadata_max)
+            ? lfs->cfg->metadata_max
+            : lfs->cfg->block_size)/4);
+    bool ckpt = lfs->cfg->checkpoint_type && lfs->checkpoint_stale;
+    bool wear = lfs->wear && lfs->wear_erases &&
+            2*lfs->cfg->block_count <= limit;
+    if (!ckpt && !wear) {
+        return 0;
+    }
+
+    // record each metadata pair after the superblock pair, as it is now
+    struct {
+        lfs_gstate_t gstate;
+        struct lfs_checkpoint pairs[LFS_CHECKPOINT_MAX];
+    } record = {.gstate = {0}};
+    lfs_mdir_t root;
+    int err = lfs_dir_fetch(lfs, &root, lfs->root);
+    if (err) {
+        return err;
+    }
+
+    lfs_size_t count = 0;
+    lfs_mdir_t dir = root;
+    while (ckpt && !lfs_pair_isnull(dir.tail)) {
+        if (count >= lfs_min(LFS_CHECKPOINT_MAX,
+                (limit - sizeof(record.gstate)) / sizeof(record.pairs[0]))) {
+            // too many to record, mount will have to scan them
+            ckpt = false;
+            break;
+        }
+
+        err = lfs_dir_fetch(lfs, &dir, dir.tail);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_getgstate(lfs, &dir, &record.gstate);
+        if (err) {
+            return err;
+        }
+
+        struct lfs_checkpoint *entry = &record.pairs[count];
+        entry->pair[0] = dir.pair[0];
+        entry->pair[1] = dir.pair[1];
+        entry->rev = dir.rev;
+        entry->off = dir.off;
+        entry->etag = dir.etag;
+        lfs_checkpoint_tole32(entry);
+        count += 1;
+    }
+    lfs_gstate_tole32(&record.gstate);
+
+    // already written? comparing is cheaper than committing
+    lfs_size_t size = sizeof(record.gstate) + count*sizeof(record.pairs[0]);
+    bool same = true;
+    for (lfs_off_t off = 0; ckpt && same && off < size;
+            off += sizeof(struct lfs_checkpoint)) {
+        struct lfs_checkpoint stored;
+        lfs_size_t diff = lfs_min(size - off, sizeof(stored));
+        lfs_stag_t tag = lfs_dir_getslice(lfs, &root,
+                LFS_MKTAG(0x7ff, 0x3ff, 0),
+                LFS_MKTAG(LFS_TYPE_USERATTR + lfs->cfg->checkpoint_type, 0, 0),
+                off, &stored, diff);
+        if (tag < 0 && tag != LFS_ERR_NOENT) {
+            return tag;
+        }
+
+        same = (tag >= 0 && lfs_tag_size(tag) == size &&
+                memcmp((uint8_t*)&record + off, &stored, diff) == 0);
+    }
+    ckpt = ckpt && !same;
 
-                        lfs_pair_tole32(pair);
-                        state = lfs_dir_orphaningcommit(lfs, &pdir, LFS_MKATTRS(
-                                {LFS_MKTAG_IF(moveid != 0x3ff,
-                                    LFS_TYPE_DELETE, moveid, 0), NULL},
-                                {LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8),
-                                    pair}));
-                        lfs_pair_fromle32(pair);
-                        if (state < 0) {
-                            return state;
-                        }
+    // the erase counts go in the same commit
+    struct lfs_mattr attrs[2];
+    int attrcount = 0;
+    lfs_size_t commitsize = 0;
+    if (ckpt) {
+        attrs[attrcount].tag = LFS_MKTAG(
+                LFS_TYPE_USERATTR + lfs->cfg->checkpoint_type, 0, size);
+        attrs[attrcount].buffer = &record;
+        attrcount += 1;
+        commitsize += sizeof(lfs_tag_t) + size;
+    }
 
-                        found += 1;
+    lfs_size_t erases = lfs->wear_erases;
+    if (wear) {
+        attrs[attrcount].tag = LFS_MKTAG(
+                LFS_TYPE_USERATTR + lfs->cfg->wear_type,
+                0, 2*lfs->cfg->block_count);
+        attrs[attrcount].buffer = lfs->wear;
+        attrcount += 1;
+        commitsize += sizeof(lfs_tag_t) + 2*lfs->cfg->block_count;
+    }
 
-                        // did our commit create more orphans?
-                        if (state == LFS_OK_ORPHANED) {
-                            goto restart;
-                        }
+    if (attrcount) {
+        // compact now, in the background, rather than leave the superblock
+        // pair for the next write to compact
+        if (root.off + commitsize > lfs_fs_compactthresh(lfs)) {
+            root.erased = false;
+        }
 
-                        // refetch tail
-                        continue;
-                    }
-                }
-            }
+        lfs_block_t tail[2] = {root.tail[0], root.tail[1]};
+        err = lfs_dir_commit(lfs, &root, attrs, attrcount);
+        if (err == LFS_ERR_NOSPC) {
+            // no room for it, mount will have to scan
+            lfs_cache_drop(lfs, &lfs->pcache);
+            lfs->checkpoint_stale = false;
+            lfs->wear_erases = 0;
+            return 0;
+        } else if (err) {
+            return err;
+        }
 
-            pdir = dir;
+        // erases while committing, compacting, may not be in the counts
+        if (wear) {
+            lfs->wear_erases -= erases;
+        }
+
+        // the commit may have split the superblock pair, leaving a new pair
+        // out of the checkpoint
+        if (!lfs_pair_sync(root.tail, tail)) {
+            return 0;
         }
     }
 
-    // mark orphans as fixed
-    return lfs_fs_preporphans(lfs, -lfs_min(
-            lfs_gstate_getorphans(&lfs->gstate),
-            found));
+    lfs->checkpoint_stale = false;
+    return 0;
 }
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_fs_forceconsistency(lfs_t *lfs) {
-    int err = lfs_fs_demove(lfs);
-    if (err) {
-        return err;
+static int lfs_fs_rawgc(lfs_t *lfs) {
+    // finish anything a power loss left behind first
+    if (lfs_gstate_hasmove(&lfs->gdisk) ||
+            lfs_gstate_hasorphans(&lfs->gstate)) {
+        int err = lfs_fs_forceconsistency(lfs);
+        if (err) {
+            return err;
+        }
+
+        return 1;
     }
 
-    err = lfs_fs_deorphan(lfs, true);
+    lfs_mdir_t mdir;
+    int err = lfs_dir_fetch(lfs, &mdir, lfs->gc_pair);
     if (err) {
         return err;
     }
 
-    return 0;
+    // compact if the log is past the threshold, or can't be appended to
+    if (lfs->cfg->compact_thresh != (lfs_size_t)-1 &&
+            (!mdir.erased || mdir.off > lfs_fs_compactthresh(lfs))) {
+        // the easiest way to compact is to mark the mdir as unerased and
+        // commit nothing
+        lfs_block_t pair[2] = {mdir.pair[0], mdir.pair[1]};
+        mdir.erased = false;
+        err = lfs_dir_commit(lfs, &mdir, NULL, 0);
+        if (err) {
+            return err;
+        }
+
+        if (!lfs_pair_sync(lfs->gc_pair, pair)) {
+            // relocated or dropped, start again
+            return 1;
+        }
+    }
+
+    if (lfs_pair_isnull(mdir.tail)) {
+        lfs->gc_pair[0] = 0;
+        lfs->gc_pair[1] = 1;
+        return 0;
+    }
+
+    lfs->gc_pair[0] = mdir.tail[0];
+    lfs->gc_pair[1] = mdir.tail[1];
+    return 1;
 }
 #endif
 
@@ -4629,6 +6409,21 @@ static int lfs_fs_size_count(void *p, lfs_block_t block) {
 }
 
 static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
+#ifndef LFS_READONLY
+    if (lfs->cfg->free_bitmap) {
+        // the free bitmap keeps count of the blocks in use, which includes
+        // blocks waiting for a rebuild to reclaim them
+        if (!lfs->free.size) {
+            int err = lfs_alloc_scan(lfs);
+            if (err) {
+                return err;
+            }
+        }
+
+        return lfs->free.used;
+    }
+#endif
+
     lfs_size_t size = 0;
     int err = lfs_fs_rawtraverse(lfs, lfs_fs_size_count, &size, false);
     if (err) {
@@ -4638,6 +6433,61 @@ static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs) {
     return size;
 }
 
+#ifndef LFS_READONLY
+static int lfs_fs_checkfree_mark(void *p, lfs_block_t block) {
+    lfs_t *lfs = (lfs_t*)p;
+    if (block >= lfs->cfg->block_count) {
+        return LFS_ERR_CORRUPT;
+    }
+
+    if (!(lfs->free.buffer[block / 32] & (1U << (block % 32)))) {
+        LFS_ERROR("Block 0x%"PRIx32" in use but marked free", block);
+        return LFS_ERR_CORRUPT;
+    }
+
+    lfs_alloc_pending(lfs)[block / 32] |= 1U << (block % 32);
+    return 0;
+}
+
+static lfs_ssize_t lfs_fs_rawcheckfree(lfs_t *lfs) {
+    if (!lfs->cfg->free_bitmap || !lfs->free.size) {
+        // nothing to check
+        return 0;
+    }
+
+    // nothing is in flight between operations, so the pending bitmap is
+    // free to record which blocks the traversal finds
+    lfs_alloc_ack(lfs);
+    int err = lfs_fs_rawtraverse(lfs, lfs_fs_checkfree_mark, lfs, true);
+    if (err) {
+        lfs_alloc_ack(lfs);
+        return err;
+    }
+
+    // count blocks marked in use that the filesystem doesn't reference
+    lfs_size_t leaked = 0;
+    lfs_block_t used = 0;
+    const uint32_t *found = lfs_alloc_pending(lfs);
+    for (lfs_block_t b = 0; b < lfs->cfg->block_count; b++) {
+        if (lfs->free.buffer[b / 32] & (1U << (b % 32))) {
+            used += 1;
+            if (!(found[b / 32] & (1U << (b % 32)))) {
+                leaked += 1;
+            }
+        }
+    }
+
+    lfs_alloc_ack(lfs);
+    if (used != lfs->free.used) {
+        LFS_ERROR("Blocks in use %"PRIu32" but counted %"PRIu32,
+                used, lfs->free.used);
+        return LFS_ERR_CORRUPT;
+    }
+
+    return leaked;
+}
+#endif
+
 #ifdef LFS_MIGRATE
 ////// Migration from littelfs v1 below this //////
 
@@ -5321,9 +7171,11 @@ int lfs_format(lfs_t *lfs, const struct lfs_config *cfg) {
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
             cfg->name_max, cfg->file_max, cfg->attr_max);
+    LFS_PROF_BEGIN("lfs_format");
 
     err = lfs_rawformat(lfs, cfg);
 
+    LFS_PROF_END("lfs_format");
     LFS_TRACE("lfs_format -> %d", err);
     LFS_UNLOCK(cfg);
     return err;
@@ -5351,9 +7203,11 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *cfg) {
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
             cfg->name_max, cfg->file_max, cfg->attr_max);
+    LFS_PROF_BEGIN("lfs_mount");
 
     err = lfs_rawmount(lfs, cfg);
 
+    LFS_PROF_END("lfs_mount");
     LFS_TRACE("lfs_mount -> %d", err);
     LFS_UNLOCK(cfg);
     return err;
@@ -5365,9 +7219,11 @@ int lfs_unmount(lfs_t *lfs) {
         return err;
     }
     LFS_TRACE("lfs_unmount(%p)", (void*)lfs);
+    LFS_PROF_BEGIN("lfs_unmount");
 
     err = lfs_rawunmount(lfs);
 
+    LFS_PROF_END("lfs_unmount");
     LFS_TRACE("lfs_unmount -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5380,9 +7236,11 @@ int lfs_remove(lfs_t *lfs, const char *path) {
         return err;
     }
     LFS_TRACE("lfs_remove(%p, \"%s\")", (void*)lfs, path);
+    LFS_PROF_BEGIN("lfs_remove");
 
     err = lfs_rawremove(lfs, path);
 
+    LFS_PROF_END("lfs_remove");
     LFS_TRACE("lfs_remove -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5396,9 +7254,11 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
         return err;
     }
     LFS_TRACE("lfs_rename(%p, \"%s\", \"%s\")", (void*)lfs, oldpath, newpath);
+    LFS_PROF_BEGIN("lfs_rename");
 
     err = lfs_rawrename(lfs, oldpath, newpath);
 
+    LFS_PROF_END("lfs_rename");
     LFS_TRACE("lfs_rename -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5411,9 +7271,11 @@ int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
         return err;
     }
     LFS_TRACE("lfs_stat(%p, \"%s\", %p)", (void*)lfs, path, (void*)info);
+    LFS_PROF_BEGIN("lfs_stat");
 
     err = lfs_rawstat(lfs, path, info);
 
+    LFS_PROF_END("lfs_stat");
     LFS_TRACE("lfs_stat -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5427,9 +7289,11 @@ lfs_ssize_t lfs_getattr(lfs_t *lfs, const char *path,
     }
     LFS_TRACE("lfs_getattr(%p, \"%s\", %"PRIu8", %p, %"PRIu32")",
             (void*)lfs, path, type, buffer, size);
+    LFS_PROF_BEGIN("lfs_getattr");
 
     lfs_ssize_t res = lfs_rawgetattr(lfs, path, type, buffer, size);
 
+    LFS_PROF_END("lfs_getattr");
     LFS_TRACE("lfs_getattr -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5444,9 +7308,11 @@ int lfs_setattr(lfs_t *lfs, const char *path,
     }
     LFS_TRACE("lfs_setattr(%p, \"%s\", %"PRIu8", %p, %"PRIu32")",
             (void*)lfs, path, type, buffer, size);
+    LFS_PROF_BEGIN("lfs_setattr");
 
     err = lfs_rawsetattr(lfs, path, type, buffer, size);
 
+    LFS_PROF_END("lfs_setattr");
     LFS_TRACE("lfs_setattr -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5460,15 +7326,153 @@ int lfs_removeattr(lfs_t *lfs, const char *path, uint8_t type) {
         return err;
     }
     LFS_TRACE("lfs_removeattr(%p, \"%s\", %"PRIu8")", (void*)lfs, path, type);
+    LFS_PROF_BEGIN("lfs_removeattr");
 
     err = lfs_rawremoveattr(lfs, path, type);
 
+    LFS_PROF_END("lfs_removeattr");
     LFS_TRACE("lfs_removeattr -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
 }
 #endif
 
+#ifdef LFS_TXN
+#ifndef LFS_READONLY
+int lfs_txn_begin(lfs_t *lfs, lfs_txn_t *txn) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_begin(%p, %p)", (void*)lfs, (void*)txn);
+    LFS_PROF_BEGIN("lfs_txn_begin");
+
+    err = lfs_txn_rawbegin(lfs, txn);
+
+    LFS_PROF_END("lfs_txn_begin");
+    LFS_TRACE("lfs_txn_begin -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_txn_write(lfs_t *lfs, lfs_txn_t *txn,
+        const char *path, const void *buffer, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_write(%p, %p, \"%s\", %p, %"PRIu32")",
+            (void*)lfs, (void*)txn, path, buffer, size);
+    LFS_PROF_BEGIN("lfs_txn_write");
+
+    err = lfs_txn_rawwrite(lfs, txn, path, buffer, size);
+
+    LFS_PROF_END("lfs_txn_write");
+    LFS_TRACE("lfs_txn_write -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_txn_file(lfs_t *lfs, lfs_txn_t *txn, lfs_file_t *file) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_file(%p, %p, %p)",
+            (void*)lfs, (void*)txn, (void*)file);
+    LFS_PROF_BEGIN("lfs_txn_file");
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    err = lfs_txn_rawfile(lfs, txn, file);
+
+    LFS_PROF_END("lfs_txn_file");
+    LFS_TRACE("lfs_txn_file -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_txn_setattr(lfs_t *lfs, lfs_txn_t *txn, const char *path,
+        uint8_t type, const void *buffer, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_setattr(%p, %p, \"%s\", %"PRIu8", %p, %"PRIu32")",
+            (void*)lfs, (void*)txn, path, type, buffer, size);
+    LFS_PROF_BEGIN("lfs_txn_setattr");
+
+    err = lfs_txn_rawsetattr(lfs, txn, path, type, buffer, size);
+
+    LFS_PROF_END("lfs_txn_setattr");
+    LFS_TRACE("lfs_txn_setattr -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_txn_removeattr(lfs_t *lfs, lfs_txn_t *txn, const char *path,
+        uint8_t type) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_removeattr(%p, %p, \"%s\", %"PRIu8")",
+            (void*)lfs, (void*)txn, path, type);
+    LFS_PROF_BEGIN("lfs_txn_removeattr");
+
+    err = lfs_txn_rawremoveattr(lfs, txn, path, type);
+
+    LFS_PROF_END("lfs_txn_removeattr");
+    LFS_TRACE("lfs_txn_removeattr -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_txn_remove(lfs_t *lfs, lfs_txn_t *txn, const char *path) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_remove(%p, %p, \"%s\")", (void*)lfs, (void*)txn, path);
+    LFS_PROF_BEGIN("lfs_txn_remove");
+
+    err = lfs_txn_rawremove(lfs, txn, path);
+
+    LFS_PROF_END("lfs_txn_remove");
+    LFS_TRACE("lfs_txn_remove -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_txn_commit(lfs_t *lfs, lfs_txn_t *txn) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_txn_commit(%p, %p)", (void*)lfs, (void*)txn);
+    LFS_PROF_BEGIN("lfs_txn_commit");
+
+    err = lfs_txn_rawcommit(lfs, txn);
+
+    LFS_PROF_END("lfs_txn_commit");
+    LFS_TRACE("lfs_txn_commit -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+#endif
+
 #ifndef LFS_NO_MALLOC
 int lfs_file_open(lfs_t *lfs, lfs_file_t *file, const char *path, int flags) {
     int err = LFS_LOCK(lfs->cfg);
@@ -5477,10 +7481,12 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file, const char *path, int flags) {
     }
     LFS_TRACE("lfs_file_open(%p, %p, \"%s\", %x)",
             (void*)lfs, (void*)file, path, flags);
+    LFS_PROF_BEGIN("lfs_file_open");
     LFS_ASSERT(!lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     err = lfs_file_rawopen(lfs, file, path, flags);
 
+    LFS_PROF_END("lfs_file_open");
     LFS_TRACE("lfs_file_open -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5498,10 +7504,12 @@ int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
                  ".buffer=%p, .attrs=%p, .attr_count=%"PRIu32"})",
             (void*)lfs, (void*)file, path, flags,
             (void*)cfg, cfg->buffer, (void*)cfg->attrs, cfg->attr_count);
+    LFS_PROF_BEGIN("lfs_file_opencfg");
     LFS_ASSERT(!lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     err = lfs_file_rawopencfg(lfs, file, path, flags, cfg);
 
+    LFS_PROF_END("lfs_file_opencfg");
     LFS_TRACE("lfs_file_opencfg -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5513,10 +7521,12 @@ int lfs_file_close(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_close(%p, %p)", (void*)lfs, (void*)file);
+    LFS_PROF_BEGIN("lfs_file_close");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     err = lfs_file_rawclose(lfs, file);
 
+    LFS_PROF_END("lfs_file_close");
     LFS_TRACE("lfs_file_close -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5529,10 +7539,12 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_sync(%p, %p)", (void*)lfs, (void*)file);
+    LFS_PROF_BEGIN("lfs_file_sync");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     err = lfs_file_rawsync(lfs, file);
 
+    LFS_PROF_END("lfs_file_sync");
     LFS_TRACE("lfs_file_sync -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5547,10 +7559,12 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
     }
     LFS_TRACE("lfs_file_read(%p, %p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, buffer, size);
+    LFS_PROF_BEGIN("lfs_file_read");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     lfs_ssize_t res = lfs_file_rawread(lfs, file, buffer, size);
 
+    LFS_PROF_END("lfs_file_read");
     LFS_TRACE("lfs_file_read -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5565,10 +7579,12 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
     }
     LFS_TRACE("lfs_file_write(%p, %p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, buffer, size);
+    LFS_PROF_BEGIN("lfs_file_write");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     lfs_ssize_t res = lfs_file_rawwrite(lfs, file, buffer, size);
 
+    LFS_PROF_END("lfs_file_write");
     LFS_TRACE("lfs_file_write -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5583,10 +7599,12 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
     }
     LFS_TRACE("lfs_file_seek(%p, %p, %"PRId32", %d)",
             (void*)lfs, (void*)file, off, whence);
+    LFS_PROF_BEGIN("lfs_file_seek");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     lfs_soff_t res = lfs_file_rawseek(lfs, file, off, whence);
 
+    LFS_PROF_END("lfs_file_seek");
     LFS_TRACE("lfs_file_seek -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5600,10 +7618,12 @@ int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
     }
     LFS_TRACE("lfs_file_truncate(%p, %p, %"PRIu32")",
             (void*)lfs, (void*)file, size);
+    LFS_PROF_BEGIN("lfs_file_truncate");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     err = lfs_file_rawtruncate(lfs, file, size);
 
+    LFS_PROF_END("lfs_file_truncate");
     LFS_TRACE("lfs_file_truncate -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5616,10 +7636,12 @@ lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_tell(%p, %p)", (void*)lfs, (void*)file);
+    LFS_PROF_BEGIN("lfs_file_tell");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     lfs_soff_t res = lfs_file_rawtell(lfs, file);
 
+    LFS_PROF_END("lfs_file_tell");
     LFS_TRACE("lfs_file_tell -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5631,9 +7653,11 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_rewind(%p, %p)", (void*)lfs, (void*)file);
+    LFS_PROF_BEGIN("lfs_file_rewind");
 
     err = lfs_file_rawrewind(lfs, file);
 
+    LFS_PROF_END("lfs_file_rewind");
     LFS_TRACE("lfs_file_rewind -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5645,10 +7669,12 @@ lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file) {
         return err;
     }
     LFS_TRACE("lfs_file_size(%p, %p)", (void*)lfs, (void*)file);
+    LFS_PROF_BEGIN("lfs_file_size");
     LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
 
     lfs_soff_t res = lfs_file_rawsize(lfs, file);
 
+    LFS_PROF_END("lfs_file_size");
     LFS_TRACE("lfs_file_size -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5661,9 +7687,11 @@ int lfs_mkdir(lfs_t *lfs, const char *path) {
         return err;
     }
     LFS_TRACE("lfs_mkdir(%p, \"%s\")", (void*)lfs, path);
+    LFS_PROF_BEGIN("lfs_mkdir");
 
     err = lfs_rawmkdir(lfs, path);
 
+    LFS_PROF_END("lfs_mkdir");
     LFS_TRACE("lfs_mkdir -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5676,10 +7704,12 @@ int lfs_dir_open(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
         return err;
     }
     LFS_TRACE("lfs_dir_open(%p, %p, \"%s\")", (void*)lfs, (void*)dir, path);
+    LFS_PROF_BEGIN("lfs_dir_open");
     LFS_ASSERT(!lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)dir));
 
     err = lfs_dir_rawopen(lfs, dir, path);
 
+    LFS_PROF_END("lfs_dir_open");
     LFS_TRACE("lfs_dir_open -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5691,9 +7721,11 @@ int lfs_dir_close(lfs_t *lfs, lfs_dir_t *dir) {
         return err;
     }
     LFS_TRACE("lfs_dir_close(%p, %p)", (void*)lfs, (void*)dir);
+    LFS_PROF_BEGIN("lfs_dir_close");
 
     err = lfs_dir_rawclose(lfs, dir);
 
+    LFS_PROF_END("lfs_dir_close");
     LFS_TRACE("lfs_dir_close -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5706,9 +7738,11 @@ int lfs_dir_read(lfs_t *lfs, lfs_dir_t *dir, struct lfs_info *info) {
     }
     LFS_TRACE("lfs_dir_read(%p, %p, %p)",
             (void*)lfs, (void*)dir, (void*)info);
+    LFS_PROF_BEGIN("lfs_dir_read");
 
     err = lfs_dir_rawread(lfs, dir, info);
 
+    LFS_PROF_END("lfs_dir_read");
     LFS_TRACE("lfs_dir_read -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5721,9 +7755,11 @@ int lfs_dir_seek(lfs_t *lfs, lfs_dir_t *dir, lfs_off_t off) {
     }
     LFS_TRACE("lfs_dir_seek(%p, %p, %"PRIu32")",
             (void*)lfs, (void*)dir, off);
+    LFS_PROF_BEGIN("lfs_dir_seek");
 
     err = lfs_dir_rawseek(lfs, dir, off);
 
+    LFS_PROF_END("lfs_dir_seek");
     LFS_TRACE("lfs_dir_seek -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5735,9 +7771,11 @@ lfs_soff_t lfs_dir_tell(lfs_t *lfs, lfs_dir_t *dir) {
         return err;
     }
     LFS_TRACE("lfs_dir_tell(%p, %p)", (void*)lfs, (void*)dir);
+    LFS_PROF_BEGIN("lfs_dir_tell");
 
     lfs_soff_t res = lfs_dir_rawtell(lfs, dir);
 
+    LFS_PROF_END("lfs_dir_tell");
     LFS_TRACE("lfs_dir_tell -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5749,9 +7787,11 @@ int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir) {
         return err;
     }
     LFS_TRACE("lfs_dir_rewind(%p, %p)", (void*)lfs, (void*)dir);
+    LFS_PROF_BEGIN("lfs_dir_rewind");
 
     err = lfs_dir_rawrewind(lfs, dir);
 
+    LFS_PROF_END("lfs_dir_rewind");
     LFS_TRACE("lfs_dir_rewind -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
@@ -5763,9 +7803,11 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
         return err;
     }
     LFS_TRACE("lfs_fs_size(%p)", (void*)lfs);
+    LFS_PROF_BEGIN("lfs_fs_size");
 
     lfs_ssize_t res = lfs_fs_rawsize(lfs);
 
+    LFS_PROF_END("lfs_fs_size");
     LFS_TRACE("lfs_fs_size -> %"PRId32, res);
     LFS_UNLOCK(lfs->cfg);
     return res;
@@ -5778,14 +7820,107 @@ int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *, lfs_block_t), void *data) {
     }
     LFS_TRACE("lfs_fs_traverse(%p, %p, %p)",
             (void*)lfs, (void*)(uintptr_t)cb, data);
+    LFS_PROF_BEGIN("lfs_fs_traverse");
 
     err = lfs_fs_rawtraverse(lfs, cb, data, true);
 
+    LFS_PROF_END("lfs_fs_traverse");
     LFS_TRACE("lfs_fs_traverse -> %d", err);
     LFS_UNLOCK(lfs->cfg);
     return err;
 }
 
+#ifndef LFS_READONLY
+lfs_ssize_t lfs_fs_nextfree(lfs_t *lfs, lfs_block_t *blocks, lfs_size_t count) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_nextfree(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)blocks, count);
+    LFS_PROF_BEGIN("lfs_fs_nextfree");
+
+    lfs_ssize_t res = lfs_alloc_peek(lfs, blocks, count);
+
+    LFS_PROF_END("lfs_fs_nextfree");
+    LFS_TRACE("lfs_fs_nextfree -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+#endif
+
+#ifndef LFS_READONLY
+lfs_ssize_t lfs_fs_checkfree(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_checkfree(%p)", (void*)lfs);
+    LFS_PROF_BEGIN("lfs_fs_checkfree");
+
+    lfs_ssize_t res = lfs_fs_rawcheckfree(lfs);
+
+    LFS_PROF_END("lfs_fs_checkfree");
+    LFS_TRACE("lfs_fs_checkfree -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_gc(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_gc(%p)", (void*)lfs);
+    LFS_PROF_BEGIN("lfs_fs_gc");
+
+    err = lfs_fs_rawgc(lfs);
+
+    LFS_PROF_END("lfs_fs_gc");
+    LFS_TRACE("lfs_fs_gc -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_checkpoint(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_checkpoint(%p)", (void*)lfs);
+    LFS_PROF_BEGIN("lfs_fs_checkpoint");
+
+    err = lfs_fs_rawcheckpoint(lfs);
+
+    LFS_PROF_END("lfs_fs_checkpoint");
+    LFS_TRACE("lfs_fs_checkpoint -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_fs_mkconsistent(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_mkconsistent(%p)", (void*)lfs);
+    LFS_PROF_BEGIN("lfs_fs_mkconsistent");
+
+    err = lfs_fs_rawmkconsistent(lfs);
+
+    LFS_PROF_END("lfs_fs_mkconsistent");
+    LFS_TRACE("lfs_fs_mkconsistent -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifdef LFS_MIGRATE
 int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
     int err = LFS_LOCK(cfg);
@@ -5808,9 +7943,11 @@ int lfs_migrate(lfs_t *lfs, const struct lfs_config *cfg) {
             cfg->block_cycles, cfg->cache_size, cfg->lookahead_size,
             cfg->read_buffer, cfg->prog_buffer, cfg->lookahead_buffer,
             cfg->name_max, cfg->file_max, cfg->attr_max);
+    LFS_PROF_BEGIN("lfs_migrate");
 
     err = lfs_rawmigrate(lfs, cfg);
 
+    LFS_PROF_END("lfs_migrate");
     LFS_TRACE("lfs_migrate -> %d", err);
     LFS_UNLOCK(cfg);
     return err;
@@ -68,6 +68,20 @@ typedef uint32_t lfs_block_t;
 #define LFS_ATTR_MAX 1022
 #endif
 
+// Maximum number of metadata pairs a mount checkpoint records, see
+// checkpoint_type. lfs_fs_checkpoint builds the checkpoint on the stack, in
+// 12 + 20*LFS_CHECKPOINT_MAX bytes.
+#ifndef LFS_CHECKPOINT_MAX
+#define LFS_CHECKPOINT_MAX 16
+#endif
+
+// Maximum number of operations a transaction stages, see lfs_txn_begin.
+// Each costs 80 bytes of the lfs_txn_t, for the operation and the attributes
+// it adds to the commit. Transactions are only built with LFS_TXN defined.
+#ifndef LFS_TXN_MAX
+#define LFS_TXN_MAX 8
+#endif
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs_error {
@@ -132,6 +146,8 @@ enum lfs_open_flags {
     LFS_O_EXCL   = 0x0200,    // Fail if a file already exists
     LFS_O_TRUNC  = 0x0400,    // Truncate the existing file to zero size
     LFS_O_APPEND = 0x0800,    // Move to end of file on every write
+    LFS_O_COLD   = 0x1000,    // Rarely rewritten, never inline, most worn blocks
+    LFS_O_LOG    = 0x2000,    // Append after a sync in the tail block, in place
 #endif
 
     // internally used flags
@@ -263,6 +279,94 @@ struct lfs_config {
     // can help bound the metadata compaction time. Must be <= block_size.
     // Defaults to block_size when zero.
     lfs_size_t metadata_max;
+
+    // Optional pointer to a memory-mapped view of the block device, such as
+    // internal flash. When set, reads, compares and checksums are done
+    // directly on the memory at direct_map + block*block_size + off,
+    // bypassing the read callback and the read cache. Programmed data must be
+    // visible through the mapping once sync returns, littlefs calls sync
+    // before reading the block it last programmed through the mapping, so
+    // the block device can hold back programs to that block until then.
+    // Defaults to using the read callback when NULL.
+    const void *direct_map;
+
+    // Optional number of read cache slots. Metadata reads that miss are loaded
+    // into the least recently used slot instead of the single read cache, so
+    // the superblock, directories and CTZ skip-lists read together stay
+    // cached. Not used in direct-mapped mode. Defaults to the single read
+    // cache when zero.
+    lfs_size_t rcache_slots;
+
+    // Optional size of each read cache slot in bytes. Must be a multiple of
+    // the read size. Defaults to cache_size when zero.
+    lfs_size_t rcache_size;
+
+    // Optional statically allocated buffer for the read cache slots, of
+    // LFS_RCACHE_BUFFER_SIZE(rcache_slots, rcache_size) bytes and 32-bit
+    // aligned. By default lfs_malloc is used to allocate this buffer.
+    void *rcache_buffer;
+
+    // Optional flag to keep the superblock pair, which is also the root
+    // directory, in the read cache slots. Pinned slots are only evicted when
+    // no unpinned slot is left.
+    bool rcache_pin;
+
+    // Optional flag to use the lookahead buffer as an exact bitmap of the
+    // blocks in use, built by one traversal of the filesystem and then
+    // updated as blocks are allocated and released, so allocating doesn't
+    // traverse the filesystem. Blocks that can't be released safely stay in
+    // use until the bitmap is rebuilt, when space runs out. Requires a
+    // lookahead_size of at least 8*ceil(block_count/32) bytes. Defaults to a
+    // lookahead window refilled by traversals when false.
+    bool free_bitmap;
+
+    // Optional number of dentry cache entries. Path lookups remember where
+    // each name was found, or that it wasn't found, so opening the same path
+    // again doesn't fetch and search every directory along it. Entries are
+    // dropped when their metadata pair is committed. Defaults to no cache
+    // when zero.
+    lfs_size_t dcache_size;
+
+    // Optional statically allocated buffer for the dentry cache, of
+    // dcache_size lfs_dentry_t entries. By default lfs_malloc is used to
+    // allocate this buffer.
+    void *dcache_buffer;
+
+    // Optional custom attribute type for a mount checkpoint, kept on the
+    // root directory. The checkpoint records each metadata pair after the
+    // superblock's, with its revision count and where its log ends, and the
+    // global state they hold. Mount trusts it when none of those pairs have
+    // changed, instead of fetching and checksumming each of them, and falls
+    // back to scanning them all otherwise. Written by lfs_fs_checkpoint and
+    // lfs_unmount. Defaults to no checkpoint when zero.
+    uint8_t checkpoint_type;
+
+    // Optional threshold for lfs_fs_gc. Metadata pairs whose log has grown
+    // past this many bytes are compacted ahead of time, instead of by the
+    // commit that runs out of space. Defaults to 7/8 of metadata_max, or of
+    // block_size, when zero. -1 disables compacting in lfs_fs_gc.
+    lfs_size_t compact_thresh;
+
+    // Optional custom attribute type for erase counts, kept on the root
+    // directory. littlefs counts every erase of every block, and allocates
+    // the least worn free block instead of the next one, so blocks that are
+    // freed and reused often don't wear out before the rest. Files opened
+    // with LFS_O_COLD take the most worn free block instead, resting it
+    // under data that is rarely rewritten. The counts are logical, one for
+    // each erase littlefs asks the block device for, whether or not the
+    // device actually erases, and erases made behind littlefs's back aren't
+    // counted. They are saved by lfs_fs_checkpoint and lfs_unmount, with or
+    // without checkpoint_type, erases since then are lost on power loss.
+    // They are only saved if 2*block_count bytes fit in attr_max and a
+    // quarter of the superblock pair. Requires free_bitmap, lfs_mount and
+    // lfs_format return LFS_ERR_INVAL without it. Defaults to no erase counts
+    // when zero.
+    uint8_t wear_type;
+
+    // Optional statically allocated buffer for the erase counts, of
+    // 2*block_count bytes, each block's count as a little-endian 16-bit
+    // value. By default lfs_malloc is used to allocate this buffer.
+    void *wear_buffer;
 };
 
 // File info structure
@@ -315,6 +419,27 @@ struct lfs_file_config {
 
     // Number of custom attributes in the list
     lfs_size_t attr_count;
+
+    // Optional buffer for an index of the file's CTZ skip-list, of
+    // ctz_index_size lfs_ctz_point_t entries. Blocks found by reads and
+    // writes are remembered, so a seek is found from the nearest one
+    // instead of from the last block of the file. Defaults to no index
+    // when NULL.
+    void *ctz_index;
+
+    // Number of entries in ctz_index
+    lfs_size_t ctz_index_size;
+
+    // Optional readahead buffer of readahead_size bytes, a multiple of
+    // read_size. Once a few reads in a row have each continued where the
+    // last one stopped, a read smaller than cache_size that the buffer
+    // doesn't hold fills it from the file's current block, up to the end of
+    // the block, instead of reading cache_size bytes at a time. Not used
+    // with direct_map. Defaults to no readahead when NULL.
+    void *readahead_buffer;
+
+    // Size of readahead_buffer in bytes
+    lfs_size_t readahead_size;
 };
 
 
@@ -326,6 +451,16 @@ typedef struct lfs_cache {
     uint8_t *buffer;
 } lfs_cache_t;
 
+// read cache slot, see rcache_slots
+typedef struct lfs_rslot {
+    lfs_cache_t cache;
+    uint32_t used;
+} lfs_rslot_t;
+
+// size of rcache_buffer, slot state followed by slot data
+#define LFS_RCACHE_BUFFER_SIZE(slots, size) \
+    ((slots)*(sizeof(lfs_rslot_t) + (size)))
+
 typedef struct lfs_mdir {
     lfs_block_t pair[2];
     uint32_t rev;
@@ -337,6 +472,23 @@ typedef struct lfs_mdir {
     lfs_block_t tail[2];
 } lfs_mdir_t;
 
+// dentry cache entry, see dcache_size
+typedef struct lfs_dentry {
+    uint32_t hash;          // hash of parent directory pair and name
+    uint32_t crc;           // crc of name, to rule out hash collisions
+    int32_t tag;            // name tag, or LFS_ERR_NOENT
+    uint16_t id;            // id, or where a missing name would be created
+    uint32_t used;
+    lfs_block_t child[2];   // pair of a directory, once looked up
+    lfs_mdir_t m;           // mdir holding the name, pair[0] null if unused
+} lfs_dentry_t;
+
+// CTZ skip-list index entry, see lfs_file_config.ctz_index
+typedef struct lfs_ctz_point {
+    lfs_off_t index;        // block index in the file, -1 if unused
+    lfs_block_t block;
+} lfs_ctz_point_t;
+
 // littlefs directory type
 typedef struct lfs_dir {
     struct lfs_dir *next;
@@ -365,10 +517,45 @@ typedef struct lfs_file {
     lfs_block_t block;
     lfs_off_t off;
     lfs_cache_t cache;
+    lfs_size_t committed;   // leading ctz blocks that may be committed
+    lfs_ctz_point_t *index; // see lfs_file_config.ctz_index
+    lfs_size_t index_size;
+    lfs_cache_t ra;         // see lfs_file_config.readahead_buffer
+    lfs_off_t ra_next;      // where a sequential read continues
+    lfs_size_t ra_streak;   // sequential reads in a row
 
     const struct lfs_file_config *cfg;
 } lfs_file_t;
 
+// attribute of a metadata commit
+struct lfs_mattr {
+    uint32_t tag;
+    const void *buffer;
+};
+
+#ifdef LFS_TXN
+// littlefs transaction type
+typedef struct lfs_txn {
+    lfs_size_t count;
+    struct lfs_txn_op {
+        uint8_t type;
+        uint8_t attr;           // attribute type
+        uint8_t item;           // first operation on the same entry
+        uint8_t flags;
+        const char *path;       // or the lfs_file_t
+        const void *buffer;
+        lfs_size_t size;
+        int32_t tag;            // entry's name tag before the commit
+        uint16_t id;            // entry's id as the commit is built
+        int32_t otag;           // entry's struct before the commit
+        lfs_block_t ohead;
+        lfs_size_t osize;
+        lfs_block_t ctz[2];     // ctz struct a staged file commits
+    } ops[LFS_TXN_MAX];
+    struct lfs_mattr attrs[4*LFS_TXN_MAX];
+} lfs_txn_t;
+#endif
+
 typedef struct lfs_superblock {
     uint32_t version;
     lfs_size_t block_size;
@@ -388,6 +575,27 @@ typedef struct lfs {
     lfs_cache_t rcache;
     lfs_cache_t pcache;
 
+    lfs_rslot_t *rslots;
+    lfs_size_t rslot_size;
+    uint32_t rslot_clock;
+    uint32_t rcache_hits;       // metadata reads found in a slot
+    uint32_t rcache_misses;     // metadata reads loaded into a slot
+
+    lfs_dentry_t *dcache;
+    uint32_t dcache_clock;
+    uint32_t dcache_hits;       // path names found in the dentry cache
+    uint32_t dcache_misses;     // path names searched for
+
+    bool checkpoint_stale;      // metadata changed since the last checkpoint
+    bool checkpoint_used;       // mounted from the checkpoint
+
+    lfs_block_t gc_pair[2];     // metadata pair lfs_fs_gc checks next
+
+    uint8_t *wear;              // erase counts, with wear_type
+    lfs_size_t wear_erases;     // erases since the counts were saved
+
+    lfs_block_t unsynced;       // block programmed since the last sync
+
     lfs_block_t root[2];
     struct lfs_mlist {
         struct lfs_mlist *next;
@@ -406,6 +614,7 @@ typedef struct lfs {
         lfs_block_t size;
         lfs_block_t i;
         lfs_block_t ack;
+        lfs_block_t used;       // blocks marked in use, with free_bitmap
         uint32_t *buffer;
     } free;
 
@@ -445,7 +654,9 @@ int lfs_mount(lfs_t *lfs, const struct lfs_config *config);
 
 // Unmounts a littlefs
 //
-// Does nothing besides releasing any allocated resources.
+// Does nothing besides releasing any allocated resources, and writing a
+// mount checkpoint and the erase counts if checkpoint_type or wear_type is
+// set.
 // Returns a negative error code on failure.
 int lfs_unmount(lfs_t *lfs);
 
@@ -607,6 +818,87 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file);
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file);
 
 
+/// Transactions ///
+
+#ifdef LFS_TXN
+#ifndef LFS_READONLY
+// Begin a transaction
+//
+// A transaction stages writes, attribute changes, creates and removes of
+// entries in one directory, and lfs_txn_commit writes them all with a single
+// metadata commit, so after a power loss either all of them or none of them
+// have happened. The staging functions only record the operation, paths and
+// buffers must stay valid until the commit, which looks the entries up. At
+// most LFS_TXN_MAX operations can be staged.
+//
+// Returns a negative error code on failure.
+int lfs_txn_begin(lfs_t *lfs, lfs_txn_t *txn);
+#endif
+
+#ifndef LFS_READONLY
+// Stage writing a whole file from a buffer
+//
+// Creates the file if it doesn't exist, or replaces its data. The data is
+// committed inline, so size is limited to the inline file size (the smaller
+// of cache_size and an eighth of metadata_max / block_size).
+//
+// Returns a negative error code on failure, LFS_ERR_FBIG if the data is too
+// large to inline.
+int lfs_txn_write(lfs_t *lfs, lfs_txn_t *txn,
+        const char *path, const void *buffer, lfs_size_t size);
+#endif
+
+#ifndef LFS_READONLY
+// Stage the changes to an open file, as lfs_file_sync would commit them
+//
+// For files of any size: the file's data is written out by lfs_txn_commit,
+// and its new size and attributes committed along with the rest of the
+// transaction. The file must stay open until then.
+//
+// Returns a negative error code on failure.
+int lfs_txn_file(lfs_t *lfs, lfs_txn_t *txn, lfs_file_t *file);
+#endif
+
+#ifndef LFS_READONLY
+// Stage setting a custom attribute, see lfs_setattr
+//
+// Returns a negative error code on failure.
+int lfs_txn_setattr(lfs_t *lfs, lfs_txn_t *txn, const char *path,
+        uint8_t type, const void *buffer, lfs_size_t size);
+#endif
+
+#ifndef LFS_READONLY
+// Stage removing a custom attribute, see lfs_removeattr
+//
+// Returns a negative error code on failure.
+int lfs_txn_removeattr(lfs_t *lfs, lfs_txn_t *txn, const char *path,
+        uint8_t type);
+#endif
+
+#ifndef LFS_READONLY
+// Stage removing a file
+//
+// Returns a negative error code on failure.
+int lfs_txn_remove(lfs_t *lfs, lfs_txn_t *txn, const char *path);
+#endif
+
+#ifndef LFS_READONLY
+// Commit a transaction
+//
+// Checks the staged operations against the filesystem, then writes them
+// with one metadata commit. All of the entries must be in the same metadata
+// pair, which they are unless the directory has grown past one pair.
+// Nothing is changed if an operation fails its checks: LFS_ERR_NOENT for a
+// change to a missing entry, LFS_ERR_ISDIR for a write or remove of a
+// directory, LFS_ERR_INVAL for entries in different metadata pairs. The
+// transaction is empty afterwards, ready to stage more operations.
+//
+// Returns a negative error code on failure.
+int lfs_txn_commit(lfs_t *lfs, lfs_txn_t *txn);
+#endif
+#endif
+
+
 /// Directory operations ///
 
 #ifndef LFS_READONLY
@@ -664,6 +956,10 @@ int lfs_dir_rewind(lfs_t *lfs, lfs_dir_t *dir);
 // Note: Result is best effort. If files share COW structures, the returned
 // size may be larger than the filesystem actually is.
 //
+// With free_bitmap this is the count of blocks marked in use, kept up to date
+// by the allocator, so no traversal is needed. It includes blocks waiting for
+// a rebuild to reclaim them, lfs_fs_checkfree() reports those.
+//
 // Returns the number of allocated blocks, or a negative error code on failure.
 lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 
@@ -676,6 +972,73 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 // Returns a negative error code on failure.
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 
+#ifndef LFS_READONLY
+// Find the blocks the allocator will hand out next
+//
+// Fills blocks with up to count blocks that are free in the current
+// lookahead window (or the free bitmap), in the order they will be
+// allocated, without allocating them. If the window has been used up it is
+// refilled, which requires a traversal of the filesystem. This can be used
+// to prepare blocks, such as erasing them, while the filesystem is idle.
+// The result is only valid until the next filesystem operation.
+//
+// Returns the number of blocks found, or a negative error code on failure.
+lfs_ssize_t lfs_fs_nextfree(lfs_t *lfs, lfs_block_t *blocks, lfs_size_t count);
+#endif
+
+#ifndef LFS_READONLY
+// Check the free bitmap against a traversal of the filesystem
+//
+// Only does anything with free_bitmap, after the bitmap has been built.
+// Blocks in use by the filesystem but marked free are reported as
+// LFS_ERR_CORRUPT. Blocks marked in use but no longer referenced are leaked
+// until the next rebuild, this is not an error. Also checks the count of
+// blocks in use returned by lfs_fs_size().
+//
+// Returns the number of leaked blocks, or a negative error code on failure.
+lfs_ssize_t lfs_fs_checkfree(lfs_t *lfs);
+#endif
+
+#ifndef LFS_READONLY
+// Write a mount checkpoint
+//
+// Records where the metadata pairs are, so the next mount can skip scanning
+// them, see checkpoint_type. Only writes anything if the metadata has changed
+// since the last checkpoint. Also saves the erase counts, see wear_type, if
+// any blocks have been erased since they were saved, also when checkpoint_type
+// is zero. lfs_unmount also does this.
+//
+// Returns a negative error code on failure.
+int lfs_fs_checkpoint(lfs_t *lfs);
+#endif
+
+#ifndef LFS_READONLY
+// Do one step of background garbage collection
+//
+// Each call does a bounded amount of work, so an idle loop can keep calling
+// it until its time runs out. The first step finishes any moves and orphans
+// a power loss left behind, work the next write would otherwise have to do.
+// Each step after that fetches one metadata pair, and compacts it if its log
+// has grown past compact_thresh. The steps start again from the superblock
+// pair when a metadata pair is relocated or dropped.
+//
+// Returns 1 if there are more steps to do, 0 once every metadata pair has
+// been checked, or a negative error code on failure.
+int lfs_fs_gc(lfs_t *lfs);
+#endif
+
+#ifndef LFS_READONLY
+// Attempt to make the filesystem consistent and ready for writing
+//
+// Calling this function is not required, consistency will be implicitly
+// enforced on the first operation that writes to the filesystem, but this
+// function allows the work to be performed earlier and without other
+// filesystem changes.
+//
+// Returns a negative error code on failure.
+int lfs_fs_mkconsistent(lfs_t *lfs);
+#endif
+
 #ifndef LFS_READONLY
 #ifdef LFS_MIGRATE
 // Attempts to migrate a previous version of littlefs
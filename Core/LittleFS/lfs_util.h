@@ -90,6 +90,20 @@ extern "C"
 #endif
 #endif
 
+// Profiling hooks, called with the function's name around the work each
+// public function does. LFS_PROFILE selects lfs_prof_begin() and
+// lfs_prof_end(), provided by the port, to time the calls. Public functions
+// don't call each other, so the hooks never nest.
+#ifndef LFS_PROF_BEGIN
+#ifdef LFS_PROFILE
+#define LFS_PROF_BEGIN(name) lfs_prof_begin(name)
+#define LFS_PROF_END(name) lfs_prof_end(name)
+#else
+#define LFS_PROF_BEGIN(name)
+#define LFS_PROF_END(name)
+#endif
+#endif
+
 // Runtime assertions
 #ifndef LFS_ASSERT
 #ifndef LFS_NO_ASSERT
@@ -216,6 +230,28 @@ static inline uint32_t lfs_tobe32(uint32_t a) {
 // Calculate CRC-32 with polynomial = 0x04c11db7
 uint32_t lfs_crc(uint32_t crc, const void *buffer, size_t size);
 
+// CRC-32 backends, LFS_CRC_BACKEND selects the one used by lfs_crc()
+#define LFS_CRC_NIBBLE  0 // 16 entry table, two lookups per byte (64 bytes)
+#define LFS_CRC_TABLE   1 // 256 entry table, one lookup per byte (1 KiB)
+#define LFS_CRC_SLICE4  2 // slice-by-4, four bytes per step (4 KiB)
+#define LFS_CRC_SLICE8  3 // slice-by-8, eight bytes per step (8 KiB)
+#define LFS_CRC_HW      4 // lfs_crc_hw(), provided by the port (CRC hardware)
+
+#ifndef LFS_CRC_BACKEND
+#define LFS_CRC_BACKEND LFS_CRC_TABLE
+#endif
+
+uint32_t lfs_crc_nibble(uint32_t crc, const void *buffer, size_t size);
+uint32_t lfs_crc_table(uint32_t crc, const void *buffer, size_t size);
+uint32_t lfs_crc_slice4(uint32_t crc, const void *buffer, size_t size);
+uint32_t lfs_crc_slice8(uint32_t crc, const void *buffer, size_t size);
+uint32_t lfs_crc_hw(uint32_t crc, const void *buffer, size_t size);
+
+#ifdef LFS_PROFILE
+void lfs_prof_begin(const char *name);
+void lfs_prof_end(const char *name);
+#endif
+
 // Allocate memory, only used if buffers are not provided to littlefs
 // Note, memory must be 64-bit aligned
 static inline void *lfs_malloc(size_t size) {
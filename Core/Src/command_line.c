@@ -19,6 +19,9 @@
 #include "command_line.h"
 #include "main.h"   // HAL functions and defines
 #include "littlefs_interface.h"
+#include "littlefs_log.h"
+#include "littlefs_kv.h"
+#include "littlefs_compress.h"
 #include "version.h"
 
 
@@ -43,6 +46,18 @@ const COMMAND_ITEM cmd_table[] = {
 	{"rx",        "receive xmodem <file>",                        1, cl_xmodem_receive},
 	{"version",   "display firmware version",                     1, cl_version},
 	LITTLEFS_COMMANDS,   /* set of commands from littlefs_interface.h */
+#if LFS_RING_LOG
+	LITTLEFS_LOG_COMMANDS, /* ring log commands from littlefs_log.h */
+#endif
+#if LFS_KV_STORE
+	LITTLEFS_KV_COMMANDS, /* key-value store commands from littlefs_kv.h */
+#endif
+#if LFS_COMPRESS
+	LITTLEFS_COMPRESS_COMMANDS, /* compressed file commands from littlefs_compress.h */
+#endif
+#ifdef FLASH_SIM
+	FLASH_SIM_COMMANDS,  /* host build, FLASH simulator commands from Host/flash_sim.h */
+#endif
 	{NULL,NULL,0,NULL}, /* end of table */
 };
 
@@ -0,0 +1,418 @@
+/*
+ * littlefs_compress.c
+ *
+ *  Compressed files on top of LittleFS (see littlefs_compress.h), and the "zcopy" command.
+ */
+
+#include <stdio.h> // printf()
+#include <string.h> // memset()
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "littlefs_compress.h"
+#include "command_line.h" // arc, argv[]
+
+#if LFS_COMPRESS
+extern lfs_t lfs;
+
+#define LFSZ_F_COMPRESSED       0x01 // file has an index
+#define LFSZ_F_WRITING          0x02 // opened for writing
+#define LFSZ_F_EMITTED          0x04 // the partly filled chunk being written is in the file
+#define LFSZ_F_PENDING          0x08 // data written since the chunk being written was compressed
+
+#define LFSZ_GROUP_SIZE         (1 + 2*8) // flag byte, 8 matches
+#define LFSZ_INPUT_SIZE         32 // compressed bytes the decompressor reads at a time
+
+LFSZ_STATS lfsz_stats;
+
+// Compress the chunk being written, buf[0 - fill), into the file after the chunks before it, replacing
+// the chunk if it was compressed before.  Each offset back, nearest first, is tried for the longest match.
+static int lfsz_flush(LFSZ * z)
+{
+	uint32_t start_cycles = LFS_BENCH_CYCLES();
+	uint32_t io_cycles = 0;
+	uint32_t chunk = (z->index.size - z->fill) / z->index.chunk;
+	lfs_off_t start = chunk ? z->index.end[chunk-1] : 0;
+	const uint8_t * buf = z->buf;
+	uint32_t n = z->fill;
+	uint8_t group[LFSZ_GROUP_SIZE];
+	uint32_t length = 1, items = 0;
+	int retval;
+
+	if(z->flags & LFSZ_F_EMITTED) {
+		retval = lfs_file_truncate(z->lfs, &z->file, start);
+		if(retval < LFS_ERR_OK) return retval;
+	}
+	lfs_soff_t pos = lfs_file_seek(z->lfs, &z->file, start, LFS_SEEK_SET);
+	if(pos < LFS_ERR_OK) return pos;
+
+	group[0] = 0;
+	for(uint32_t i=0;i<n;) {
+		uint32_t best = 0, back = 0;
+		uint32_t max = n - i < LFSZ_MATCH_MAX ? n - i : LFSZ_MATCH_MAX;
+		if(max >= LFSZ_MATCH_MIN) {
+			for(uint32_t j=i;j-- > 0 && best < max;) {
+				// a longer match has to match where the best one so far stopped
+				if(buf[j+best] != buf[i+best] || buf[j] != buf[i]) continue;
+				uint32_t len = 1;
+				while(len < max && buf[j+len] == buf[i+len]) len++;
+				if(len > best) {
+					best = len;
+					back = i - j;
+				}
+			}
+		}
+		if(best >= LFSZ_MATCH_MIN) {
+			uint16_t match = (uint16_t)((back - 1) << 6 | (best - LFSZ_MATCH_MIN));
+			group[0] |= 1 << items;
+			group[length++] = match >> 8;
+			group[length++] = match & 0xFF;
+			i += best;
+		} else {
+			group[length++] = buf[i++];
+		}
+		if(++items == 8 || i == n) {
+			uint32_t io_start = LFS_BENCH_CYCLES();
+			lfs_ssize_t written = lfs_file_write(z->lfs, &z->file, group, length);
+			io_cycles += LFS_BENCH_CYCLES() - io_start;
+			if(written < LFS_ERR_OK) return written;
+			group[0] = 0;
+			length = 1;
+			items = 0;
+		}
+	}
+
+	lfs_soff_t end = lfs_file_tell(z->lfs, &z->file);
+	if(end < LFS_ERR_OK) return end;
+	if(end > 0xFFFF) return LFS_ERR_FBIG;
+	z->index.end[chunk] = (uint16_t)end;
+	z->index.count = chunk + 1;
+	z->attr.size = LFSZ_INDEX_SIZE(z->index.count);
+	z->flags = (z->flags | LFSZ_F_EMITTED) & ~LFSZ_F_PENDING;
+
+	lfsz_stats.compress_bytes += n;
+	lfsz_stats.compress_cycles += LFS_BENCH_CYCLES() - start_cycles - io_cycles;
+	return LFS_ERR_OK;
+}
+
+// Decompress a chunk into buf
+static int lfsz_load(LFSZ * z, uint32_t chunk)
+{
+	uint32_t start_cycles = LFS_BENCH_CYCLES();
+	uint32_t io_cycles = 0;
+	lfs_off_t start = chunk ? z->index.end[chunk-1] : 0;
+	uint32_t n = z->index.size - chunk * z->index.chunk;
+	uint8_t in[LFSZ_INPUT_SIZE];
+	uint32_t have = 0, used = 0, out = 0;
+	uint8_t flag = 0, items = 0;
+
+	if(n > z->index.chunk) n = z->index.chunk;
+	if(z->index.end[chunk] < start) return LFS_ERR_CORRUPT;
+	lfs_size_t left = z->index.end[chunk] - start; // compressed bytes not read yet
+
+	z->loaded = -1;
+	lfs_soff_t pos = lfs_file_seek(z->lfs, &z->file, start, LFS_SEEK_SET);
+	if(pos < LFS_ERR_OK) return pos;
+
+	while(out < n) {
+		// Room for a flag byte and a match
+		if(have - used < 3 && left) {
+			memmove(in, in+used, have-used);
+			have -= used;
+			used = 0;
+			lfs_size_t size = sizeof(in) - have < left ? sizeof(in) - have : left;
+			uint32_t io_start = LFS_BENCH_CYCLES();
+			lfs_ssize_t bytes_read = lfs_file_read(z->lfs, &z->file, in+have, size);
+			io_cycles += LFS_BENCH_CYCLES() - io_start;
+			if(bytes_read < LFS_ERR_OK) return bytes_read;
+			if((lfs_size_t)bytes_read != size) return LFS_ERR_CORRUPT;
+			have += size;
+			left -= size;
+		}
+
+		if(!items) {
+			if(used >= have) return LFS_ERR_CORRUPT;
+			flag = in[used++];
+			items = 8;
+		}
+		if(flag & 1) {
+			if(used + 2 > have) return LFS_ERR_CORRUPT;
+			uint32_t match = (uint32_t)in[used] << 8 | in[used+1];
+			uint32_t back = (match >> 6) + 1;
+			uint32_t len = (match & 0x3F) + LFSZ_MATCH_MIN;
+			used += 2;
+			if(back > out || len > n - out) return LFS_ERR_CORRUPT;
+			while(len--) {
+				z->buf[out] = z->buf[out-back];
+				out++;
+			}
+		} else {
+			if(used >= have) return LFS_ERR_CORRUPT;
+			z->buf[out++] = in[used++];
+		}
+		flag >>= 1;
+		items--;
+	}
+	z->loaded = chunk;
+
+	lfsz_stats.decompress_bytes += n;
+	lfsz_stats.decompress_cycles += LFS_BENCH_CYCLES() - start_cycles - io_cycles;
+	return LFS_ERR_OK;
+}
+
+int lfsz_open(LFSZ * z, lfs_t * lfs, const char * path, int flags)
+{
+	int writing = (flags & LFS_O_WRONLY) == LFS_O_WRONLY;
+	int open_flags = flags & ~LFSZ_O_COMPRESS;
+
+	memset(z,0,sizeof(*z));
+	z->lfs = lfs;
+	z->loaded = -1;
+	z->attr.type = LFSZ_ATTR_TYPE;
+	z->attr.buffer = &z->index;
+	z->attr.size = sizeof(z->index);
+	z->config.attrs = &z->attr;
+	z->config.attr_count = 1;
+
+	// The index, and the last chunk, are read back when writing
+	if(writing) open_flags |= LFS_O_RDWR;
+	int retval = lfs_file_opencfg(lfs, &z->file, path, open_flags, &z->config);
+	if(retval < LFS_ERR_OK) return retval;
+
+	lfs_soff_t stored = lfs_file_size(lfs, &z->file);
+	if(writing && (stored == 0 || (flags & LFS_O_TRUNC)) && !(z->index.chunk && z->index.size == 0)) {
+		// A new (or truncated) file: LFSZ_O_COMPRESS picks its format, replacing any index it had
+		uint16_t stale = z->index.chunk;
+		memset(&z->index,0,sizeof(z->index));
+		if(flags & LFSZ_O_COMPRESS) {
+			z->index.chunk = LFSZ_CHUNK;
+			z->attr.size = LFSZ_INDEX_SIZE(0);
+		} else {
+			z->attr.size = 0; // an empty index is a plain file
+			if(!stale) z->config.attr_count = 0;
+		}
+	} else if(z->index.chunk) {
+		if(z->index.chunk > LFSZ_CHUNK || z->index.count > LFSZ_INDEX_MAX ||
+		   z->index.count != (z->index.size + z->index.chunk - 1) / z->index.chunk) {
+			lfs_file_close(lfs, &z->file);
+			return LFS_ERR_CORRUPT;
+		}
+		z->attr.size = LFSZ_INDEX_SIZE(z->index.count);
+	} else {
+		z->config.attr_count = 0; // plain file
+	}
+
+	if(z->index.chunk) {
+		z->flags |= LFSZ_F_COMPRESSED;
+		if(writing) {
+			// Appending: continue the partly filled last chunk
+			z->flags |= LFSZ_F_WRITING;
+			z->fill = z->index.size % z->index.chunk;
+			if(z->fill) {
+				retval = lfsz_load(z, z->index.count - 1);
+				if(retval < LFS_ERR_OK) {
+					lfs_file_close(lfs, &z->file);
+					return retval;
+				}
+				z->loaded = -1;
+				z->flags |= LFSZ_F_EMITTED;
+			}
+			z->pos = z->index.size;
+		}
+	}
+	return LFS_ERR_OK;
+}
+
+lfs_ssize_t lfsz_read(LFSZ * z, void * buffer, lfs_size_t size)
+{
+	uint8_t * data = buffer;
+	lfs_size_t done = 0;
+
+	if(!(z->flags & LFSZ_F_COMPRESSED)) return lfs_file_read(z->lfs, &z->file, buffer, size);
+	if(z->flags & LFSZ_F_WRITING) return LFS_ERR_BADF;
+
+	while(done < size && z->pos < z->index.size) {
+		uint32_t chunk = z->pos / z->index.chunk;
+		if((int32_t)chunk != z->loaded) {
+			int retval = lfsz_load(z, chunk);
+			if(retval < LFS_ERR_OK) return retval;
+		}
+		uint32_t off = z->pos - chunk * z->index.chunk;
+		lfs_size_t n = size - done;
+		if(n > z->index.chunk - off) n = z->index.chunk - off;
+		if(n > z->index.size - z->pos) n = z->index.size - z->pos;
+		memcpy(data + done, z->buf + off, n);
+		done += n;
+		z->pos += n;
+	}
+	return done;
+}
+
+lfs_ssize_t lfsz_write(LFSZ * z, const void * buffer, lfs_size_t size)
+{
+	const uint8_t * data = buffer;
+	lfs_size_t done = 0;
+
+	if(!(z->flags & LFSZ_F_COMPRESSED)) return lfs_file_write(z->lfs, &z->file, buffer, size);
+
+	while(done < size) {
+		if(z->index.size >= (uint32_t)LFSZ_INDEX_MAX * z->index.chunk) return done ? (lfs_ssize_t)done : LFS_ERR_FBIG;
+		lfs_size_t n = size - done;
+		if(n > (lfs_size_t)(z->index.chunk - z->fill)) n = z->index.chunk - z->fill;
+		memcpy(z->buf + z->fill, data + done, n);
+		z->fill += n;
+		z->index.size += n;
+		z->flags |= LFSZ_F_PENDING;
+		done += n;
+		if(z->fill == z->index.chunk) {
+			int retval = lfsz_flush(z);
+			if(retval < LFS_ERR_OK) return retval;
+			z->fill = 0;
+			z->flags &= ~LFSZ_F_EMITTED;
+		}
+	}
+	z->pos = z->index.size;
+	return done;
+}
+
+lfs_soff_t lfsz_seek(LFSZ * z, lfs_soff_t off, int whence)
+{
+	if(!(z->flags & LFSZ_F_COMPRESSED)) return lfs_file_seek(z->lfs, &z->file, off, whence);
+
+	lfs_soff_t pos = off;
+	if(whence == LFS_SEEK_CUR) pos += z->pos;
+	else if(whence == LFS_SEEK_END) pos += z->index.size;
+	if(pos < 0) return LFS_ERR_INVAL;
+	// Compressed files are written sequentially
+	if((z->flags & LFSZ_F_WRITING) && (lfs_size_t)pos != z->index.size) return LFS_ERR_INVAL;
+	z->pos = pos;
+	return pos;
+}
+
+lfs_soff_t lfsz_size(LFSZ * z)
+{
+	if(!(z->flags & LFSZ_F_COMPRESSED)) return lfs_file_size(z->lfs, &z->file);
+	return z->index.size;
+}
+
+int lfsz_sync(LFSZ * z)
+{
+	if((z->flags & LFSZ_F_PENDING) && z->fill) {
+		int retval = lfsz_flush(z);
+		if(retval < LFS_ERR_OK) return retval;
+	}
+	return lfs_file_sync(z->lfs, &z->file);
+}
+
+int lfsz_close(LFSZ * z)
+{
+	int retval = LFS_ERR_OK;
+	if((z->flags & LFSZ_F_PENDING) && z->fill) retval = lfsz_flush(z);
+	int err = lfs_file_close(z->lfs, &z->file);
+	return retval < LFS_ERR_OK ? retval : err;
+}
+
+int lfsz_is_compressed(LFSZ * z)
+{
+	return (z->flags & LFSZ_F_COMPRESSED) != 0;
+}
+
+//=================================================================================================
+// Command line
+//=================================================================================================
+
+// Source and destination files, static to keep their chunks off the stack
+static LFSZ zcopy_src, zcopy_dst;
+
+// Copy a file, plain or compressed, to a compressed file: zcopy <source> <destination>
+// Displays the space saved, and the compressor's and decompressor's CPU time per KB (DWT cycle counter,
+// host CPU time in the host build, without the FLASH reads and writes).  The copy is then read back in
+// order, and at random offsets (each decompressing one chunk), and checked against the source.
+int cl_zcopy(void)
+{
+	uint8_t buffer[64], check[64];
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	uint32_t seed = 0x12345678;
+	uint32_t reads = 32, bad = 0;
+	struct lfs_info info;
+
+	int retval = lfsz_open(&zcopy_src, &lfs, argv[1], LFS_O_RDONLY);
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error opening file \"%s\"\n",__func__,argv[1]);
+		return retval;
+	}
+	retval = lfsz_open(&zcopy_dst, &lfs, argv[2], LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | LFSZ_O_COMPRESS);
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error opening file \"%s\"\n",__func__,argv[2]);
+		lfsz_close(&zcopy_src);
+		return retval;
+	}
+
+	LFSZ_STATS before = lfsz_stats;
+	lfs_ssize_t bytes_read;
+	do {
+		bytes_read = lfsz_read(&zcopy_src, buffer, sizeof(buffer));
+		if(bytes_read > 0) {
+			lfs_ssize_t written = lfsz_write(&zcopy_dst, buffer, bytes_read);
+			if(written < LFS_ERR_OK) bytes_read = written;
+		}
+	} while(bytes_read > 0);
+	retval = lfsz_close(&zcopy_dst);
+	if(bytes_read < LFS_ERR_OK) retval = bytes_read;
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error copying \"%s\" to \"%s\": %d\n",__func__,argv[1],argv[2],retval);
+		lfsz_close(&zcopy_src);
+		return retval;
+	}
+	uint32_t compress_bytes = lfsz_stats.compress_bytes - before.compress_bytes;
+	uint32_t compress_cycles = lfsz_stats.compress_cycles - before.compress_cycles;
+
+	// Space saved, in bytes and in whole blocks (small files are inlined in their directory instead)
+	uint32_t size = lfsz_size(&zcopy_src);
+	retval = lfs_stat(&lfs, argv[2], &info);
+	if(retval < LFS_ERR_OK) {
+		lfsz_close(&zcopy_src);
+		return retval;
+	}
+	lfs_size_t block_size = lfs.cfg->block_size;
+	printf("%lu bytes compressed to %lu (%lu%%), %lu block(s) instead of %lu\n",size,info.size,
+		size ? info.size*100/size : 0,(info.size+block_size-1)/block_size,(size+block_size-1)/block_size);
+	printf("Compress:   %lu cycles/KB\n",compress_bytes ? (uint32_t)((uint64_t)compress_cycles*1024/compress_bytes) : 0);
+
+	// Read it back, in order
+	retval = lfsz_open(&zcopy_dst, &lfs, argv[2], LFS_O_RDONLY);
+	if(retval < LFS_ERR_OK) {
+		lfsz_close(&zcopy_src);
+		return retval;
+	}
+	before = lfsz_stats;
+	lfsz_seek(&zcopy_src, 0, LFS_SEEK_SET);
+	do {
+		bytes_read = lfsz_read(&zcopy_dst, buffer, sizeof(buffer));
+		lfs_ssize_t check_read = lfsz_read(&zcopy_src, check, sizeof(check));
+		if(bytes_read != check_read || (bytes_read > 0 && memcmp(buffer,check,bytes_read) != 0)) bad++;
+	} while(bytes_read > 0);
+	uint32_t decompress_bytes = lfsz_stats.decompress_bytes - before.decompress_bytes;
+	uint32_t decompress_cycles = lfsz_stats.decompress_cycles - before.decompress_cycles;
+	printf("Decompress: %lu cycles/KB\n",decompress_bytes ? (uint32_t)((uint64_t)decompress_cycles*1024/decompress_bytes) : 0);
+
+	// Random 16 byte reads, the index finds the chunk to decompress
+	uint32_t cycles = 0;
+	for(uint32_t i=0;i<reads && size;i++) {
+		seed = seed * 1103515245 + 12345;
+		lfs_soff_t off = (seed >> 8) % size;
+		uint32_t start = LFS_BENCH_CYCLES();
+		lfsz_seek(&zcopy_dst, off, LFS_SEEK_SET);
+		bytes_read = lfsz_read(&zcopy_dst, buffer, 16);
+		cycles += LFS_BENCH_CYCLES() - start;
+		lfsz_seek(&zcopy_src, off, LFS_SEEK_SET);
+		lfs_ssize_t check_read = lfsz_read(&zcopy_src, check, 16);
+		if(bytes_read != check_read || (bytes_read > 0 && memcmp(buffer,check,bytes_read) != 0)) bad++;
+	}
+	printf("Random 16 byte reads: %lu us each, %lu bad reads\n",size ? cycles/cycles_per_us/reads : 0,bad);
+
+	lfsz_close(&zcopy_dst);
+	lfsz_close(&zcopy_src);
+	return bad ? LFS_ERR_CORRUPT : LFS_ERR_OK;
+} // cl_zcopy()
+#endif // LFS_COMPRESS
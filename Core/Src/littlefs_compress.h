@@ -0,0 +1,110 @@
+/*
+ * littlefs_compress.h
+ *
+ *  Compressed files on top of LittleFS, for logs and text configs on the small FLASH volume.
+ *
+ *  lfsz_open() with LFSZ_O_COMPRESS creates a compressed file, and lfsz_write() compresses the data as it is
+ *  written.  lfsz_read() and lfsz_seek() work the same on compressed and plain files, so readers don't need
+ *  to know which they have.  A file's format is set when it's created (or truncated), an existing plain file
+ *  stays plain.
+ *
+ *  The data is compressed in chunks of LFSZ_CHUNK bytes, each one on its own (LZSS, the chunk is the window),
+ *  so a read decompresses only the chunk it's in.  The file's index, a custom attribute (LFSZ_ATTR_TYPE), holds
+ *  its size and where each compressed chunk ends:
+ *      uint32_t size, uint16_t chunk, uint16_t count, uint16_t end[count]
+ *  A compressed chunk is groups of a flag byte and 8 items, a literal byte (flag bit 0) or a match (flag bit 1)
+ *  of 2 bytes, big endian: (offset back - 1) << 6 | (length - 3).
+ *
+ *  Compressed files are written sequentially: opened for writing, an existing compressed file is appended to.
+ *  lfsz_sync() compresses the partly filled last chunk, and compresses it again when more data is added.
+ *
+ *  RAM: an LFSZ holds a chunk (the compressor's window and the decompressed chunk), the index and the lfs_file_t.
+ */
+
+#ifndef _littlefs_compress_h_
+#define _littlefs_compress_h_
+
+#include <stdint.h>
+#include "lfs.h"
+
+// LFS_COMPRESS builds compressed files and the "zcopy" command (about 3.7K of code), and "cat" displays compressed
+// files decompressed
+#ifndef LFS_COMPRESS
+#define LFS_COMPRESS            0
+#endif
+
+// Bytes compressed together, the unit of random access, <= 1024.  Larger chunks compress better,
+// compression time per byte grows with the chunk size.
+#ifndef LFSZ_CHUNK
+#define LFSZ_CHUNK              512
+#endif
+
+// Most chunks in a compressed file, the largest file is LFSZ_INDEX_MAX * LFSZ_CHUNK bytes.  2 bytes each.
+#ifndef LFSZ_INDEX_MAX
+#define LFSZ_INDEX_MAX          64
+#endif
+
+// Custom attribute type of a compressed file's index
+#ifndef LFSZ_ATTR_TYPE
+#define LFSZ_ATTR_TYPE          0x5A
+#endif
+
+#define LFSZ_O_COMPRESS         0x8000 // lfsz_open(): compress the file, if it's created (not a LittleFS flag)
+#define LFSZ_MATCH_MIN          3      // shortest match, shorter repeats are literals
+#define LFSZ_MATCH_MAX          (LFSZ_MATCH_MIN + 63)
+
+#if LFSZ_CHUNK > 1024
+#error "LFSZ_CHUNK must be <= 1024, matches have a 10 bit offset"
+#endif
+
+// Compressed file's index, its custom attribute
+typedef struct {
+	uint32_t size;              // uncompressed bytes
+	uint16_t chunk;             // chunk size it was written with, 0 for a plain file
+	uint16_t count;             // chunks
+	uint16_t end[LFSZ_INDEX_MAX]; // compressed offset each chunk ends at
+} LFSZ_INDEX;
+
+#define LFSZ_INDEX_SIZE(count)  (8 + 2*(count)) // bytes of the attribute
+
+// Open file
+typedef struct {
+	lfs_t * lfs;
+	lfs_file_t file;
+	struct lfs_file_config config;
+	struct lfs_attr attr;
+	LFSZ_INDEX index;
+	uint32_t pos;               // uncompressed position
+	int32_t loaded;             // chunk decompressed into buf, -1 for none
+	uint16_t fill;              // bytes written into buf of the chunk being written
+	uint8_t flags;              // LFSZ_F_...
+	uint8_t buf[LFSZ_CHUNK];
+} LFSZ;
+
+// Compressor / decompressor totals, CPU time only (the file reads and writes they make aren't counted)
+typedef struct {
+	uint32_t compress_bytes;    // uncompressed bytes in
+	uint32_t compress_cycles;
+	uint32_t decompress_bytes;  // uncompressed bytes out
+	uint32_t decompress_cycles;
+} LFSZ_STATS;
+
+extern LFSZ_STATS lfsz_stats;
+
+int lfsz_open(LFSZ * z, lfs_t * lfs, const char * path, int flags); // lfs_file_open() flags, and LFSZ_O_COMPRESS
+lfs_ssize_t lfsz_read(LFSZ * z, void * buffer, lfs_size_t size);
+lfs_ssize_t lfsz_write(LFSZ * z, const void * buffer, lfs_size_t size);
+lfs_soff_t lfsz_seek(LFSZ * z, lfs_soff_t off, int whence); // reading only, for compressed files
+lfs_soff_t lfsz_size(LFSZ * z);                             // uncompressed size
+int lfsz_sync(LFSZ * z);
+int lfsz_close(LFSZ * z);
+int lfsz_is_compressed(LFSZ * z);
+
+// Command Line functions implemented within littlefs_compress.c:
+int cl_zcopy(void);
+
+// Records to add into command line interface (command_line.c):
+#define LITTLEFS_COMPRESS_COMMANDS \
+{"zcopy",      "Copy <source> to compressed <destination>, with size and CPU cycles/KB", 3, cl_zcopy} \
+
+#endif // _littlefs_compress_h_
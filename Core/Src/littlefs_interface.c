@@ -6,7 +6,7 @@
  *
  *  Using STM32 HAL interface modules, create an interface between the LittleFS file system
  *  and an STM32's unused FLASH Program Memory
- *  In this example, we will use a fixed FLASH block size, with a fixed address.
+ *  The file system uses the top of FLASH, sized at boot from the FLASH size register.
  */
 
 #include <stdio.h> // printf()
@@ -15,6 +15,7 @@
 #include "main.h"
 #include "lfs.h"
 #include "littlefs_interface.h"
+#include "littlefs_compress.h"
 #include "command_line.h" // arc, argv[]
 
 // global variables used by the file system
@@ -25,10 +26,57 @@ extern lfs_t lfs;
 extern  void init_lfs_cfg(void);
 extern  struct lfs_config lfs_cfg;
 
+LFS_FLASH_STATS lfs_flash_stats; // FLASH block device counters
+
 void memory_dump(void * address, uint32_t count); // hexdump.c
 void file_dump(void * address, uint32_t count);  // hexdump.c
 //void hexdump(void * address, uint32_t count, uint32_t address_value); // hexdump.c
 
+// Erased page tracking
+// Erasing a 1K page takes 20-40ms, even when the page is already blank (all 0xFF).
+// Two bitmaps track what we know about each page (LittleFS block, when blocks are multiple pages):
+//   page_known - page state has been determined (blank checked, erased, or programmed since boot)
+//   page_blank - page is known to be blank
+// A page's state is determined lazily, the first time LittleFS asks to erase it.  Programming a page
+// makes it "known, not blank", erasing it makes it "known, blank".
+// page_preerased marks pages erased ahead of time by lfs_idle(), and not yet handed to LittleFS.
+static uint32_t page_known[(LFS_MAX_BLOCKS+31)/32];
+static uint32_t page_blank[(LFS_MAX_BLOCKS+31)/32];
+static uint32_t page_preerased[(LFS_MAX_BLOCKS+31)/32];
+
+#define PAGE_BIT_SET(map,page)   ((map)[(page)/32] |=  (1UL << ((page)%32)))
+#define PAGE_BIT_CLR(map,page)   ((map)[(page)/32] &= ~(1UL << ((page)%32)))
+#define PAGE_BIT_TST(map,page)   ((map)[(page)/32] &   (1UL << ((page)%32)))
+
+// Return 1 if every word in the FLASH block is 0xFFFFFFFF
+static int flash_page_is_blank(uint32_t address)
+{
+	const uint32_t * word = (const uint32_t *)address;
+	lfs_flash_stats.blank_checks++;
+	for(uint32_t i=0;i<LFS_BLOCK_SIZE/sizeof(uint32_t);i++) {
+		if(word[i] != 0xFFFFFFFF) return 0;
+	}
+	return 1;
+}
+
+// Return 1 if the page is known to be blank, blank checking it the first time we are asked
+static int page_is_blank(lfs_block_t block)
+{
+	if(!PAGE_BIT_TST(page_known,block)) {
+		PAGE_BIT_SET(page_known,block);
+		if(flash_page_is_blank(lfs_flash_start + (block * LFS_BLOCK_SIZE)))
+			PAGE_BIT_SET(page_blank,block);
+		else
+			PAGE_BIT_CLR(page_blank,block);
+	}
+	return PAGE_BIT_TST(page_blank,block) ? 1 : 0;
+}
+
+#if LFS_WRITEBACK
+static int writeback_drain(void); // write-back buffer, see lfs_prog()
+static int writeback_holds(lfs_block_t block);
+#endif
+
 // Read a region in a FLASH block. Negative error codes are propagated to the user.
 int lfs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
 {
@@ -38,26 +86,37 @@ int lfs_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void
 		return LFS_ERR_INVAL;
 	}
 
-	lfs_block_t address = FLASH_USER_START_ADDR + (block * STM32F103_SECTOR_SIZE + off);
+#if LFS_WRITEBACK
+	// Reading back data that is still in the write-back buffer?  Program it first.
+	if(writeback_holds(block)) {
+		int err = writeback_drain();
+		if(err) return err;
+	}
+#endif
+
+	lfs_block_t address = lfs_flash_start + (block * LFS_BLOCK_SIZE + off);
 	//printf("+%s(Addr 0x%06lX, Len 0x%04lX)\r\n",__func__,address,size);
 	//hexdump((void *)address,size);
 	memcpy(buffer, (void *)address, size);
+	lfs_flash_stats.read_calls++;
+	lfs_flash_stats.read_bytes += size;
 
 	return LFS_ERR_OK;
 }
 
-// Use 64 bit (8 byte) long data blocks to help increase efficiency
-int lfs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+// Program using the HAL, 64 bits (8 bytes) at a time
+// Each HAL_FLASH_Program() call programs four half-words, setting and clearing PG, and waiting
+// (with timeout bookkeeping) for each one.
+// Like flash_program_fast(), a half-word that fails to program (PGERR) returns LFS_ERR_CORRUPT,
+// so LittleFS moves the data to another block.  This happens after a power loss tears a program:
+// LittleFS may take the partly programmed area for erased FLASH.
+static int flash_program_hal(uint32_t address, const uint8_t *buffer, uint32_t size)
 {
-	PARAMETER_NOT_USED(c);
-	lfs_block_t address = FLASH_USER_START_ADDR + (block * STM32F103_SECTOR_SIZE + off);
 	HAL_StatusTypeDef hal_rc = HAL_OK;
 	uint32_t block_count = size / 8;
 
-	//printf("+%s(Addr 0x%06lX, Len 0x%04lX)\r\n",__func__,address,size);
-	//hexdump((void *)address,size);
   	/* Program the user Flash area word by word
-  	(area defined by FLASH_USER_START_ADDR and FLASH_USER_END_ADDR) ***********/
+  	(area defined by lfs_flash_start and lfs_cfg.block_count) ***********/
 
   	uint64_t data_source;
 
@@ -68,26 +127,184 @@ int lfs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const
   		if (hal_rc == HAL_OK)
   		{
   			address += 8;
-  			buffer = (uint8_t *)buffer + 8;
+  			buffer += 8;
   		}
   		else
   		{
   		  /* Error occurred while writing data in Flash memory.
   			 User can add here some code to deal with this error */
-  			printf("Program Error, 0x%X\n",hal_rc);
-
+  			printf("Program Error at 0x%08lX, 0x%X\n",address,hal_rc);
+  			break;
   		} // else
   	} // for
+
+  	if(hal_rc == HAL_OK) return LFS_ERR_OK;
+  	return (HAL_FLASH_GetError() & HAL_FLASH_ERROR_PROG) ? LFS_ERR_CORRUPT : LFS_ERR_IO;
+}
+
+// Half-word program time, STM32F103 datasheet tPROG: 52.5us typical, 70us maximum
+#define FLASH_PROG_MAX_US       70
+
+// Wait for the FLASH controller to finish an operation, an erase may still be running.
+// Gives up after FLASH_TIMEOUT_VALUE ms as the HAL does.
+static int flash_wait_ready(void)
+{
+	uint32_t start = HAL_GetTick();
+	while(FLASH->SR & FLASH_SR_BSY) {
+		if(HAL_GetTick() - start > FLASH_TIMEOUT_VALUE) return LFS_ERR_IO;
+	}
+	return LFS_ERR_OK;
+}
+
+// Wait for a half-word program to finish, polling BSY at most "polls" times.
+// Cheaper than reading the tick counter for every half-word.
+static int flash_wait_prog(uint32_t polls)
+{
+	while(FLASH->SR & FLASH_SR_BSY) {
+		if(--polls == 0) return LFS_ERR_IO;
+	}
+	return LFS_ERR_OK;
+}
+
+// Program using the FLASH registers directly
+// PG stays set for the whole buffer, half-words are streamed straight from the source buffer,
+// and BSY is polled once per half-word.  The FLASH must already be unlocked (see main()).
+// Returns LFS_ERR_IO if the FLASH is locked, write protected, or stays busy past the program time,
+// and LFS_ERR_CORRUPT if a half-word fails to program (PGERR - location was not erased, or read back
+// doesn't match) so LittleFS can move the data to another block.
+static int flash_program_fast(uint32_t address, const uint8_t *buffer, uint32_t size)
+{
+	volatile uint16_t *dest = (volatile uint16_t *)address;
+	int rc = LFS_ERR_OK;
+	// A BSY poll takes at least one cycle, so one poll per cycle of FLASH_PROG_MAX_US is past the program time
+	uint32_t max_polls = (SystemCoreClock / 1000000U) * FLASH_PROG_MAX_US;
+
+	if(FLASH->CR & FLASH_CR_LOCK) return LFS_ERR_IO;
+
+	if(flash_wait_ready() != LFS_ERR_OK) { // wait for any previous operation
+		printf("Program Error at 0x%08lX, FLASH busy\n",address);
+		return LFS_ERR_IO;
+	}
+	FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR; // clear status flags (write 1 to clear)
+	FLASH->CR |= FLASH_CR_PG;
+
+	for(uint32_t i=0;i<size;i+=2,dest++) {
+		uint16_t half = (uint16_t)(buffer[i] | (buffer[i+1] << 8)); // little endian, any source alignment
+		LFS_FLASH_STORE16(dest, half);
+		if(flash_wait_prog(max_polls) != LFS_ERR_OK) {
+			rc = LFS_ERR_IO;
+			break;
+		}
+		if(FLASH->SR & FLASH_SR_WRPRTERR) {
+			rc = LFS_ERR_IO;
+			break;
+		}
+		if((FLASH->SR & FLASH_SR_PGERR) || *dest != half) {
+			rc = LFS_ERR_CORRUPT;
+			break;
+		}
+	}
+
+	FLASH->CR &= ~FLASH_CR_PG;
+	FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+	if(rc != LFS_ERR_OK)
+		printf("Program Error at 0x%08lX, %d\n",(uint32_t)dest,rc);
+	return rc;
+}
+
+static int lfs_prog_fast = LFS_PROG_FAST; // runtime selection, see "writespeed"
+
+// Program a region of a FLASH block in one programming burst
+static int flash_program(lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	lfs_block_t address = lfs_flash_start + (block * LFS_BLOCK_SIZE + off);
+	int rc;
+
+	//printf("+%s(Addr 0x%06lX, Len 0x%04lX)\r\n",__func__,address,size);
+	//hexdump((void *)address,size);
+  	lfs_flash_stats.prog_bursts++;
+  	uint32_t start_cycles = DWT->CYCCNT;
+  	if(lfs_prog_fast)
+  		rc = flash_program_fast(address, buffer, size);
+  	else
+  		rc = flash_program_hal(address, buffer, size);
+  	lfs_flash_stats.prog_cycles += DWT->CYCCNT - start_cycles;
   	//printf("-%s\n",__func__);
 
-  	return hal_rc == HAL_OK?LFS_ERR_OK:LFS_ERR_IO; // If HAL_OK, return LFS_ERR_OK, else return LFS_ERR_IO
+  	return rc;
 }
 
-// Erase a single FLASH sector (block)
-int lfs_erase(const struct lfs_config *c, lfs_block_t block)
+#if LFS_WRITEBACK
+// Write-back buffer
+// LittleFS programs FLASH in cache_size (64 byte) chunks.  Sequential chunks for the same page are
+// collected here and programmed as a single burst when:
+//   - LittleFS calls lfs_sync(), at the end of every metadata commit
+//   - the next program isn't sequential, or doesn't fit
+//   - the page is read back, through lfs_read() or (LittleFS syncs first) the direct mapping
+//   - any page is erased
+// LittleFS reads back each file data program to check it, so those are programmed right away and a
+// failed program is still reported for the block it failed in.  The chunks of a metadata commit or
+// compaction are only checked once the commit is complete, and are combined.
+// FLASH always holds a prefix of the programs LittleFS made, in order, so power-loss behavior
+// is unchanged.
+static struct {
+	lfs_block_t block;
+	lfs_off_t   off;
+	lfs_size_t  size; // bytes held, 0 if empty
+	uint32_t    data[LFS_WRITEBACK_SIZE/sizeof(uint32_t)];
+} writeback;
+
+// Return 1 if the write-back buffer holds data for the block
+static int writeback_holds(lfs_block_t block)
+{
+	return writeback.size && writeback.block == block;
+}
+
+// Program anything held in the write-back buffer
+static int writeback_drain(void)
+{
+	if(!writeback.size) return LFS_ERR_OK;
+	int rc = flash_program(writeback.block, writeback.off, writeback.data, writeback.size);
+	writeback.size = 0;
+	return rc;
+}
+#endif
+
+// Program a region in a FLASH block.  LittleFS always programs multiples of prog_size (8 bytes).
+int lfs_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
 {
 	PARAMETER_NOT_USED(c);
-	lfs_block_t address = FLASH_USER_START_ADDR + (block * STM32F103_SECTOR_SIZE);
+  	lfs_flash_stats.prog_calls++;
+  	lfs_flash_stats.prog_bytes += size;
+  	PAGE_BIT_SET(page_known,block); // page is no longer blank
+  	PAGE_BIT_CLR(page_blank,block);
+  	PAGE_BIT_CLR(page_preerased,block);
+
+#if LFS_WRITEBACK
+  	// Not a continuation of the buffered data?  Program what we have first.
+  	if(writeback.size && (writeback.block != block || writeback.off + writeback.size != off ||
+  			writeback.size + size > LFS_WRITEBACK_SIZE)) {
+  		int err = writeback_drain();
+  		if(err) return err;
+  	}
+  	if(size > LFS_WRITEBACK_SIZE)
+  		return flash_program(block, off, buffer, size); // too big to buffer
+  	if(!writeback.size) {
+  		writeback.block = block;
+  		writeback.off = off;
+  	}
+  	memcpy((uint8_t *)writeback.data + writeback.size, buffer, size);
+  	writeback.size += size;
+  	return LFS_ERR_OK;
+#else
+  	return flash_program(block, off, buffer, size);
+#endif
+}
+
+// Erase a single LittleFS block (LFS_PAGES_PER_BLOCK FLASH pages), updating the erased page tracking
+static int flash_erase_page(lfs_block_t block)
+{
+	lfs_block_t address = lfs_flash_start + (block * LFS_BLOCK_SIZE);
 	//printf("+%s(Addr 0x%06lX)\r\n",__func__,address);
 
 	HAL_StatusTypeDef hal_rc;
@@ -97,8 +314,10 @@ int lfs_erase(const struct lfs_config *c, lfs_block_t block)
 	/* Fill EraseInit structure*/
 	EraseInitStruct.TypeErase   = FLASH_TYPEERASE_PAGES;
 	EraseInitStruct.PageAddress = address;
-	EraseInitStruct.NbPages     = 1;
+	EraseInitStruct.NbPages     = LFS_PAGES_PER_BLOCK;
 	hal_rc = HAL_FLASHEx_Erase(&EraseInitStruct, &PAGEError);
+	if(hal_rc == HAL_OK)
+		PAGE_BIT_SET(page_blank,block); // known to be blank until programmed
 //	if (hal_rc != HAL_OK)
 //	{
 //		printf("%s ERROR 0x%X\n",__func__,hal_rc);
@@ -109,16 +328,80 @@ int lfs_erase(const struct lfs_config *c, lfs_block_t block)
   	return hal_rc == HAL_OK?LFS_ERR_OK:LFS_ERR_IO; // If HAL_OK, return LFS_ERR_OK, else return LFS_ERR_IO
 }
 
+// Erase a single FLASH sector (block)
+int lfs_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	PARAMETER_NOT_USED(c);
+	lfs_flash_stats.erase_calls++;
+
+#if LFS_WRITEBACK
+	// Keep programs and erases in order
+	int err = writeback_drain();
+	if(err) return err;
+#endif
+
+	// Already blank?  Nothing to do.
+	if(page_is_blank(block)) {
+		lfs_flash_stats.erase_skipped++;
+		if(PAGE_BIT_TST(page_preerased,block)) {
+			// lfs_idle() already paid for this erase
+			PAGE_BIT_CLR(page_preerased,block);
+			lfs_flash_stats.preerase_hits++;
+		}
+		return LFS_ERR_OK;
+	}
+
+	return flash_erase_page(block);
+}
+
 
 int lfs_sync(const struct lfs_config *c)
 {
   PARAMETER_NOT_USED(c);
-  // write function performs no caching.  No need for sync.
   //printf("+%s()\r\n",__func__);
+#if LFS_WRITEBACK
+  // Everything programmed before a sync must be on FLASH when we return
+  return writeback_drain();
+#else
+  // write function performs no caching.  No need for sync.
   return LFS_ERR_OK;
+#endif
   //return LFS_ERR_IO;
 }
 
+#ifdef CRC
+// CRC-32 for LittleFS using the STM32 CRC calculation unit (LFS_CRC_BACKEND = LFS_CRC_HW)
+// The unit uses LittleFS's polynomial, but shifts MSB first, takes 32-bit words, and always starts from
+// 0xFFFFFFFF after a reset.  LittleFS's CRC is bit reflected (LSB first), so the words fed to the unit
+// and the result are bit reversed (RBIT).  To continue from LittleFS's running CRC, the first word
+// written is the one that takes the unit from 0xFFFFFFFF to that CRC: found by undoing 32 shift steps.
+// Bytes that don't make a whole word are done in software.
+uint32_t lfs_crc_hw(uint32_t crc, const void *buffer, size_t size)
+{
+	const uint8_t *data = buffer;
+	size_t words = size / 4;
+
+	if(words < 2) return lfs_crc_nibble(crc, buffer, size); // not worth loading the unit
+
+	if(!(RCC->AHBENR & RCC_AHBENR_CRCEN))
+		__HAL_RCC_CRC_CLK_ENABLE();
+
+	uint32_t seed = __RBIT(crc);
+	for(int i=0;i<32;i++)
+		seed = (seed & 1) ? ((seed ^ 0x04C11DB7) >> 1) | 0x80000000 : seed >> 1;
+	CRC->CR = CRC_CR_RESET;
+	CRC->DR = seed ^ 0xFFFFFFFF;
+
+	for(size_t i=0;i<words;i++,data+=4) {
+		uint32_t word;
+		memcpy(&word, data, 4); // Cortex-M3 handles unaligned word loads
+		CRC->DR = __RBIT(word);
+	}
+	crc = __RBIT(CRC->DR);
+	return lfs_crc_nibble(crc, data, size & 3);
+}
+#endif
+
 #define READ_SIZE       			1   // Minimum size of a block read. All read operations will be a multiple of this value.
 #define PROGRAM_SIZE				8   // Minimum size of a block program. All program operations will be a multiple of this value.
 #define CACHE_SIZE 				64 // Must be a multiple of the read and program sizes, and a factor of the block size.
@@ -131,6 +414,21 @@ lfs_t lfs;
 uint32_t read_buffer[CACHE_SIZE/sizeof(uint32_t)];              // Uses CACHE_SIZE for size, align the buffer to 4 byte boundary
 uint32_t program_buffer[CACHE_SIZE/sizeof(uint32_t)];           // Uses CACHE_SIZE for size, align the buffer to 4 byte boundary
 uint32_t lookahead_buffer[LOOKAHEAD_CACHE_SIZE/sizeof(uint32_t)]; // 32-bit alignment, multiple of 8 bytes
+#if LFS_RCACHE_SLOTS && !LFS_DIRECT_MAPPED
+#define LFS_RCACHE_USED 		LFS_RCACHE_SLOTS // direct mapped reads don't use the read cache
+uint32_t rcache_slot_buffer[LFS_RCACHE_BUFFER_SIZE(LFS_RCACHE_SLOTS,CACHE_SIZE)/sizeof(uint32_t)];
+#else
+#define LFS_RCACHE_USED 		0
+#endif
+#if LFS_DCACHE_SIZE
+lfs_dentry_t dcache_buffer[LFS_DCACHE_SIZE];
+#endif
+#if LFS_WEAR_TYPE
+#if !LFS_FREE_BITMAP
+#error "LFS_WEAR_TYPE needs LFS_FREE_BITMAP, least worn allocation picks from the whole bitmap"
+#endif
+uint8_t wear_buffer[2*LFS_MAX_BLOCKS]; // erase count of each block, 16-bit little-endian
+#endif
 
 struct lfs_config lfs_cfg =
 {
@@ -141,8 +439,8 @@ struct lfs_config lfs_cfg =
     .sync = lfs_sync,    // sync function
     .read_size = 1,      // minimum read size (Our Flash interface supports single byte reads)
     .prog_size = 8,      // minimum program size (Our Flash interface supports 8 byte writes)
-    .block_size = STM32F103_SECTOR_SIZE,       // block_size - 4KByte erase sectors
-    .block_count = STM32F103_SECTOR_COUNT,     // block_count - number of sectors
+    .block_size = LFS_BLOCK_SIZE,        // block_size - LFS_PAGES_PER_BLOCK 1K FLASH pages
+    .block_count = 0,                    // block_count - set by lfs_init(), from the FLASH size
     .block_cycles = 256,                 // block_cycles - suggested value: 100 - 1000
     .cache_size = CACHE_SIZE,            // cache_size - multiple of read and program block size
     .lookahead_size = LOOKAHEAD_CACHE_SIZE, // lookahead_size (multiple of 8)
@@ -155,8 +453,86 @@ struct lfs_config lfs_cfg =
     .name_max = LFS_NAME_MAX,           // name_max
     .file_max = LFS_FILE_MAX,           // file_max
     .attr_max = LFS_ATTR_MAX,           // attr_max
+    .metadata_max = LFS_METADATA_MAX,   // metadata_max - compact metadata logs at this size, 0 for block_size
+    .direct_map = NULL,                  // set by lfs_init() when LFS_DIRECT_MAPPED
+#if LFS_RCACHE_USED
+    .rcache_slots = LFS_RCACHE_SLOTS,    // rcache_slots - metadata read cache
+    .rcache_size = CACHE_SIZE,           // rcache_size - bytes per slot
+    .rcache_buffer = &rcache_slot_buffer, // rcache_buffer
+    .rcache_pin = true,                  // rcache_pin - keep the superblock pair cached
+#endif
+    .free_bitmap = LFS_FREE_BITMAP,      // free_bitmap - exact free block bitmap, in the lookahead buffer
+#if LFS_DCACHE_SIZE
+    .dcache_size = LFS_DCACHE_SIZE,      // dcache_size - path lookup cache entries
+    .dcache_buffer = &dcache_buffer,     // dcache_buffer
+#endif
+    .checkpoint_type = LFS_CHECKPOINT_TYPE, // checkpoint_type - mount checkpoint attribute on "/"
+    .compact_thresh = 0,                 // compact_thresh - lfs_fs_gc() compacts metadata logs past 7/8 full
+#if LFS_WEAR_TYPE
+    .wear_type = LFS_WEAR_TYPE,          // wear_type - erase counts attribute on "/", least worn allocation
+    .wear_buffer = &wear_buffer,         // wear_buffer
+#endif
+};
+
+uint32_t lfs_flash_start; // Address of the LittleFS region in FLASH
+
+// Where the file system starts, for known FLASH sizes.  Other sizes use the top quarter of FLASH.
+static const struct {
+	uint16_t flash_kb; // FLASH size
+	uint16_t start_kb; // file system start, KBytes from the start of FLASH
+} flash_layouts[] = {
+	{ 64,  44}, // 20 pages, only with LFS_FLASH_KB_OVERRIDE 64 or less on a 64K part
+	{128,  96}, // 32 pages
 };
 
+// Determine the FLASH region used by the file system, from the FLASH size register, at least LFS_FLASH_KB_OVERRIDE.
+// Sets lfs_flash_start, lfs_cfg.block_count, and lfs_cfg.direct_map.
+int lfs_flash_geometry(void)
+{
+	extern uint32_t _sidata, _sdata, _edata; // linker script symbols
+	uint32_t flash_kb = *(volatile uint16_t *)FLASHSIZE_BASE;
+	if(flash_kb < LFS_FLASH_KB_OVERRIDE)
+		flash_kb = LFS_FLASH_KB_OVERRIDE; // 64K parts with 128K of usable FLASH
+	uint32_t flash_size = flash_kb * 1024;
+	// F103 physical page size: 1K up to 128K (low / medium density), 2K above (high density, XL)
+	uint32_t page_size = (flash_kb > 128) ? 0x800 : 0x400;
+	uint32_t start = (flash_size - flash_size / 4 + page_size - 1) & ~(page_size - 1); // top quarter, whole pages
+
+	for(unsigned i=0;i<sizeof(flash_layouts)/sizeof(flash_layouts[0]);i++) {
+		if(flash_layouts[i].flash_kb == flash_kb)
+			start = flash_layouts[i].start_kb * 1024;
+	}
+	if(LFS_BLOCK_SIZE % page_size) {
+		// Erasing a block would erase the neighbouring block in the same page
+		printf("%s: %uK blocks are smaller than the %luK FLASH pages, %luK FLASH\r\n",
+			__func__,LFS_BLOCK_SIZE / 1024,page_size / 1024,flash_kb);
+		return LFS_ERR_INVAL;
+	}
+	if(flash_size - start > LFS_MAX_BLOCKS * LFS_BLOCK_SIZE)
+		start = flash_size - LFS_MAX_BLOCKS * LFS_BLOCK_SIZE;
+	lfs_flash_start = FLASH_BASE + start;
+	lfs_cfg.block_count = (flash_size - start) / LFS_BLOCK_SIZE;
+#if LFS_DIRECT_MAPPED
+	lfs_cfg.direct_map = (const void *)lfs_flash_start; // LittleFS reads the memory-mapped FLASH directly
+#endif
+
+	// The firmware image (code, constants, and .data initializers) must end below the file system
+	uint32_t image_end = (uint32_t)&_sidata + ((uint32_t)&_edata - (uint32_t)&_sdata);
+	if(image_end > lfs_flash_start) {
+		printf("%s: firmware (ends 0x%08lX) overlaps file system (0x%08lX), %luK FLASH\r\n",
+			__func__,image_end,lfs_flash_start,flash_kb);
+		return LFS_ERR_NOSPC;
+	}
+	if(lfs_cfg.block_count < 2) {
+		printf("%s: not enough FLASH for a file system, %luK FLASH\r\n",__func__,flash_kb);
+		return LFS_ERR_NOSPC;
+	}
+	return LFS_ERR_OK;
+}
+
+static int lfs_mounted; // set once lfs_init() has mounted the file system
+static uint32_t lfs_mount_cycles; // time lfs_init()'s lfs_mount() took
+
 // Initialize file system
 int lfs_init(void) {
     //printf("+%s()\r\n",__func__);
@@ -164,6 +540,14 @@ int lfs_init(void) {
 //    char buf[30]; // read bootcount.txt file into this buffer
 //    lfs_file_t file;
 
+    // Enable the DWT cycle counter, used to measure FLASH programming time
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    // Where is the file system, and how big is it?
+    err = lfs_flash_geometry();
+    if(err) return err;
+
     // Test the buffers.  Are they all non-zero?
     if(!lfs_cfg.read_buffer || !lfs_cfg.prog_buffer) {
         printf("Buffer problems!! read_buffer: 0x%08lX, program_buffer: 0x%08lX\r\n",
@@ -173,7 +557,9 @@ int lfs_init(void) {
 
     // mount the filesystem
     //printf("%s, mounting filesystem\n",__func__);
+    uint32_t start = LFS_BENCH_CYCLES();
     err = lfs_mount(&lfs, &lfs_cfg);
+    lfs_mount_cycles = LFS_BENCH_CYCLES() - start;
 
     // reformat if we can't mount the filesystem
     // this should only happen on the first boot
@@ -184,6 +570,10 @@ int lfs_init(void) {
         err = lfs_mount(&lfs, &lfs_cfg);
         printf("lfs_mount - returned: %d\r\n",err);
     }
+    lfs_mounted = (err == LFS_ERR_OK);
+    if(lfs_mounted)
+        printf("lfs_mount: %lu us (%s)\r\n",lfs_mount_cycles / (SystemCoreClock / 1000000),
+            lfs.checkpoint_used ? "checkpoint" : "full scan");
 
 #if 0
     // The following block of code implements a "Boot Count", using a file in the file system.
@@ -219,6 +609,67 @@ int lfs_init(void) {
     return err;
 }
 
+// Idle time FLASH maintenance, called from the main loop while waiting for commands.
+// Pre-erase the next few blocks the LittleFS allocator will hand out, so the erase LittleFS
+// requests when it allocates them becomes a no-op instead of a 20-40ms stall in the middle of a command.
+// Only one page is erased per call, keeping the main loop responsive.
+// Once those are erased, run garbage collection steps for up to LFS_GC_BUDGET_US, then update the mount
+// checkpoint if the file system has changed, so the next boot mounts without scanning all the metadata,
+// and save the erase counts if any blocks have been erased.  Either is a commit to the superblock pair,
+// which never moves, so one is written at most once every LFS_CHECKPOINT_INTERVAL_S.
+void lfs_idle(void)
+{
+	if(!lfs_mounted) return;
+
+#if LFS_PREERASE_AHEAD
+	lfs_block_t blocks[LFS_PREERASE_AHEAD];
+
+	lfs_ssize_t count = lfs_fs_nextfree(&lfs, blocks, LFS_PREERASE_AHEAD);
+	for(lfs_ssize_t i=0;i<count;i++) {
+		if(page_is_blank(blocks[i])) continue; // nothing to do
+		if(flash_erase_page(blocks[i]) == LFS_ERR_OK) {
+			PAGE_BIT_SET(page_preerased,blocks[i]);
+			lfs_flash_stats.preerased++;
+		}
+		return; // one page per call
+	}
+#endif
+
+#if LFS_GC_BUDGET_US
+	// A pass over the metadata, in steps, whenever something has been programmed since the last pass
+	static uint32_t gc_prog_calls = (uint32_t)-1; // lfs_prog() calls when the last pass finished
+	if(gc_prog_calls != lfs_flash_stats.prog_calls) {
+		uint32_t cycles_per_us = SystemCoreClock / 1000000;
+		uint32_t start = DWT->CYCCNT;
+		do {
+			uint32_t erases = lfs_flash_stats.erase_calls;
+			uint32_t step = DWT->CYCCNT;
+			int more = lfs_fs_gc(&lfs);
+			step = DWT->CYCCNT - step;
+			lfs_flash_stats.gc_steps++;
+			if(lfs_flash_stats.erase_calls != erases) lfs_flash_stats.gc_compactions++;
+			if(step > lfs_flash_stats.gc_max_cycles) lfs_flash_stats.gc_max_cycles = step;
+			if(more <= 0) {
+				gc_prog_calls = lfs_flash_stats.prog_calls;
+				break;
+			}
+		} while(DWT->CYCCNT - start < LFS_GC_BUDGET_US * cycles_per_us);
+		if(gc_prog_calls != lfs_flash_stats.prog_calls) return; // checkpoint after the pass
+	}
+#endif
+
+#if LFS_CHECKPOINT_TYPE || LFS_WEAR_TYPE
+	// lfs_fs_checkpoint() saves whichever of the two is out of date, the erase counts on their own
+	// when there is no checkpoint, in one commit.
+	static uint32_t checkpoint_tick; // HAL_GetTick() when the last one was written (or boot)
+	if((lfs.checkpoint_stale || lfs.wear_erases) &&
+			HAL_GetTick() - checkpoint_tick >= LFS_CHECKPOINT_INTERVAL_S * 1000UL) {
+		lfs_fs_checkpoint(&lfs);
+		checkpoint_tick = HAL_GetTick();
+	}
+#endif
+}
+
 //=================================================================================================
 // Command Line functions that interface with LittleFS
 //=================================================================================================
@@ -261,12 +712,60 @@ int cl_dir(void)
 	// Display totals and expected space remaining
 	// Calculate number of 1024 byte blocks used and subtract from number of blocks allocated for the file system
 	lfs_ssize_t blocks_used = lfs_fs_size(&lfs);
-	uint32_t bytes_remaining = (STM32F103_SECTOR_COUNT - blocks_used) * STM32F103_SECTOR_SIZE;
+	uint32_t bytes_remaining = (lfs_cfg.block_count - blocks_used) * lfs_cfg.block_size;
 	//printf("\nFile count: %lu\nBytes total: %lu\nBytes remaining %lu\n",file_count,total_bytes,bytes_remaining);
-	printf("\nFile count: %lu\nBytes total: %lu\nSectors Used: %lu\nBytes remaining %lu\n",file_count,total_bytes,blocks_used,bytes_remaining);
+	printf("\nFile count: %lu\nBytes total: %lu\nBlocks Used: %lu\nBytes remaining %lu\n",file_count,total_bytes,blocks_used,bytes_remaining);
  	return 0;
 }
 
+// lfs_fs_traverse() callback, counting blocks (directories are seen twice, through their parent and the
+// directory list, and files open for writing may share blocks)
+static uint32_t lfs_counted[(LFS_MAX_BLOCKS + 31) / 32];
+static int lfs_count_block(void * count, lfs_block_t block)
+{
+	if(block < LFS_MAX_BLOCKS && !(lfs_counted[block / 32] & (1U << (block % 32)))) {
+		lfs_counted[block / 32] |= 1U << (block % 32);
+		*(uint32_t *)count += 1;
+	}
+	return 0;
+}
+
+// Display the FLASH region and block geometry used by the file system.  "lfs check" also checks the free bitmap.
+int cl_lfs(void)
+{
+	uint32_t flash_kb = *(volatile uint16_t *)FLASHSIZE_BASE;
+	if(flash_kb < LFS_FLASH_KB_OVERRIDE)
+		printf("Processor Flash: %luK bytes (%uK used, LFS_FLASH_KB_OVERRIDE)\n",flash_kb,LFS_FLASH_KB_OVERRIDE);
+	else
+		printf("Processor Flash: %luK bytes\n",flash_kb);
+	printf("File system: 0x%08lX - 0x%08lX\n",lfs_flash_start,lfs_flash_start + lfs_cfg.block_count * lfs_cfg.block_size - 1);
+	printf("Block size: %lu bytes (%u pages), Block count: %lu\n",lfs_cfg.block_size,LFS_PAGES_PER_BLOCK,lfs_cfg.block_count);
+	printf("Mounted: %s\n",lfs_mounted ? "yes" : "no");
+	printf("Free block bitmap: %s\n",lfs_cfg.free_bitmap ? (lfs.free.size ? "built" : "not built yet") : "off (lookahead window)");
+	printf("Mount: %lu us, %s\n",lfs_mount_cycles / (SystemCoreClock / 1000000),
+		!lfs_cfg.checkpoint_type ? "full scan (checkpoint off)" : lfs.checkpoint_used ? "from checkpoint" : "full scan");
+	if(lfs_mounted && argc > 1 && strcmp(argv[1],"check") == 0) {
+		// Compare the free bitmap with a traversal of the file system
+		lfs_ssize_t leaked = lfs_fs_checkfree(&lfs);
+		if(leaked < 0) {
+			printf("Free bitmap check failed: %ld\n",leaked);
+			return leaked;
+		}
+		printf("Free bitmap check passed, %ld blocks waiting for a rebuild\n",leaked);
+		uint32_t counted = 0;
+		memset(lfs_counted,0,sizeof(lfs_counted));
+		lfs_fs_traverse(&lfs, lfs_count_block, &counted);
+		printf("Blocks used: %ld (traversal: %lu)\n",lfs_fs_size(&lfs),counted);
+	}
+	if(lfs_mounted && argc > 1 && strcmp(argv[1],"checkpoint") == 0) {
+		// Write the mount checkpoint now, instead of waiting for lfs_idle()
+		int err = lfs_fs_checkpoint(&lfs);
+		printf("Checkpoint: %s (%d)\n",err ? "failed" : "written",err);
+		return err;
+	}
+	return 0;
+}
+
 // Make a directory..  Required 1 argument, the directory name
 int cl_make_dir(void)
 {
@@ -374,12 +873,18 @@ int cl_make_file_4kb(void)
 // Display file - Type...  Requires 1 argument, the filename
 int cl_cat(void)
 {
-    lfs_file_t file;
     char buffer[120]; // buffer to hold a line+ from the file
 
     // Returns a negative error code on failure.
+#if LFS_COMPRESS
+    static LFSZ file; // compressed files are displayed decompressed, static to keep its chunk off the stack
+    int retval = lfsz_open(&file, &lfs,
+        argv[1], LFS_O_RDONLY);
+#else
+    lfs_file_t file;
     int retval = lfs_file_open(&lfs, &file,
         argv[1], LFS_O_RDONLY);
+#endif
 
     if(retval != LFS_ERR_OK) {
         printf("%s: Error opening file \"%s\"\n",__func__,argv[1]);
@@ -391,7 +896,11 @@ int cl_cat(void)
     int bytesread;
     char c;
     do {
+#if LFS_COMPRESS
+        bytesread = lfsz_read(&file, buffer, sizeof(buffer));
+#else
         bytesread = lfs_file_read(&lfs, &file, buffer, sizeof(buffer));
+#endif
         if(bytesread < LFS_ERR_OK) {
             printf("%s: Error reading file \"%s\"\n",__func__,argv[1]);
         }
@@ -405,7 +914,11 @@ int cl_cat(void)
     } while(bytesread); // keep looping as long as we keep getting data from file
 
     // Close file before returning
+#if LFS_COMPRESS
+    lfsz_close(&file);
+#else
     lfs_file_close(&lfs, &file);
+#endif
     printf("\n\n");
 
     return LFS_ERR_OK;
@@ -518,46 +1031,509 @@ int cl_rename(void)
     return retval;
 } // cl_rename()
 
-// Assume timer 4 is enabled and configured to clock at 1us (1MHz) rate
-// This command requires 1 command line argument, <file name>
-// The time it takes to open the file, read the file, and close the file will be measured and reported.
+// This command requires 1 command line argument, <file name>, and reads it [bytes per read] (default 1024) at a time.
+// The time it takes to open the file, read the file, and close the file will be measured (DWT cycle counter) and
+// reported, along with the lfs_read() calls it took: with the file's 64 byte cache, then with a readahead buffer
+// (LFS_READAHEAD_SIZE, when FLASH reads aren't direct mapped).  Reads of 64 bytes or more skip the file cache.
 int cl_readspeed(void)
+{
+#if LFS_READAHEAD_SIZE
+    static uint8_t readahead[LFS_READAHEAD_SIZE];
+    const struct lfs_file_config cfgs[2] = {
+        { .readahead_buffer = NULL },
+        { .readahead_buffer = readahead, .readahead_size = LFS_READAHEAD_SIZE },
+    };
+    #define READSPEED_PASSES 2 // with the file cache, then with the readahead buffer
+#else
+    const struct lfs_file_config cfgs[1] = {{ .readahead_buffer = NULL }};
+    #define READSPEED_PASSES 1
+#endif
+    uint32_t cycles_per_us = SystemCoreClock / 1000000;
+    uint8_t buf[1024];
+    uint32_t read_size = sizeof(buf);
+    int retval = LFS_ERR_OK;
+
+    if(argc > 2) read_size = strtoul(argv[2],NULL,0);
+    if(read_size < 1 || read_size > sizeof(buf)) read_size = sizeof(buf);
+
+    for(int pass=0;pass<READSPEED_PASSES && retval == LFS_ERR_OK;pass++) {
+        lfs_file_t file;
+        LFS_FLASH_STATS before = lfs_flash_stats;
+        uint32_t start = DWT->CYCCNT;
+
+        // Returns a negative error code on failure.
+        retval = lfs_file_opencfg(&lfs, &file,
+            argv[1], LFS_O_RDONLY, &cfgs[pass]);
+
+        if(retval != LFS_ERR_OK) {
+            printf("%s: Error opening file \"%s\"\n",__func__,argv[1]);
+            return retval;
+        }
+
+        int bytes_read = 0;
+        uint32_t total_bytes_read = 0;
+        // Loop, reading the file read_size bytes at a time, until the entire file has been read
+        do {
+            bytes_read = lfs_file_read(&lfs, &file, buf, read_size);
+            if(bytes_read < LFS_ERR_OK) {
+                printf("%s: Error reading file \"%s\"\n",__func__,argv[1]);
+                retval = bytes_read;
+                break; // done reading
+            }
+            total_bytes_read += bytes_read;
+
+        } while(bytes_read > 0); // keep looping as long as we keep getting data from file
+
+        lfs_file_close(&lfs, &file);
+
+        uint32_t us = (DWT->CYCCNT - start) / cycles_per_us;
+        printf("Read file: \"%s\", %lu byte reads%s, Time: %lu us, %lu KB/s, %lu lfs_read() calls\n",
+            argv[1],read_size,pass ? " with readahead" : "",us,
+            us ? (uint32_t)((uint64_t)total_bytes_read * 1000000 / 1024 / us) : 0,
+            lfs_flash_stats.read_calls - before.read_calls);
+    }
+    return retval;
+} // cl_readspeed()
+
+// Measure write throughput.  Requires 1 argument, <file name>, optional [KBytes] (default 4), optional "hal"
+// The file is created (or truncated) and filled with a data pattern, in 256 byte writes.
+// Reports total time, and FLASH programming cycles per KByte.  Use "hal" to compare against the
+// HAL_FLASH_Program() path.
+int cl_writespeed(void)
 {
     lfs_file_t file;
-    volatile TIM_TypeDef *TIMx = TIM4;
-    uint32_t start_us = TIMx->CNT; // read us hardware timer
+    uint8_t buf[256];
+    uint32_t kbytes = 4;
+    int retval;
 
-    // Returns a negative error code on failure.
-    int retval = lfs_file_open(&lfs, &file,
-        argv[1], LFS_O_RDONLY);
+    if(argc > 2) kbytes = strtoul(argv[2],NULL,0);
+    lfs_prog_fast = (argc > 3 && strcmp(argv[3],"hal") == 0) ? 0 : LFS_PROG_FAST;
+    const char * path = lfs_prog_fast ? "registers" : "HAL";
+
+    for(unsigned i=0;i<sizeof(buf);i++)
+        buf[i] = (uint8_t)i;
+
+    LFS_FLASH_STATS before = lfs_flash_stats;
+    uint32_t start_cycles = DWT->CYCCNT;
 
+    retval = lfs_file_open(&lfs, &file, argv[1], LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
     if(retval != LFS_ERR_OK) {
         printf("%s: Error opening file \"%s\"\n",__func__,argv[1]);
+        lfs_prog_fast = LFS_PROG_FAST;
         return retval;
     }
+    uint32_t written = 0;
+    for(uint32_t count=0;count<kbytes*1024/sizeof(buf);count++) {
+        retval = lfs_file_write(&lfs, &file, buf, sizeof(buf));
+        if(retval < LFS_ERR_OK) break;
+        written += retval;
+    }
+    int close_rc = lfs_file_close(&lfs, &file);
+    if(retval >= LFS_ERR_OK) retval = close_rc;
 
-    int bytes_read = 0;
-    int total_bytes_read = 0;
-    uint8_t buf[1024];
-    // Loop, reading the file into a 1K buffer, until the entire file has been read
-    do {
-    	bytes_read = lfs_file_read(&lfs, &file, buf, sizeof(buf));
-        if(bytes_read < LFS_ERR_OK) {
-            printf("%s: Error reading file \"%s\"\n",__func__,argv[1]);
-            break; // done reading
-        }
-        total_bytes_read += bytes_read;
+    lfs_prog_fast = LFS_PROG_FAST;
+    if(retval < LFS_ERR_OK) {
+        // No throughput for a write that didn't complete
+        printf("%s: Error writing file \"%s\" after %lu bytes, %d\n",__func__,argv[1],written,retval);
+        return retval;
+    }
 
-    } while(bytes_read > 0); // keep looping as long as we keep getting data from file
+    uint32_t total_cycles = DWT->CYCCNT - start_cycles;
+    uint32_t prog_cycles = lfs_flash_stats.prog_cycles - before.prog_cycles;
+    uint32_t prog_bytes = lfs_flash_stats.prog_bytes - before.prog_bytes;
+    uint32_t cycles_per_us = SystemCoreClock / 1000000;
+
+    printf("Wrote %lu KB to \"%s\" (%s), Time: %lu us\n",kbytes,argv[1],
+        path,total_cycles/cycles_per_us);
+    printf("Programmed %lu bytes in %lu calls, %lu bursts, %lu erases\n",prog_bytes,
+        lfs_flash_stats.prog_calls - before.prog_calls,lfs_flash_stats.prog_bursts - before.prog_bursts,
+        lfs_flash_stats.erase_calls - before.erase_calls);
+    if(prog_bytes)
+        printf("Programming: %lu cycles/KB (%lu us/KB)\n",
+            (uint32_t)((uint64_t)prog_cycles*1024/prog_bytes),(uint32_t)((uint64_t)prog_cycles*1024/prog_bytes/cycles_per_us));
+    return LFS_ERR_OK;
+} // cl_writespeed()
 
-    lfs_file_close(&lfs, &file);
+// Time random 16 byte reads of a file, default 200 reads, opened without and then with a CTZ skip-list index.
+// Both passes read the same positions.  Reports cycles per read and lfs_read() calls (direct mapped reads
+// don't call lfs_read()).
+int cl_seekspeed(void)
+{
+	static lfs_ctz_point_t seek_index[LFS_CTZ_INDEX_SIZE];
+	const struct lfs_file_config cfgs[2] = {
+		{ .ctz_index = NULL },
+		{ .ctz_index = seek_index, .ctz_index_size = LFS_CTZ_INDEX_SIZE },
+	};
+	uint32_t reads = 200;
+	int retval = LFS_ERR_OK;
+
+	if(argc > 2) reads = strtoul(argv[2],NULL,0);
+
+	printf("Index    Cycles/read  lfs_read() calls\n");
+	for(int pass=0;pass<2 && retval == LFS_ERR_OK;pass++) {
+		lfs_file_t file;
+		uint8_t buf[16];
+		uint32_t seed = 0x12345678;
+
+		retval = lfs_file_opencfg(&lfs, &file, argv[1], LFS_O_RDONLY, &cfgs[pass]);
+		if(retval != LFS_ERR_OK) {
+			printf("%s: Error opening file \"%s\"\n",__func__,argv[1]);
+			return retval;
+		}
+		lfs_soff_t size = lfs_file_size(&lfs, &file);
+		if(size <= 0) {
+			lfs_file_close(&lfs, &file);
+			printf("%s: \"%s\" is empty\n",__func__,argv[1]);
+			return LFS_ERR_INVAL;
+		}
 
-    uint32_t stop_us = TIMx->CNT; // read us hardware timer
-    if(stop_us < start_us) stop_us += 1<<16; // roll-over, add 16-bit roll-over offset
+		LFS_FLASH_STATS before = lfs_flash_stats;
+		uint32_t start = LFS_BENCH_CYCLES();
+		for(uint32_t i=0;i<reads;i++) {
+			seed = seed * 1103515245 + 12345;
+			lfs_file_seek(&lfs, &file, (seed >> 8) % size, LFS_SEEK_SET);
+			int bytes_read = lfs_file_read(&lfs, &file, buf, sizeof(buf));
+			if(bytes_read < LFS_ERR_OK) {
+				printf("%s: Error reading file \"%s\"\n",__func__,argv[1]);
+				retval = bytes_read;
+				break;
+			}
+		}
+		uint32_t cycles = LFS_BENCH_CYCLES() - start;
+		lfs_file_close(&lfs, &file);
 
-    printf("Read file: \"%s\", Time: %lu us\n",argv[1],stop_us-start_us);
-    return retval;
-} // cl_readspeed()
+		printf("%-8s %11lu  %lu\n",pass ? "ctz" : "none",reads ? cycles/reads : 0,
+			lfs_flash_stats.read_calls - before.read_calls);
+	}
+	return retval;
+} // cl_seekspeed()
+
+// Commit latency for several metadata_max limits: the whole block, then halving down to 256 bytes.
+// Small files in a scratch directory ("clat") are rewritten round robin, each rewrite (open, write, close) is
+// one directory commit.  Displays a histogram of the commit times, and how many had to compact (erase a page).
+// A smaller limit compacts more often, but each compaction copies less, lowering the worst case.
+int cl_commitlat(void)
+{
+	static const char * const bucket_names[] = {"<256us","<512us","<1ms","<2ms","<4ms","<8ms","<16ms","<32ms",">=32ms"};
+	#define COMMITLAT_BUCKETS (sizeof(bucket_names)/sizeof(bucket_names[0]))
+	uint32_t commits = 200;
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	lfs_size_t saved_max = lfs_cfg.metadata_max;
+	int retval = LFS_ERR_OK;
+
+	if(argc > 1) commits = strtoul(argv[1],NULL,0);
+
+	printf("metadata_max  avg us  max us  compactions ");
+	for(unsigned b=0;b<COMMITLAT_BUCKETS;b++) printf(" %6s",bucket_names[b]);
+	printf("\n");
+	for(lfs_size_t max = lfs_cfg.block_size; max >= 256 && retval == LFS_ERR_OK; max /= 2) {
+		uint32_t buckets[COMMITLAT_BUCKETS] = {0};
+		uint32_t total_us = 0, max_us = 0, compactions = 0;
+		char name[16];
+
+		lfs_cfg.metadata_max = max; // LittleFS reads the limit from the config on each commit
+		retval = lfs_mkdir(&lfs, "clat");
+		if(retval != LFS_ERR_OK) {
+			printf("%s: Error creating directory \"clat\"\n",__func__);
+			break;
+		}
+		for(uint32_t i=0;i<commits;i++) {
+			lfs_file_t file;
+			sprintf(name,"clat/f%lu",i % 8);
+			uint32_t erases = lfs_flash_stats.erase_calls;
+			uint32_t start = DWT->CYCCNT;
+			retval = lfs_file_open(&lfs, &file, name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+			if(retval == LFS_ERR_OK) {
+				lfs_ssize_t written = lfs_file_write(&lfs, &file, &i, sizeof(i));
+				retval = lfs_file_close(&lfs, &file);
+				if(written < 0) retval = written;
+			}
+			uint32_t us = (DWT->CYCCNT - start) / cycles_per_us;
+			if(retval != LFS_ERR_OK) {
+				printf("%s: Error writing \"%s\": %d\n",__func__,name,retval);
+				break;
+			}
+
+			unsigned b = 0;
+			while(b < COMMITLAT_BUCKETS - 1 && us >= (256UL << b)) b++;
+			buckets[b]++;
+			total_us += us;
+			if(us > max_us) max_us = us;
+			if(lfs_flash_stats.erase_calls != erases) compactions++;
+		}
+
+		// Clean up the scratch directory
+		for(uint32_t i=0;i<8 && i<commits;i++) {
+			sprintf(name,"clat/f%lu",i);
+			lfs_remove(&lfs, name);
+		}
+		lfs_remove(&lfs, "clat");
+
+		if(retval == LFS_ERR_OK) {
+			printf("%12lu %7lu %7lu  %11lu ",max,commits ? total_us/commits : 0,max_us,compactions);
+			for(unsigned b=0;b<COMMITLAT_BUCKETS;b++) printf(" %6lu",buckets[b]);
+			printf("\n");
+		}
+	}
+	lfs_cfg.metadata_max = saved_max;
+	return retval;
+} // cl_commitlat()
+
+#ifdef LFS_TXN
+// Updating several small files together: each file written on its own (open, write, close: one commit per file),
+// vs all of them staged in one transaction (lfs_txn_write(), one commit for the lot, which also makes the update
+// atomic).  Files are rewritten in a scratch directory ("txn"), [files] (up to LFS_TXN_MAX) per round.
+int cl_txnbench(void)
+{
+	static lfs_txn_t txn; // too large for the stack
+	uint32_t files = 4, rounds = 20;
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	int retval = LFS_ERR_OK;
+	char names[LFS_TXN_MAX][12];
+	uint32_t data[LFS_TXN_MAX][4];
+
+	if(argc > 1) files = strtoul(argv[1],NULL,0);
+	if(argc > 2) rounds = strtoul(argv[2],NULL,0);
+	if(files < 1 || files > LFS_TXN_MAX) {
+		printf("%s: 1 - %u files\n",__func__,LFS_TXN_MAX);
+		return LFS_ERR_INVAL;
+	}
+	for(uint32_t f=0;f<files;f++) sprintf(names[f],"txn/f%lu",f);
+
+	retval = lfs_mkdir(&lfs, "txn");
+	if(retval != LFS_ERR_OK) {
+		printf("%s: Error creating directory \"txn\"\n",__func__);
+		return retval;
+	}
+
+	printf("%lu files, %lu rounds\n",files,rounds);
+	printf("method        us/round  prog bytes/round  erases\n");
+	for(int pass=0;pass<2 && retval == LFS_ERR_OK;pass++) {
+		LFS_FLASH_STATS before = lfs_flash_stats;
+		uint32_t start = DWT->CYCCNT;
+		for(uint32_t r=0;r<rounds && retval == LFS_ERR_OK;r++) {
+			for(uint32_t f=0;f<files;f++) memset(data[f],r+f,sizeof(data[f]));
+			if(pass == 0) {
+				for(uint32_t f=0;f<files && retval == LFS_ERR_OK;f++) {
+					lfs_file_t file;
+					retval = lfs_file_open(&lfs, &file, names[f], LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+					if(retval == LFS_ERR_OK) {
+						lfs_ssize_t written = lfs_file_write(&lfs, &file, data[f], sizeof(data[f]));
+						retval = lfs_file_close(&lfs, &file);
+						if(written < 0) retval = written;
+					}
+				}
+			} else {
+				lfs_txn_begin(&lfs, &txn);
+				for(uint32_t f=0;f<files && retval == LFS_ERR_OK;f++) {
+					retval = lfs_txn_write(&lfs, &txn, names[f], data[f], sizeof(data[f]));
+				}
+				if(retval == LFS_ERR_OK) retval = lfs_txn_commit(&lfs, &txn);
+			}
+		}
+		uint32_t us = (DWT->CYCCNT - start) / cycles_per_us;
+		if(retval != LFS_ERR_OK) {
+			printf("%s: Error writing \"txn\" files: %d\n",__func__,retval);
+			break;
+		}
+		printf("%-12s %9lu  %16lu  %6lu\n",pass ? "transaction" : "file each",rounds ? us/rounds : 0,
+			rounds ? (lfs_flash_stats.prog_bytes - before.prog_bytes)/rounds : 0,
+			lfs_flash_stats.erase_calls - before.erase_calls);
+	}
+
+	// Clean up the scratch directory
+	for(uint32_t f=0;f<files;f++) lfs_remove(&lfs, names[f]);
+	lfs_remove(&lfs, "txn");
+	return retval;
+} // cl_txnbench()
+#endif // LFS_TXN
+
+// Display the FLASH block device counters.  "fsstat reset" clears them.
+// With LFS_DIRECT_MAPPED, reads are done in place by LittleFS and no longer show up as lfs_read() calls.
+// Clear the counters, run a command (dir, readspeed, ...), then display them to see what it cost.
+int cl_fsstat(void)
+{
+	if(argc > 1 && strcmp(argv[1],"reset") == 0) {
+		memset(&lfs_flash_stats,0,sizeof(lfs_flash_stats));
+		lfs.rcache_hits = lfs.rcache_misses = 0;
+		lfs.dcache_hits = lfs.dcache_misses = 0;
+		printf("FLASH counters cleared\n");
+		return 0;
+	}
+
+	printf("Direct mapped reads: %s\n",lfs_cfg.direct_map ? "yes" : "no");
+	if(lfs_cfg.rcache_slots)
+		printf("Read cache slots:  %10lu  hits: %lu  misses: %lu\n",lfs_cfg.rcache_slots,lfs.rcache_hits,lfs.rcache_misses);
+	if(lfs_cfg.dcache_size)
+		printf("Dentry cache:      %10lu  hits: %lu  misses: %lu\n",lfs_cfg.dcache_size,lfs.dcache_hits,lfs.dcache_misses);
+	printf("lfs_read() calls:  %10lu  bytes copied: %lu\n",lfs_flash_stats.read_calls,lfs_flash_stats.read_bytes);
+	printf("lfs_prog() calls:  %10lu  bytes:        %lu  cycles: %lu\n",lfs_flash_stats.prog_calls,lfs_flash_stats.prog_bytes,lfs_flash_stats.prog_cycles);
+	printf("Program bursts:    %10lu  (write-back buffer: %s)\n",lfs_flash_stats.prog_bursts,LFS_WRITEBACK ? "on" : "off");
+	printf("lfs_erase() calls: %10lu  skipped (already blank): %lu  blank checks: %lu\n",
+		lfs_flash_stats.erase_calls,lfs_flash_stats.erase_skipped,lfs_flash_stats.blank_checks);
+	printf("Idle pre-erased:   %10lu  erases moved off the critical path: %lu\n",
+		lfs_flash_stats.preerased,lfs_flash_stats.preerase_hits);
+	printf("Idle GC steps:     %10lu  compactions: %lu  longest step: %lu us\n",
+		lfs_flash_stats.gc_steps,lfs_flash_stats.gc_compactions,lfs_flash_stats.gc_max_cycles / (SystemCoreClock / 1000000));
+	return 0;
+} // cl_fsstat()
+
+// Display the erase count LittleFS keeps for each block (LFS_WEAR_TYPE), and how evenly they are spread.
+// These are the erases LittleFS asked for, "fsstat" shows how many lfs_erase() skipped or lfs_idle() did early.
+// Blocks in use are marked with '*' once the free bitmap is built.
+int cl_wear(void)
+{
+	if(!lfs.wear) {
+		printf("Erase counts are off (LFS_WEAR_TYPE)\n");
+		return 0;
+	}
+
+	uint32_t min = UINT32_MAX, max = 0, total = 0;
+	for(uint32_t block=0;block<lfs_cfg.block_count;block++) {
+		uint32_t count = lfs.wear[2*block] | (uint32_t)lfs.wear[2*block+1] << 8;
+		bool used = lfs_cfg.free_bitmap && lfs.free.size && (lfs.free.buffer[block / 32] & (1U << (block % 32)));
+		printf("%4lu:%6lu%c",block,count,used ? '*' : ' ');
+		if(block % 8 == 7 || block + 1 == lfs_cfg.block_count) printf("\n");
+		if(count < min) min = count;
+		if(count > max) max = count;
+		total += count;
+	}
+
+	uint32_t mean_x10 = total * 10 / lfs_cfg.block_count;
+	printf("Erases: %lu, min %lu, mean %lu.%lu, max %lu",total,min,mean_x10 / 10,mean_x10 % 10,max);
+	if(mean_x10) printf(" (max/mean %lu.%02lu)",max * 10 / mean_x10,(max * 1000 / mean_x10) % 100);
+	printf("\nNot yet saved: %lu erases\n",lfs.wear_erases);
+	return 0;
+} // cl_wear()
+
+#ifdef LFS_PROFILE
+// Per function profile, filled in by the LFS_PROF_BEGIN() / LFS_PROF_END() hooks in the public lfs_xxx() functions
+typedef struct {
+	const char * name;      // public function, NULL for an unused slot
+	uint32_t calls;
+	uint32_t total_us;
+	uint32_t max_us;
+	uint32_t reads;         // lfs_read() calls made (direct mapped reads aren't seen)
+	uint32_t progs;         // lfs_prog() calls made
+	uint32_t erases;        // lfs_erase() calls made
+	uint16_t hist[LFS_PROF_BUCKETS]; // call count per latency bucket, saturates
+} LFS_PROF_SLOT;
+
+static LFS_PROF_SLOT lfs_prof[LFS_PROF_SLOTS];
+static LFS_FLASH_STATS lfs_prof_stats; // FLASH counters when the call started
+static uint32_t lfs_prof_cycles;       // DWT cycle counter when the call started
+
+void lfs_prof_begin(const char * name)
+{
+	(void)name;
+	lfs_prof_stats = lfs_flash_stats;
+	lfs_prof_cycles = DWT->CYCCNT;
+}
+
+void lfs_prof_end(const char * name)
+{
+	uint32_t us = (DWT->CYCCNT - lfs_prof_cycles) / (SystemCoreClock / 1000000);
+	LFS_PROF_SLOT * slot = NULL;
+
+	// The name is a string literal in lfs.c, usually the same pointer each call
+	for(int i=0;i<LFS_PROF_SLOTS;i++) {
+		if(!lfs_prof[i].name || lfs_prof[i].name == name || strcmp(lfs_prof[i].name,name) == 0) {
+			slot = &lfs_prof[i];
+			break;
+		}
+	}
+	if(!slot) return; // no room, raise LFS_PROF_SLOTS
+
+	slot->name = name;
+	slot->calls++;
+	slot->total_us += us;
+	if(us > slot->max_us) slot->max_us = us;
+	slot->reads += lfs_flash_stats.read_calls - lfs_prof_stats.read_calls;
+	slot->progs += lfs_flash_stats.prog_calls - lfs_prof_stats.prog_calls;
+	slot->erases += lfs_flash_stats.erase_calls - lfs_prof_stats.erase_calls;
+
+	unsigned b = 0;
+	for(uint32_t t = us >> 3; t && b < LFS_PROF_BUCKETS - 1; t >>= 1) b++;
+	if(slot->hist[b] != UINT16_MAX) slot->hist[b]++;
+}
+
+// Display the LittleFS API profile, then clear it.  Each function is followed by its latency histogram,
+// buckets with no calls left out.
+int cl_fsprof(void)
+{
+	printf("Function              calls   avg us   max us    reads    progs   erases\n");
+	for(int i=0;i<LFS_PROF_SLOTS && lfs_prof[i].name;i++) {
+		LFS_PROF_SLOT * slot = &lfs_prof[i];
+		printf("%-20s %6lu %8lu %8lu %8lu %8lu %8lu\n",slot->name,slot->calls,slot->total_us / slot->calls,
+			slot->max_us,slot->reads,slot->progs,slot->erases);
+		printf("   ");
+		for(unsigned b=0;b<LFS_PROF_BUCKETS;b++) {
+			if(!slot->hist[b]) continue;
+			uint32_t bound = 8UL << b; // microseconds
+			if(b == LFS_PROF_BUCKETS - 1)
+				printf(" >=%lums:%u",(bound / 2) / 1000,slot->hist[b]);
+			else if(bound < 1000)
+				printf(" <%luus:%u",bound,slot->hist[b]);
+			else
+				printf(" <%lums:%u",bound / 1000,slot->hist[b]);
+		}
+		printf("\n");
+	}
+	if(lfs_cfg.direct_map) printf("(direct mapped reads aren't counted as reads)\n");
+	memset(lfs_prof,0,sizeof(lfs_prof));
+	return 0;
+} // cl_fsprof()
+#endif // LFS_PROFILE
+
+#if LFS_CRC_BENCH
+// Compare the CRC-32 backends against lfs_crc_nibble() (every length up to 64 bytes, at every alignment),
+// and time each one over a 1K buffer.  lfs_crc() uses the backend selected by LFS_CRC_BACKEND.
+int cl_crcbench(void)
+{
+	static const struct {
+		const char * name;
+		uint32_t (*crc)(uint32_t crc, const void *buffer, size_t size);
+	} backends[] = {
+		{"nibble", lfs_crc_nibble},
+		{"table",  lfs_crc_table},
+		{"slice4", lfs_crc_slice4},
+		{"slice8", lfs_crc_slice8},
+#ifdef CRC
+		{"hw",     lfs_crc_hw},
+#endif
+	};
+	static uint8_t data[1024+4];
+	uint32_t seed = 0x12345678;
+	int failures = 0;
+
+	for(unsigned i=0;i<sizeof(data);i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+
+	printf("lfs_crc() backend: %d\n",LFS_CRC_BACKEND);
+	printf("Backend    Result  Cycles/KB\n");
+	for(unsigned b=0;b<sizeof(backends)/sizeof(backends[0]);b++) {
+		int match = 1;
+		for(unsigned align=0;align<4;align++) {
+			for(unsigned len=0;len<=64;len++) {
+				if(backends[b].crc(0xFFFFFFFF, data+align, len) != lfs_crc_nibble(0xFFFFFFFF, data+align, len))
+					match = 0;
+			}
+		}
+		if(backends[b].crc(0xFFFFFFFF, data, 1024) != lfs_crc_nibble(0xFFFFFFFF, data, 1024))
+			match = 0;
+		failures += !match;
+
+		uint32_t start = LFS_BENCH_CYCLES();
+		for(int i=0;i<8;i++)
+			backends[b].crc(0xFFFFFFFF, data, 1024);
+		uint32_t cycles = (LFS_BENCH_CYCLES() - start) / 8;
+		printf("%-8s   %-6s  %lu\n",backends[b].name,match ? "ok" : "FAIL",cycles);
+	}
+	return failures;
+} // cl_crcbench()
+#endif
 
 
 
@@ -6,9 +6,9 @@
  *
  *  Using STM32 HAL interface modules, create an interface between the LittleFS file system
  *  and an STM32's unused FLASH Program Memory
- *  In this example, we will use a fixed FLASH block size, with a fixed address.
+ *  The file system uses the top of FLASH, sized at boot from the FLASH size register.
  */
-#include "main.h" // ADDR_FLASH_PAGE_96
+#include "main.h" // FLASH_BASE
 
 /**********************************************************************************************************************
  * Macro definitions
@@ -16,21 +16,195 @@
 /** This macro is used to suppress compiler messages about a parameter not being used in a function. */
 #define PARAMETER_NOT_USED(p) (void) ((p))
 
-#if 1 //
-// The following are for an STM32-F103RB, with 128K FLASH:
-#define FLASH_USER_START_ADDR   ADDR_FLASH_PAGE_96   /* Start @ of user Flash area */
-#define FLASH_USER_END_ADDR     ADDR_FLASH_PAGE_127 + FLASH_PAGE_SIZE   /* End @ of user Flash area */
-#define STM32F103_SECTOR_SIZE	0x400 /* 1K */
-#define STM32F103_SECTOR_COUNT  32
+// The LFS_xxx settings below may also be set from the compiler command line (-DLFS_DIRECT_MAPPED=0)
+
+// FLASH geometry
+// The LittleFS region is placed at the top of FLASH, for the FLASH size the FLASH size register reports, or
+// LFS_FLASH_KB_OVERRIDE if that is larger (see lfs_flash_geometry()):
+//    64K FLASH:  44K - 64K,  20 pages
+//   128K FLASH:  96K - 128K, 32 pages
+//   others:      top quarter, whole pages, at most STM32F103_MAX_PAGES
+#define STM32F103_PAGE_SIZE     0x400 /* 1K, physical FLASH erase page */
+#define STM32F103_MAX_PAGES     64    /* Most pages the file system may use */
+
+// Smallest FLASH size, in KBytes, the file system is placed for.  Parts reporting a larger size in the FLASH size
+// register use that.  The default, 128, keeps it at 96K - 128K on the STM32-F103RB and on the STM32-F103C8T6
+// parts that report 64K but have 128K of usable FLASH.  0 uses the FLASH size register alone, putting it at
+// 44K - 64K on a 64K part: only for firmware that ends below 44K (Release builds), with the FLASH region in the
+// linker script shrunk to match.  Changing this moves the file system, it is reformatted.
+#ifndef LFS_FLASH_KB_OVERRIDE
+#define LFS_FLASH_KB_OVERRIDE   128
+#endif
+
+// LittleFS block size, in physical pages: 1, 2 or 4 (1K, 2K or 4K blocks).
+// Larger blocks reduce metadata pair overhead and CTZ skip-list depth for large files,
+// but every file that isn't inlined uses at least one block.  Changing this reformats the file system.
+#ifndef LFS_PAGES_PER_BLOCK
+#define LFS_PAGES_PER_BLOCK     1
+#endif
+#define LFS_BLOCK_SIZE          (LFS_PAGES_PER_BLOCK * STM32F103_PAGE_SIZE)
+#define LFS_MAX_BLOCKS          (STM32F103_MAX_PAGES / LFS_PAGES_PER_BLOCK)
+
+extern uint32_t lfs_flash_start; // Address of the LittleFS region in FLASH, set by lfs_init()
+
+// The LittleFS region is ordinary memory-mapped FLASH.  With LFS_DIRECT_MAPPED set to 1, LittleFS reads,
+// compares and CRCs the FLASH in place, without calling lfs_read() or copying through its read cache.
+// Set to 0 to route all reads through lfs_read() (useful for comparing the two with "fsstat").
+#ifndef LFS_DIRECT_MAPPED
+#define LFS_DIRECT_MAPPED       1
+#endif
+
+// Counters maintained by the FLASH block device functions, displayed by the "fsstat" command
+typedef struct {
+	uint32_t read_calls;    // lfs_read() callbacks
+	uint32_t read_bytes;    // bytes copied out of FLASH by lfs_read()
+	uint32_t prog_calls;    // lfs_prog() callbacks
+	uint32_t prog_bytes;    // bytes programmed
+	uint32_t prog_bursts;   // FLASH programming bursts (controller setup / teardown)
+	uint32_t prog_cycles;   // CPU cycles spent programming FLASH (DWT cycle counter)
+	uint32_t erase_calls;   // lfs_erase() callbacks
+	uint32_t erase_skipped; // lfs_erase() calls satisfied without erasing (page already blank)
+	uint32_t blank_checks;  // pages blank checked (once per page until it is programmed or erased)
+	uint32_t preerased;     // pages erased ahead of time by lfs_idle()
+	uint32_t preerase_hits; // lfs_erase() calls that found the page already erased by lfs_idle()
+	uint32_t gc_steps;      // lfs_fs_gc() steps run by lfs_idle()
+	uint32_t gc_compactions;// lfs_fs_gc() steps that compacted metadata (erased a page)
+	uint32_t gc_max_cycles; // longest lfs_fs_gc() step
+} LFS_FLASH_STATS;
+
+extern LFS_FLASH_STATS lfs_flash_stats;
+
+// Program FLASH through the FLASH registers (1), instead of HAL_FLASH_Program() (0)
+#ifndef LFS_PROG_FAST
+#define LFS_PROG_FAST           1
+#endif
+
+// Half-word store that programs FLASH, in the register program path (the host build simulates it)
+#ifndef LFS_FLASH_STORE16
+#define LFS_FLASH_STORE16(address,half) (*(volatile uint16_t *)(address) = (half))
+#endif
+
+// Write-back buffer: collect sequential programs to the same page, programming them in one burst when LittleFS
+// calls lfs_sync() at the end of a metadata commit.  LittleFS syncs before reading such a page back through the
+// direct mapping.  LFS_WRITEBACK_SIZE bytes of RAM, a multiple of 8, up to LFS_BLOCK_SIZE.  0 to disable.
+#ifndef LFS_WRITEBACK
+#define LFS_WRITEBACK           1
+#endif
+#ifndef LFS_WRITEBACK_SIZE
+#define LFS_WRITEBACK_SIZE      LFS_BLOCK_SIZE
+#endif
+
+// LittleFS read cache slots: metadata blocks (superblock, directories) stay cached in RAM between reads,
+// least recently used slot replaced first, the superblock pair kept.  Each slot costs CACHE_SIZE + 20 bytes.
+// Only used when reads go through lfs_read() (LFS_DIRECT_MAPPED 0), 0 to disable.
+#ifndef LFS_RCACHE_SLOTS
+#define LFS_RCACHE_SLOTS        4
+#endif
+
+// Allocate from an exact bitmap of free blocks, kept in the lookahead buffer, instead of traversing the
+// file system every time the lookahead window runs out.  "lfs check" compares the bitmap with a traversal.
+#ifndef LFS_FREE_BITMAP
+#define LFS_FREE_BITMAP         1
+#endif
+
+// LittleFS dentry cache: path lookups remember which directory entry each name was found in (or that it
+// wasn't there), so repeat opens of a deep path skip searching the directories along it.  Each entry costs
+// 60 bytes, 0 to disable.
+#ifndef LFS_DCACHE_SIZE
+#define LFS_DCACHE_SIZE         6
+#endif
+
+// Entries in the CTZ skip-list index "seekspeed" opens its file with (struct lfs_file_config ctz_index),
+// remembering where blocks of the file are, so a seek walks the skip-list from the nearest one.  8 bytes each.
+#ifndef LFS_CTZ_INDEX_SIZE
+#define LFS_CTZ_INDEX_SIZE      8
+#endif
+
+// Readahead buffer "readspeed" opens files with (struct lfs_file_config readahead_buffer), bytes: once a file is
+// being read sequentially, a small read that misses fills it from the rest of the file's block, one lfs_read() call,
+// instead of the 64 byte file cache at a time.  Direct mapped reads don't go through lfs_read(), and don't need it.
+// 0 to disable.
+#ifndef LFS_READAHEAD_SIZE
+#if LFS_DIRECT_MAPPED
+#define LFS_READAHEAD_SIZE      0
 #else
-// The following are for an STM32-F103C8T6, with 64K FLASH:
-#define FLASH_USER_START_ADDR   ADDR_FLASH_PAGE_44   /* Start @ of user Flash area */
-#define FLASH_USER_END_ADDR     ADDR_FLASH_PAGE_63 + FLASH_PAGE_SIZE   /* End @ of user Flash area */
-#define STM32F103_SECTOR_SIZE	0x400 /* 1K */
-#define STM32F103_SECTOR_COUNT  20
+#define LFS_READAHEAD_SIZE      LFS_BLOCK_SIZE
+#endif
+#endif
+
+// Metadata log size limit (LittleFS metadata_max), bytes: directories are compacted once their log reaches this,
+// instead of the whole block, bounding the time one compaction takes with multi-page blocks.  Must be <= LFS_BLOCK_SIZE,
+// 0 for the whole block.  "commitlat" compares the commit latency of several limits.
+#ifndef LFS_METADATA_MAX
+#define LFS_METADATA_MAX        0
+#endif
+
+// Background garbage collection: lfs_idle() runs lfs_fs_gc() steps for up to this long per call, once the
+// pre-erasing is done, finishing orphan / move cleanup and compacting nearly full metadata pairs before a write
+// has to.  The budget is checked between steps, a step that compacts includes a page erase.  0 to disable.
+#ifndef LFS_GC_BUDGET_US
+#define LFS_GC_BUDGET_US        2000
+#endif
+
+// Mount checkpoint: when the file system has changed, lfs_idle() has LittleFS record where its metadata pairs
+// are, in a custom attribute of this type on "/".  The next mount only checks those pairs are unchanged instead of
+// reading and checksumming all of them, and scans them all if any have changed.  0 to disable.
+#ifndef LFS_CHECKPOINT_TYPE
+#define LFS_CHECKPOINT_TYPE     0xC7
+#endif
+
+// Least time between the mount checkpoints and erase count saves lfs_idle() writes, seconds.  Each one is a
+// commit to the superblock pair, blocks 0 and 1, which LittleFS never relocates, so writing one after every change
+// would wear them out ahead of the rest.  A mount after changes made since the last checkpoint just scans all the
+// metadata pairs.  "lfs checkpoint" writes one now.
+#ifndef LFS_CHECKPOINT_INTERVAL_S
+#define LFS_CHECKPOINT_INTERVAL_S 600
+#endif
+
+// Erase counts: LittleFS counts the erases of each block and allocates the least worn free block, instead of the
+// next one round-robin, so pages that hot files and metadata pairs keep freeing and reusing don't wear out first.
+// The counts are saved in a custom attribute of this type on "/", by lfs_idle() and unmount, with or without the
+// mount checkpoint, so a power loss only forgets the erases since then.  "wear" displays them.  They are logical
+// counts, the erases LittleFS asks for: one lfs_erase() skips because the page is already blank still counts, a
+// pre-erase by lfs_idle() doesn't (LittleFS counts it when it erases that page).  Needs LFS_FREE_BITMAP.
+// 2 bytes of RAM per block, 0 to disable.
+#ifndef LFS_WEAR_TYPE
+#define LFS_WEAR_TYPE           0xC8
+#endif
+
+// Number of upcoming free blocks lfs_idle() keeps erased ahead of the allocator, 0 to disable
+#ifndef LFS_PREERASE_AHEAD
+#define LFS_PREERASE_AHEAD      4
+#endif
+
+// LittleFS's CRC-32 implementation is selected with LFS_CRC_BACKEND (see lfs_util.h), in the project's
+// preprocessor defines: LFS_CRC_NIBBLE (64 byte table), LFS_CRC_TABLE (1K, default), LFS_CRC_SLICE4 (4K),
+// LFS_CRC_SLICE8 (8K), or LFS_CRC_HW (STM32 CRC unit, lfs_crc_hw()).
+// LFS_CRC_BENCH adds the "crcbench" command, comparing and timing all of them (links all the tables).
+#ifndef LFS_CRC_BENCH
+#define LFS_CRC_BENCH           0
+#endif
+
+// Transactions (lfs_txn_begin() ... lfs_txn_commit(), Core/LittleFS/lfs.h) are built with LFS_TXN in the project's
+// preprocessor defines, along with the "txnbench" command.
+
+// API profiling: with LFS_PROFILE in the project's preprocessor defines (the host build defines it), each public
+// lfs_xxx() call is timed in microseconds (DWT cycle counter) into a log2 histogram for its function, along with the
+// lfs_read(), lfs_prog() and lfs_erase() calls it made.  "fsprof" displays and clears them.
+// Room for LFS_PROF_SLOTS functions, 60 bytes each.
+#ifndef LFS_PROF_SLOTS
+#define LFS_PROF_SLOTS          24
+#endif
+#define LFS_PROF_BUCKETS        16 // calls taking < 8us, < 16us, ... < 131ms, longer
+
+// Cycle counter used by benchmark commands
+#ifndef LFS_BENCH_CYCLES
+#define LFS_BENCH_CYCLES()      (DWT->CYCCNT)
 #endif
 
 int lfs_init(void); // Initialization for LittleFS
+int lfs_flash_geometry(void); // Locate the file system in FLASH, called by lfs_init()
+void lfs_idle(void); // Idle time FLASH maintenance, call from the main loop
 
 // Command Line functions implemented within littlefs_interface.c:
 int cl_lfs(void);
@@ -45,10 +219,40 @@ int cl_cat(void);
 int cl_copy(void);
 int cl_file_dump(void);
 int cl_readspeed(void);
+int cl_writespeed(void);
+int cl_seekspeed(void);
+int cl_commitlat(void);
+int cl_txnbench(void);
+int cl_fsstat(void);
+int cl_wear(void);
+int cl_crcbench(void);
+int cl_fsprof(void);
+
+#if LFS_CRC_BENCH
+#define LFS_CRC_BENCH_COMMAND \
+{"crcbench",   "Compare and time the LittleFS CRC-32 backends",            1, cl_crcbench},
+#else
+#define LFS_CRC_BENCH_COMMAND
+#endif
+
+#ifdef LFS_TXN
+#define LFS_TXN_BENCH_COMMAND \
+{"txnbench",   "Time writing [files] on their own vs in one transaction [rounds]", 1, cl_txnbench},
+#else
+#define LFS_TXN_BENCH_COMMAND
+#endif
+
+#ifdef LFS_PROFILE
+#define LFS_PROF_COMMAND \
+{"fsprof",     "Display, then clear, the LittleFS API call latency histograms", 1, cl_fsprof},
+#else
+#define LFS_PROF_COMMAND
+#endif
 
 // Records to add into command line interface (command_line.c):
 #define LITTLEFS_COMMANDS \
 {"dir",        "Directory listing for file system",                         1, cl_dir}, \
+{"lfs",        "Display file system FLASH geometry, \"lfs check\" checks the free bitmap, \"lfs checkpoint\" writes the mount checkpoint", 1, cl_lfs}, \
 {"mkdir",      "Make Directory",                                            2, cl_make_dir}, \
 {"remove",     "Remove File/Directory (directory must be empty)",           2, cl_remove}, \
 {"makefile",   "Make a file <file name>",                                   2, cl_make_file}, \
@@ -56,5 +260,13 @@ int cl_readspeed(void);
 {"cat",        "Display text file (only printable text)",                   2, cl_cat}, \
 {"type",       "Display text file (only printable text)",                   2, cl_cat}, \
 {"copy",       "Copy file <source file name> <destination file name>",      3, cl_copy}, \
-{"readspeed",  "Display time to open, read, and close <file>",              2, cl_readspeed} \
+{"readspeed",  "Display time to open, read, and close <file> [bytes per read]", 2, cl_readspeed}, \
+{"writespeed", "Display time to write <file> [KBytes] [hal]",               2, cl_writespeed}, \
+{"seekspeed",  "Time random reads of <file> [reads], with and without the CTZ index", 2, cl_seekspeed}, \
+{"commitlat",  "Commit latency histogram for several metadata_max limits [commits]", 1, cl_commitlat}, \
+LFS_TXN_BENCH_COMMAND \
+LFS_CRC_BENCH_COMMAND \
+LFS_PROF_COMMAND \
+{"wear",       "Display the erase count of each block",                   1, cl_wear}, \
+{"fsstat",     "Display FLASH interface counters, \"fsstat reset\" to clear", 1, cl_fsstat} \
 
@@ -0,0 +1,418 @@
+/*
+ * littlefs_kv.c
+ *
+ *  Key-value store on LittleFS custom attributes (see littlefs_kv.h), and the "kvget", "kvset" and "kvbench" commands.
+ */
+
+#include <stdio.h> // printf()
+#include <string.h> // memcpy()
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "littlefs_kv.h"
+#include "command_line.h" // arc, argv[]
+
+#if LFS_KV_STORE
+extern lfs_t lfs;
+
+#define LFSKV_REMOVE            (-1) // lfskv_slot_write(): remove the attribute, the slot was never used
+
+// Bucket file path: "<store>/<bucket>"
+static void lfskv_path(char * path, const char * name, uint8_t bucket)
+{
+	sprintf(path,"%s/%u",name,bucket);
+}
+
+// Read a slot's entry: its size, 0 for a tombstone, or LFS_ERR_NOATTR for a slot that was never used.
+// Updates staged by a batch are seen before they are written.
+static int lfskv_slot_read(LFSKV * kv, uint8_t bucket, uint8_t slot, uint8_t * entry)
+{
+	char path[LFSKV_NAME_MAX+5];
+
+	for(uint8_t i=0;i<kv->staged_count;i++) {
+		LFSKV_STAGED * staged = &kv->staged[i];
+		if(staged->bucket == bucket && staged->slot == slot) {
+			memcpy(entry,staged->entry,staged->size);
+			return staged->size;
+		}
+	}
+	lfskv_path(path,kv->name,bucket);
+	return lfs_getattr(kv->lfs, path, slot, entry, LFSKV_ENTRY_MAX);
+}
+
+// Write each bucket's staged updates, one commit per bucket: the attributes of a lfs_file_opencfg()
+// opened for writing are committed by lfs_file_close(), even if no data was written
+static int lfskv_flush(LFSKV * kv)
+{
+	char path[LFSKV_NAME_MAX+5];
+	struct lfs_attr attrs[LFSKV_BATCH_MAX];
+	int retval = LFS_ERR_OK;
+
+	for(uint8_t bucket=0;bucket<LFSKV_BUCKETS && retval >= LFS_ERR_OK;bucket++) {
+		struct lfs_file_config config;
+		lfs_file_t file;
+
+		memset(&config,0,sizeof(config));
+		config.attrs = attrs;
+		for(uint8_t i=0;i<kv->staged_count;i++) {
+			LFSKV_STAGED * staged = &kv->staged[i];
+			if(staged->bucket != bucket) continue;
+			attrs[config.attr_count].type = staged->slot;
+			attrs[config.attr_count].buffer = staged->entry;
+			attrs[config.attr_count].size = staged->size;
+			config.attr_count++;
+		}
+		if(!config.attr_count) continue;
+
+		lfskv_path(path,kv->name,bucket);
+		retval = lfs_file_opencfg(kv->lfs, &file, path, LFS_O_WRONLY, &config);
+		if(retval >= LFS_ERR_OK) retval = lfs_file_close(kv->lfs, &file);
+	}
+	kv->staged_count = 0;
+	return retval;
+}
+
+// Write a slot: an entry of size bytes, 0 for a tombstone, or LFSKV_REMOVE.  A batch stages the update instead,
+// writing a tombstone for LFSKV_REMOVE, as a file's attributes can't be removed by its commit.
+static int lfskv_slot_write(LFSKV * kv, uint8_t bucket, uint8_t slot, const uint8_t * entry, int size)
+{
+	char path[LFSKV_NAME_MAX+5];
+
+	if(kv->batching) {
+		LFSKV_STAGED * staged = NULL;
+		for(uint8_t i=0;i<kv->staged_count;i++) {
+			if(kv->staged[i].bucket == bucket && kv->staged[i].slot == slot) staged = &kv->staged[i];
+		}
+		if(!staged) {
+			if(kv->staged_count == LFSKV_BATCH_MAX) {
+				int retval = lfskv_flush(kv);
+				if(retval < LFS_ERR_OK) return retval;
+			}
+			staged = &kv->staged[kv->staged_count++];
+			staged->bucket = bucket;
+			staged->slot = slot;
+		}
+		staged->size = (uint8_t)(size > 0 ? size : 0);
+		if(size > 0) memcpy(staged->entry,entry,(size_t)size);
+		return LFS_ERR_OK;
+	}
+
+	lfskv_path(path,kv->name,bucket);
+	if(size == LFSKV_REMOVE) return lfs_removeattr(kv->lfs, path, slot);
+	return lfs_setattr(kv->lfs, path, slot, entry, (lfs_size_t)size);
+}
+
+// Find key's entry, reading it into entry.  Returns the entry's size, with *slot set to its slot, or
+// LFS_ERR_NOENT with *slot set to where a new entry goes (LFSKV_SLOTS if the bucket is full).
+static int lfskv_find(LFSKV * kv, const char * key, uint8_t * bucket, uint8_t * slot, uint8_t * entry)
+{
+	size_t length = strlen(key);
+	if(length == 0 || length > LFSKV_KEY_MAX) return LFS_ERR_INVAL;
+
+	uint32_t hash = lfs_crc(0xFFFFFFFF, key, length);
+	*bucket = (uint8_t)(hash % LFSKV_BUCKETS);
+	*slot = LFSKV_SLOTS;
+	for(uint32_t i=0;i<LFSKV_SLOTS;i++) {
+		uint8_t probe = (uint8_t)((hash / LFSKV_BUCKETS + i) % LFSKV_SLOTS);
+		int size = lfskv_slot_read(kv, *bucket, probe, entry);
+		if(size == LFS_ERR_NOATTR) {
+			// Never used: key isn't stored past here
+			if(*slot == LFSKV_SLOTS) *slot = probe;
+			return LFS_ERR_NOENT;
+		}
+		if(size < LFS_ERR_OK) return size;
+		if(size == 0) {
+			// Tombstone: keep looking, but a new entry can go here
+			if(*slot == LFSKV_SLOTS) *slot = probe;
+			continue;
+		}
+		if(size <= LFSKV_ENTRY_MAX && entry[0] == length && (size_t)size > length &&
+				memcmp(&entry[1],key,length) == 0) {
+			*slot = probe;
+			return size;
+		}
+	}
+	return LFS_ERR_NOENT;
+}
+
+int lfskv_open(LFSKV * kv, lfs_t * lfs, const char * name)
+{
+	char path[LFSKV_NAME_MAX+5];
+	lfs_file_t file;
+
+	if(strlen(name) > LFSKV_NAME_MAX) return LFS_ERR_INVAL;
+	memset(kv,0,sizeof(*kv));
+	kv->lfs = lfs;
+	strcpy(kv->name,name);
+
+	int retval = lfs_mkdir(lfs, name);
+	if(retval < LFS_ERR_OK && retval != LFS_ERR_EXIST) return retval;
+	for(uint8_t bucket=0;bucket<LFSKV_BUCKETS;bucket++) {
+		lfskv_path(path,name,bucket);
+		retval = lfs_file_open(lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT);
+		if(retval >= LFS_ERR_OK) retval = lfs_file_close(lfs, &file);
+		if(retval < LFS_ERR_OK) return retval;
+	}
+	return LFS_ERR_OK;
+}
+
+int lfskv_get(LFSKV * kv, const char * key, void * value, uint16_t size)
+{
+	uint8_t entry[LFSKV_ENTRY_MAX];
+	uint8_t bucket, slot;
+
+	int retval = lfskv_find(kv, key, &bucket, &slot, entry);
+	if(retval < LFS_ERR_OK) return retval;
+	int value_size = retval - 1 - entry[0];
+	memcpy(value,&entry[1 + entry[0]],(size_t)(value_size < size ? value_size : size));
+	return value_size;
+}
+
+int lfskv_set(LFSKV * kv, const char * key, const void * value, uint16_t size)
+{
+	uint8_t entry[LFSKV_ENTRY_MAX];
+	uint8_t bucket, slot;
+
+	if(size > LFSKV_VALUE_MAX) return LFS_ERR_FBIG;
+	int retval = lfskv_find(kv, key, &bucket, &slot, entry);
+	if(retval < LFS_ERR_OK && retval != LFS_ERR_NOENT) return retval;
+	if(slot == LFSKV_SLOTS) return LFS_ERR_NOSPC;
+
+	uint8_t length = (uint8_t)strlen(key);
+	entry[0] = length;
+	memcpy(&entry[1],key,length);
+	memcpy(&entry[1 + length],value,size);
+	return lfskv_slot_write(kv, bucket, slot, entry, 1 + length + size);
+}
+
+int lfskv_delete(LFSKV * kv, const char * key)
+{
+	uint8_t entry[LFSKV_ENTRY_MAX];
+	uint8_t bucket, slot;
+
+	int retval = lfskv_find(kv, key, &bucket, &slot, entry);
+	if(retval < LFS_ERR_OK) return retval;
+
+	// If the next slot was never used, no lookup probes past this one, and it can become unused too
+	retval = lfskv_slot_read(kv, bucket, (uint8_t)((slot + 1) % LFSKV_SLOTS), entry);
+	if(retval < LFS_ERR_OK && retval != LFS_ERR_NOATTR) return retval;
+	return lfskv_slot_write(kv, bucket, slot, NULL, retval == LFS_ERR_NOATTR ? LFSKV_REMOVE : 0);
+}
+
+int lfskv_iterate(LFSKV * kv, LFSKV_CALLBACK callback, void * context)
+{
+	uint8_t entry[LFSKV_ENTRY_MAX];
+	char key[LFSKV_KEY_MAX+1];
+
+	for(uint8_t bucket=0;bucket<LFSKV_BUCKETS;bucket++) {
+		for(uint8_t slot=0;slot<LFSKV_SLOTS;slot++) {
+			int size = lfskv_slot_read(kv, bucket, slot, entry);
+			if(size == LFS_ERR_NOATTR || size == 0) continue;
+			if(size < LFS_ERR_OK) return size;
+			if(size > LFSKV_ENTRY_MAX || entry[0] == 0 || entry[0] > LFSKV_KEY_MAX || entry[0] >= size) continue;
+			memcpy(key,&entry[1],entry[0]);
+			key[entry[0]] = '\0';
+			int retval = callback(context, key, &entry[1 + entry[0]], (uint16_t)(size - 1 - entry[0]));
+			if(retval) return retval;
+		}
+	}
+	return 0;
+}
+
+int lfskv_begin(LFSKV * kv)
+{
+	kv->batching = 1;
+	return LFS_ERR_OK;
+}
+
+int lfskv_commit(LFSKV * kv)
+{
+	int retval = lfskv_flush(kv);
+	kv->batching = 0;
+	return retval;
+}
+
+int lfskv_close(LFSKV * kv)
+{
+	return kv->batching ? lfskv_commit(kv) : LFS_ERR_OK;
+}
+
+int lfskv_remove(lfs_t * lfs, const char * name)
+{
+	char path[LFSKV_NAME_MAX+5];
+
+	if(strlen(name) > LFSKV_NAME_MAX) return LFS_ERR_INVAL;
+	for(uint8_t bucket=0;bucket<LFSKV_BUCKETS;bucket++) {
+		lfskv_path(path,name,bucket);
+		int retval = lfs_remove(lfs, path);
+		if(retval < LFS_ERR_OK && retval != LFS_ERR_NOENT) return retval;
+	}
+	return lfs_remove(lfs, name);
+}
+
+// The store the commands use, static to keep its staging area off the stack
+static LFSKV kv_store;
+
+// Print a value, as text
+static void kvprint(const char * key, const void * value, uint16_t size)
+{
+	const char * text = value;
+	printf("%-*s ",LFSKV_KEY_MAX,key);
+	for(uint16_t i=0;i<size;i++)
+		printf("%c",(text[i] >= ' ' && text[i] <= '~') ? text[i] : '.');
+	printf("\n");
+}
+
+static int kvprint_entry(void * count, const char * key, const void * value, uint16_t size)
+{
+	kvprint(key, value, size);
+	(*(uint32_t *)count)++;
+	return 0;
+}
+
+// Display a setting, or all of them: kvget [key]
+int cl_kvget(void)
+{
+	char value[LFSKV_VALUE_MAX];
+	uint32_t count = 0;
+
+	int retval = lfskv_open(&kv_store, &lfs, LFSKV_STORE);
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error opening \"%s\", %d\n",__func__,LFSKV_STORE,retval);
+		return retval;
+	}
+	if(argc > 1) {
+		retval = lfskv_get(&kv_store, argv[1], value, sizeof(value));
+		if(retval >= LFS_ERR_OK)
+			kvprint(argv[1], value, (uint16_t)retval);
+		else
+			printf("%s: Error getting \"%s\", %d\n",__func__,argv[1],retval);
+	} else {
+		retval = lfskv_iterate(&kv_store, kvprint_entry, &count);
+		printf("%lu settings\n",count);
+	}
+	lfskv_close(&kv_store);
+	return retval < LFS_ERR_OK ? retval : LFS_ERR_OK;
+}
+
+// Set a setting, or delete it: kvset <key> [value]
+int cl_kvset(void)
+{
+	int retval = lfskv_open(&kv_store, &lfs, LFSKV_STORE);
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error opening \"%s\", %d\n",__func__,LFSKV_STORE,retval);
+		return retval;
+	}
+	if(argc > 2)
+		retval = lfskv_set(&kv_store, argv[1], argv[2], (uint16_t)strlen(argv[2]));
+	else
+		retval = lfskv_delete(&kv_store, argv[1]);
+	if(retval < LFS_ERR_OK)
+		printf("%s: Error %s \"%s\", %d\n",__func__,argc > 2 ? "setting" : "deleting",argv[1],retval);
+	int err = lfskv_close(&kv_store);
+	return retval < LFS_ERR_OK ? retval : err;
+}
+
+// Settings latency: set [keys] 8 byte settings [rounds] times, then get each of them, with a file per key
+// ("kvbfile/key00" ..., open + write + close), with a store (one lfs_setattr() per set), and with a store
+// batching each round's sets (one commit per bucket)
+int cl_kvbench(void)
+{
+	static const char * const paths[3] = {"file per key","kv set","kv batch"};
+	char key[LFSKV_KEY_MAX+1], path[LFSKV_KEY_MAX+10];
+	char value[9], read_back[LFSKV_VALUE_MAX];
+	uint32_t keys = 16;
+	uint32_t rounds = 4;
+	uint32_t cycles_per_us = SystemCoreClock / 1000000;
+	int retval = LFS_ERR_OK;
+
+	if(argc > 1) keys = strtoul(argv[1],NULL,0);
+	if(argc > 2) rounds = strtoul(argv[2],NULL,0);
+	if(keys > LFSKV_BUCKETS * LFSKV_SLOTS / 2) keys = LFSKV_BUCKETS * LFSKV_SLOTS / 2;
+	if(!keys || !rounds) return LFS_ERR_INVAL;
+
+	printf("%lu keys, set %lu times each, 8 byte values\n",keys,rounds);
+	printf("Path          Set us/key  Get us/key  Prog bytes/set  Erases/100 sets  Bad\n");
+	for(int pass=0;pass<3 && retval >= LFS_ERR_OK;pass++) {
+		lfs_file_t file;
+
+		if(pass == 0) {
+			retval = lfs_mkdir(&lfs, "kvbfile");
+			if(retval == LFS_ERR_EXIST) retval = LFS_ERR_OK;
+		} else {
+			lfskv_remove(&lfs, "kvbench");
+			retval = lfskv_open(&kv_store, &lfs, "kvbench");
+		}
+		if(retval < LFS_ERR_OK) {
+			printf("%s: Error creating the %s keys, %d\n",__func__,paths[pass],retval);
+			return retval;
+		}
+
+		LFS_FLASH_STATS before = lfs_flash_stats;
+		uint32_t start = DWT->CYCCNT;
+		for(uint32_t round=0;round<rounds && retval >= LFS_ERR_OK;round++) {
+			if(pass == 2) lfskv_begin(&kv_store);
+			for(uint32_t k=0;k<keys && retval >= LFS_ERR_OK;k++) {
+				sprintf(key,"key%02lu",k);
+				sprintf(value,"%08lx",(round << 16) | k);
+				if(pass == 0) {
+					sprintf(path,"kvbfile/%s",key);
+					retval = lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+					if(retval >= LFS_ERR_OK) {
+						retval = lfs_file_write(&lfs, &file, value, 8);
+						int err = lfs_file_close(&lfs, &file);
+						if(retval >= LFS_ERR_OK) retval = err;
+					}
+				} else {
+					retval = lfskv_set(&kv_store, key, value, 8);
+				}
+			}
+			if(pass == 2 && retval >= LFS_ERR_OK) retval = lfskv_commit(&kv_store);
+		}
+		uint32_t set_us = (DWT->CYCCNT - start) / cycles_per_us;
+		uint32_t prog_bytes = lfs_flash_stats.prog_bytes - before.prog_bytes;
+		uint32_t erases = lfs_flash_stats.erase_calls - before.erase_calls;
+		if(retval < LFS_ERR_OK) {
+			printf("%s: Error setting %s keys, %d\n",__func__,paths[pass],retval);
+			break;
+		}
+
+		// Get each key, checking it has the last round's value.  Gets don't program the FLASH, they are timed with
+		// the benchmark cycle counter (host CPU time in the host build, rather than modelled FLASH time).
+		uint32_t bad = 0;
+		start = LFS_BENCH_CYCLES();
+		for(uint32_t k=0;k<keys && retval >= LFS_ERR_OK;k++) {
+			sprintf(key,"key%02lu",k);
+			sprintf(value,"%08lx",((rounds - 1) << 16) | k);
+			if(pass == 0) {
+				sprintf(path,"kvbfile/%s",key);
+				retval = lfs_file_open(&lfs, &file, path, LFS_O_RDONLY);
+				if(retval >= LFS_ERR_OK) {
+					retval = lfs_file_read(&lfs, &file, read_back, sizeof(read_back));
+					lfs_file_close(&lfs, &file);
+				}
+			} else {
+				retval = lfskv_get(&kv_store, key, read_back, sizeof(read_back));
+			}
+			if(retval != 8 || memcmp(read_back,value,8) != 0) bad++;
+		}
+		uint32_t get_us = (LFS_BENCH_CYCLES() - start) / cycles_per_us;
+		uint32_t sets = keys * rounds;
+
+		printf("%-12s %11lu %11lu %15lu %16lu %4lu\n",paths[pass],
+			set_us/sets, get_us/keys,
+			prog_bytes/sets, erases*100/sets, bad);
+		if(bad && retval >= LFS_ERR_OK) retval = LFS_ERR_CORRUPT;
+	}
+
+	// Clean up
+	for(uint32_t k=0;k<keys;k++) {
+		sprintf(path,"kvbfile/key%02lu",k);
+		lfs_remove(&lfs, path);
+	}
+	lfs_remove(&lfs, "kvbfile");
+	lfskv_close(&kv_store);
+	lfskv_remove(&lfs, "kvbench");
+	return retval < LFS_ERR_OK ? retval : LFS_ERR_OK;
+}
+#endif // LFS_KV_STORE
@@ -0,0 +1,104 @@
+/*
+ * littlefs_kv.h
+ *
+ *  Key-value store for small settings, on top of LittleFS custom attributes.
+ *
+ *  A store is a directory of LFSKV_BUCKETS empty bucket files ("kv/0" ...).  A key's CRC-32 picks its bucket, and
+ *  the first of the bucket's LFSKV_SLOTS attribute types to try; an entry is stored in an attribute of the bucket
+ *  file, as uint8_t key length, key, value.  Lookups probe the following slots until the key, or a slot that has
+ *  never been used, is found.  Deleting an entry that other entries may have probed past leaves a zero length
+ *  attribute (tombstone) in its slot, which the next set can reuse.
+ *
+ *  Each lfskv_set() / lfskv_delete() is one metadata commit (lfs_setattr()), instead of a file open, write and
+ *  close.  Between lfskv_begin() and lfskv_commit(), updates are staged in RAM, and each bucket's staged updates
+ *  are written by a single commit when the batch is committed (or is full).  A batch is atomic per bucket only.
+ *
+ *  A bucket's entries are kept in its directory entry, so they must fit in a metadata pair along with it: keep
+ *  the entries small, a bucket full of the largest entries needs most of a 1K block.
+ */
+
+#ifndef _littlefs_kv_h_
+#define _littlefs_kv_h_
+
+#include <stdint.h>
+#include "lfs.h"
+
+// LFS_KV_STORE builds the key-value store and its "kvget", "kvset" and "kvbench" commands (about 3.8K of code)
+#ifndef LFS_KV_STORE
+#define LFS_KV_STORE            0
+#endif
+
+// Bucket files in a store
+#ifndef LFSKV_BUCKETS
+#define LFSKV_BUCKETS           4
+#endif
+
+// Entries per bucket: attribute types 0 - LFSKV_SLOTS-1 of each bucket file
+#ifndef LFSKV_SLOTS
+#define LFSKV_SLOTS             16
+#endif
+
+// Longest key and value, bytes
+#ifndef LFSKV_KEY_MAX
+#define LFSKV_KEY_MAX           16
+#endif
+#ifndef LFSKV_VALUE_MAX
+#define LFSKV_VALUE_MAX         32
+#endif
+
+// Updates staged by a batch before it has to be written
+#ifndef LFSKV_BATCH_MAX
+#define LFSKV_BATCH_MAX         8
+#endif
+
+// Store the "kvget" / "kvset" commands use
+#ifndef LFSKV_STORE
+#define LFSKV_STORE             "kv"
+#endif
+
+#define LFSKV_NAME_MAX          32 // longest store (directory) name
+#define LFSKV_ENTRY_MAX         (1 + LFSKV_KEY_MAX + LFSKV_VALUE_MAX) // stored entry: key length, key, value
+
+// Update staged by a batch
+typedef struct {
+	uint8_t bucket;
+	uint8_t slot;
+	uint8_t size;               // entry size, 0 for a tombstone
+	uint8_t entry[LFSKV_ENTRY_MAX];
+} LFSKV_STAGED;
+
+// Open store
+typedef struct {
+	lfs_t * lfs;
+	uint8_t batching;           // between lfskv_begin() and lfskv_commit()
+	uint8_t staged_count;
+	LFSKV_STAGED staged[LFSKV_BATCH_MAX];
+	char name[LFSKV_NAME_MAX+1];
+} LFSKV;
+
+// Called by lfskv_iterate() for each entry, return non-zero to stop
+typedef int (*LFSKV_CALLBACK)(void * context, const char * key, const void * value, uint16_t size);
+
+int lfskv_open(LFSKV * kv, lfs_t * lfs, const char * name);   // open or create a store
+int lfskv_get(LFSKV * kv, const char * key, void * value, uint16_t size); // value size (copying as much as fits),
+                                                                           // or LFS_ERR_NOENT
+int lfskv_set(LFSKV * kv, const char * key, const void * value, uint16_t size);
+int lfskv_delete(LFSKV * kv, const char * key);                // LFS_ERR_NOENT if key isn't set
+int lfskv_iterate(LFSKV * kv, LFSKV_CALLBACK callback, void * context); // callback's return, or 0
+int lfskv_begin(LFSKV * kv);                                   // stage the following updates
+int lfskv_commit(LFSKV * kv);                                  // write the staged updates
+int lfskv_close(LFSKV * kv);                                   // commit any staged updates
+int lfskv_remove(lfs_t * lfs, const char * name);              // remove a closed store, with all of its entries
+
+// Command Line functions implemented within littlefs_kv.c:
+int cl_kvget(void);
+int cl_kvset(void);
+int cl_kvbench(void);
+
+// Records to add into command line interface (command_line.c):
+#define LITTLEFS_KV_COMMANDS \
+{"kvget",      "Display setting <key>, or all settings",                   1, cl_kvget}, \
+{"kvset",      "Set setting <key> to <value>, delete it without a value", 2, cl_kvset}, \
+{"kvbench",    "Set / get latency of settings vs a file per key [keys] [rounds]", 1, cl_kvbench} \
+
+#endif // _littlefs_kv_h_
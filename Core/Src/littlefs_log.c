@@ -0,0 +1,422 @@
+/*
+ * littlefs_log.c
+ *
+ *  Ring log of records, on top of LittleFS (see littlefs_log.h), and the "logadd", "logcat" and "logbench" commands.
+ */
+
+#include <stdio.h> // printf()
+#include <string.h> // memset()
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "littlefs_log.h"
+#include "command_line.h" // arc, argv[]
+
+#if LFS_RING_LOG
+extern lfs_t lfs;
+
+// Segment file path: "<log>/<sequence number>"
+static void lfslog_path(char * path, const char * name, uint32_t segment)
+{
+	sprintf(path,"%s/%08lx",name,(unsigned long)segment);
+}
+
+// Parse a segment file name, return 0 if it isn't one
+static int lfslog_parse(const char * file_name, uint32_t * segment)
+{
+	char * end;
+	if(strlen(file_name) != 8) return 0;
+	*segment = strtoul(file_name,&end,16);
+	return *end == '\0';
+}
+
+// Open the newest segment for appending, creating it if needed
+static int lfslog_open_last(LFSLOG * log)
+{
+	char path[LFSLOG_NAME_MAX+10];
+	lfslog_path(path,log->name,log->last);
+	int retval = lfs_file_open(log->lfs, &log->file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND | log->flags);
+	if(retval < LFS_ERR_OK) return retval;
+	lfs_soff_t size = lfs_file_size(log->lfs, &log->file);
+	if(size < 0) {
+		lfs_file_close(log->lfs, &log->file);
+		return (int)size;
+	}
+	log->size = (uint32_t)size;
+	return LFS_ERR_OK;
+}
+
+// Open a log with segments opened with flags (LFS_O_LOG, or 0 for the plain file comparison in "logbench")
+static int lfslog_open_flags(LFSLOG * log, lfs_t * lfs, const char * name, uint32_t segments, int flags)
+{
+	lfs_dir_t dir;
+	struct lfs_info info;
+	int found = 0;
+
+	if(strlen(name) > LFSLOG_NAME_MAX || segments < 2) return LFS_ERR_INVAL;
+	memset(log,0,sizeof(*log));
+	log->lfs = lfs;
+	log->segments = segments;
+	log->flags = flags;
+	strcpy(log->name,name);
+
+	int retval = lfs_mkdir(lfs, name);
+	if(retval < LFS_ERR_OK && retval != LFS_ERR_EXIST) return retval;
+
+	// Find the oldest and newest segments
+	retval = lfs_dir_open(lfs, &dir, name);
+	if(retval < LFS_ERR_OK) return retval;
+	while((retval = lfs_dir_read(lfs, &dir, &info)) > 0) {
+		uint32_t segment;
+		if(info.type != LFS_TYPE_REG || !lfslog_parse(info.name,&segment)) continue;
+		if(!found || segment - log->first > 0x7FFFFFFF) log->first = segment; // sequence numbers may wrap
+		if(!found || log->last - segment > 0x7FFFFFFF) log->last = segment;
+		found = 1;
+	}
+	lfs_dir_close(lfs, &dir);
+	if(retval < LFS_ERR_OK) return retval;
+
+	return lfslog_open_last(log);
+}
+
+int lfslog_open(LFSLOG * log, lfs_t * lfs, const char * name, uint32_t segments)
+{
+	return lfslog_open_flags(log, lfs, name, segments, LFS_O_LOG);
+}
+
+int lfslog_drop(LFSLOG * log, uint32_t count)
+{
+	char path[LFSLOG_NAME_MAX+10];
+	while(count-- && log->first != log->last) {
+		lfslog_path(path,log->name,log->first);
+		int retval = lfs_remove(log->lfs, path);
+		if(retval < LFS_ERR_OK && retval != LFS_ERR_NOENT) return retval;
+		log->first++;
+	}
+	return LFS_ERR_OK;
+}
+
+// Close the newest segment, and start the next one, dropping the oldest if there are too many
+static int lfslog_next(LFSLOG * log)
+{
+	int retval = lfs_file_close(log->lfs, &log->file);
+	if(retval < LFS_ERR_OK) return retval;
+	log->last++;
+	if(log->last - log->first >= log->segments) {
+		retval = lfslog_drop(log, log->last - log->first - log->segments + 1);
+		if(retval < LFS_ERR_OK) return retval;
+	}
+	return lfslog_open_last(log);
+}
+
+int lfslog_append(LFSLOG * log, const void * record, uint16_t size)
+{
+	static const uint8_t padding[LFSLOG_ALIGN] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+	uint32_t length = (LFSLOG_HEADER_SIZE + size + LFSLOG_ALIGN - 1) & ~(LFSLOG_ALIGN - 1);
+	uint8_t header[LFSLOG_HEADER_SIZE];
+	int retval;
+
+	if(size > LFSLOG_RECORD_MAX) return LFS_ERR_FBIG;
+
+	// Records don't span segments
+	if(log->size + length > log->lfs->cfg->block_size) {
+		retval = lfslog_next(log);
+		if(retval < LFS_ERR_OK) return retval;
+	}
+
+	uint32_t crc = lfs_crc(0xFFFFFFFF, record, size);
+	header[0] = (uint8_t)size;
+	header[1] = (uint8_t)(size >> 8);
+	header[2] = (uint8_t)~size;
+	header[3] = (uint8_t)(~size >> 8);
+	for(int i=0;i<4;i++) header[4+i] = (uint8_t)(crc >> (8*i));
+
+	while(1) {
+		retval = lfs_file_write(log->lfs, &log->file, header, sizeof(header));
+		if(retval >= LFS_ERR_OK) retval = lfs_file_write(log->lfs, &log->file, record, size);
+		if(retval >= LFS_ERR_OK && length > (uint32_t)(LFSLOG_HEADER_SIZE + size))
+			retval = lfs_file_write(log->lfs, &log->file, padding, length - LFSLOG_HEADER_SIZE - size);
+		if(retval != LFS_ERR_NOSPC || log->first == log->last) break;
+
+		// File system full: give up the unsynced records in this segment, drop the oldest segment, try again
+		lfs_file_close(log->lfs, &log->file);
+		retval = lfslog_drop(log, 1);
+		if(retval >= LFS_ERR_OK) retval = lfslog_open_last(log);
+		if(retval < LFS_ERR_OK) return retval;
+		if(log->size + length > log->lfs->cfg->block_size) {
+			retval = lfslog_next(log);
+			if(retval < LFS_ERR_OK) return retval;
+		}
+	}
+	if(retval < LFS_ERR_OK) return retval;
+
+	log->size += length;
+	return LFS_ERR_OK;
+}
+
+int lfslog_sync(LFSLOG * log)
+{
+	return lfs_file_sync(log->lfs, &log->file);
+}
+
+int lfslog_close(LFSLOG * log)
+{
+	return lfs_file_close(log->lfs, &log->file);
+}
+
+int lfslog_remove(lfs_t * lfs, const char * name)
+{
+	char path[LFSLOG_NAME_MAX+10];
+	lfs_dir_t dir;
+	struct lfs_info info;
+
+	if(strlen(name) > LFSLOG_NAME_MAX) return LFS_ERR_INVAL;
+	while(1) {
+		// Removing entries while reading the directory skips some, so start over after each one
+		int retval = lfs_dir_open(lfs, &dir, name);
+		if(retval < LFS_ERR_OK) return retval;
+		while((retval = lfs_dir_read(lfs, &dir, &info)) > 0) {
+			if(info.type == LFS_TYPE_REG) break;
+		}
+		lfs_dir_close(lfs, &dir);
+		if(retval < LFS_ERR_OK) return retval;
+		if(retval == 0) break;
+		sprintf(path,"%s/%s",name,info.name);
+		retval = lfs_remove(lfs, path);
+		if(retval < LFS_ERR_OK) return retval;
+	}
+	return lfs_remove(lfs, name);
+}
+
+void lfslog_tell(LFSLOG * log, LFSLOG_POS * pos)
+{
+	pos->segment = log->last;
+	pos->off = log->size;
+	if(pos->off + LFSLOG_HEADER_SIZE + LFSLOG_ALIGN > log->lfs->cfg->block_size) {
+		pos->segment++; // full, the next record starts a new segment
+		pos->off = 0;
+	}
+}
+
+int lfslog_reader_open(LFSLOG * log, LFSLOG_READER * reader, const LFSLOG_POS * pos)
+{
+	reader->is_open = 0;
+	if(pos) {
+		reader->pos = *pos;
+	} else {
+		reader->pos.segment = log->first;
+		reader->pos.off = 0;
+	}
+	return LFS_ERR_OK;
+}
+
+void lfslog_reader_close(LFSLOG * log, LFSLOG_READER * reader)
+{
+	if(reader->is_open) lfs_file_close(log->lfs, &reader->file);
+	reader->is_open = 0;
+}
+
+int lfslog_read(LFSLOG * log, LFSLOG_READER * reader, void * buffer, uint16_t size)
+{
+	char path[LFSLOG_NAME_MAX+10];
+	uint8_t header[LFSLOG_HEADER_SIZE];
+	int retval;
+
+	while(1) {
+		if(reader->pos.segment - log->first > 0x7FFFFFFF) {
+			// dropped, continue from the oldest record
+			lfslog_reader_close(log, reader);
+			reader->pos.segment = log->first;
+			reader->pos.off = 0;
+		}
+		if(reader->pos.segment - log->last - 1 <= 0x7FFFFFFF) return 0; // past the newest segment
+
+		if(!reader->is_open) {
+			lfslog_path(path,log->name,reader->pos.segment);
+			retval = lfs_file_open(log->lfs, &reader->file, path, LFS_O_RDONLY);
+			if(retval == LFS_ERR_NOENT && reader->pos.segment != log->last) {
+				reader->pos.segment++;
+				reader->pos.off = 0;
+				continue;
+			}
+			if(retval < LFS_ERR_OK) return retval;
+			reader->is_open = 1;
+		}
+
+		lfs_soff_t end = lfs_file_size(log->lfs, &reader->file);
+		if(end < 0) return (int)end;
+		if(reader->pos.off + LFSLOG_HEADER_SIZE > (uint32_t)end) {
+			if(reader->pos.segment == log->last) {
+				// The reader's view of the newest segment is from when it was opened, look again for newer records
+				lfs_file_close(log->lfs, &reader->file);
+				lfslog_path(path,log->name,reader->pos.segment);
+				retval = lfs_file_open(log->lfs, &reader->file, path, LFS_O_RDONLY);
+				if(retval < LFS_ERR_OK) {
+					reader->is_open = 0;
+					return retval;
+				}
+				end = lfs_file_size(log->lfs, &reader->file);
+				if(end < 0) return (int)end;
+				if(reader->pos.off + LFSLOG_HEADER_SIZE > (uint32_t)end) return 0;
+			} else {
+				lfslog_reader_close(log, reader);
+				reader->pos.segment++;
+				reader->pos.off = 0;
+				continue;
+			}
+		}
+
+		lfs_soff_t seek = lfs_file_seek(log->lfs, &reader->file, reader->pos.off, LFS_SEEK_SET);
+		if(seek < 0) return (int)seek;
+		retval = lfs_file_read(log->lfs, &reader->file, header, sizeof(header));
+		if(retval < LFS_ERR_OK) return retval;
+
+		uint16_t length = (uint16_t)(header[0] | (header[1] << 8));
+		uint16_t check = (uint16_t)(header[2] | (header[3] << 8));
+		uint32_t crc = 0;
+		for(int i=0;i<4;i++) crc |= (uint32_t)header[4+i] << (8*i);
+		uint32_t next = reader->pos.off + ((LFSLOG_HEADER_SIZE + length + LFSLOG_ALIGN - 1) & ~(LFSLOG_ALIGN - 1));
+		if((uint16_t)(length ^ check) != 0xFFFF || length > LFSLOG_RECORD_MAX || next > (uint32_t)end) {
+			// The size can't be trusted, skip the rest of the segment
+			reader->pos.off = (uint32_t)end;
+			return LFS_ERR_CORRUPT;
+		}
+
+		// Read the record, checking its CRC, copying as much as fits
+		uint32_t record_crc = 0xFFFFFFFF;
+		for(uint16_t done=0;done<length;) {
+			uint8_t chunk[32];
+			uint16_t n = (uint16_t)(length - done) < sizeof(chunk) ? (uint16_t)(length - done) : (uint16_t)sizeof(chunk);
+			retval = lfs_file_read(log->lfs, &reader->file, chunk, n);
+			if(retval < LFS_ERR_OK) return retval;
+			record_crc = lfs_crc(record_crc, chunk, n);
+			if(done < size) memcpy((uint8_t *)buffer + done, chunk, (size - done < n) ? size - done : n);
+			done += n;
+		}
+		reader->pos.off = next;
+		return record_crc == crc ? length : LFS_ERR_CORRUPT;
+	}
+}
+
+// Append a record to a ring log: logadd <log> <text>
+int cl_logadd(void)
+{
+	LFSLOG log;
+	int retval = lfslog_open(&log, &lfs, argv[1], LFSLOG_SEGMENTS);
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error opening log \"%s\", %d\n",__func__,argv[1],retval);
+		return retval;
+	}
+	retval = lfslog_append(&log, argv[2], (uint16_t)strlen(argv[2]));
+	if(retval < LFS_ERR_OK)
+		printf("%s: Error appending to log \"%s\", %d\n",__func__,argv[1],retval);
+	int err = lfslog_close(&log);
+	return retval < LFS_ERR_OK ? retval : err;
+}
+
+// Display the records in a ring log, with their positions: logcat <log>
+int cl_logcat(void)
+{
+	LFSLOG log;
+	LFSLOG_READER reader;
+	char record[LFSLOG_RECORD_MAX];
+	uint32_t records = 0, corrupt = 0;
+
+	int retval = lfslog_open(&log, &lfs, argv[1], LFSLOG_SEGMENTS);
+	if(retval < LFS_ERR_OK) {
+		printf("%s: Error opening log \"%s\", %d\n",__func__,argv[1],retval);
+		return retval;
+	}
+	lfslog_reader_open(&log, &reader, NULL);
+	while(1) {
+		LFSLOG_POS pos = reader.pos;
+		retval = lfslog_read(&log, &reader, record, sizeof(record));
+		if(retval == LFS_ERR_CORRUPT) {
+			printf("%08lx:%04lx CRC error\n",pos.segment,pos.off);
+			corrupt++;
+			continue;
+		}
+		if(retval <= 0) break;
+		printf("%08lx:%04lx ",pos.segment,pos.off);
+		for(int i=0;i<retval;i++)
+			printf("%c",(record[i] >= ' ' && record[i] <= '~') ? record[i] : '.');
+		printf("\n");
+		records++;
+	}
+	lfslog_reader_close(&log, &reader);
+	lfslog_close(&log);
+	printf("%lu records, %lu CRC errors, segments %08lx - %08lx\n",records,corrupt,log.first,log.last);
+	return retval;
+}
+
+// Sustained logging rate: append and sync [records] records of [bytes] bytes, through a ring log, then through
+// the same ring of plain files (lfs_file_write() + lfs_file_sync(), without LFS_O_LOG).  Both keep 4 segments, so
+// the ring wraps once the records fill them.  The log's records are then read back and checked.
+int cl_logbench(void)
+{
+	static const char * const names[2] = {"lbplain","lblog"};
+	uint8_t record[LFSLOG_RECORD_MAX];
+	uint32_t records = 200;
+	uint32_t bytes = 32;
+	int retval = LFS_ERR_OK;
+
+	if(argc > 1) records = strtoul(argv[1],NULL,0);
+	if(argc > 2) bytes = strtoul(argv[2],NULL,0);
+	if(bytes > LFSLOG_RECORD_MAX) bytes = LFSLOG_RECORD_MAX;
+
+	printf("%lu records of %lu bytes, append + sync each\n",records,bytes);
+	printf("Path        Records/s   us/record  Prog bytes/record  Erases/100 records\n");
+	for(int pass=0;pass<2 && retval >= LFS_ERR_OK;pass++) {
+		LFSLOG log;
+
+		lfslog_remove(&lfs, names[pass]);
+		retval = lfslog_open_flags(&log, &lfs, names[pass], 4, pass ? LFS_O_LOG : 0);
+		if(retval < LFS_ERR_OK) {
+			printf("%s: Error opening log \"%s\", %d\n",__func__,names[pass],retval);
+			return retval;
+		}
+
+		LFS_FLASH_STATS before = lfs_flash_stats;
+		uint32_t start = HAL_GetTick();
+		uint32_t count;
+		for(count=0;count<records;count++) {
+			for(uint32_t i=0;i<bytes;i++)
+				record[i] = (uint8_t)(count + i);
+			retval = lfslog_append(&log, record, (uint16_t)bytes);
+			if(retval >= LFS_ERR_OK) retval = lfslog_sync(&log);
+			if(retval < LFS_ERR_OK) {
+				printf("%s: Error logging record %lu, %d\n",__func__,count,retval);
+				break;
+			}
+		}
+		uint32_t ms = HAL_GetTick() - start;
+		uint32_t prog_bytes = lfs_flash_stats.prog_bytes - before.prog_bytes;
+		uint32_t erases = lfs_flash_stats.erase_calls - before.erase_calls;
+
+		printf("%-10s %10lu %11lu %18lu %19lu\n",pass ? "ring log" : "plain file",
+			ms ? (uint32_t)((uint64_t)count*1000/ms) : 0, count ? (uint32_t)((uint64_t)ms*1000/count) : 0,
+			count ? prog_bytes/count : 0, count ? erases*100/count : 0);
+
+		if(pass && retval >= LFS_ERR_OK) {
+			// Read back what the ring kept: the newest records, in order
+			LFSLOG_READER reader;
+			uint32_t kept = 0, bad = 0, expect = 0;
+			lfslog_reader_open(&log, &reader, NULL);
+			while((retval = lfslog_read(&log, &reader, record, sizeof(record))) != 0) {
+				if(retval < LFS_ERR_OK && retval != LFS_ERR_CORRUPT) break;
+				if(kept == 0) expect = record[0];
+				if(retval != (int)bytes || record[0] != (uint8_t)expect) bad++;
+				expect = record[0] + 1;
+				kept++;
+			}
+			lfslog_reader_close(&log, &reader);
+			printf("Read back %lu records (the newest), %lu bad\n",kept,bad);
+			if(bad && retval == 0) retval = LFS_ERR_CORRUPT;
+		}
+		int err = lfslog_close(&log);
+		if(retval >= LFS_ERR_OK) retval = err;
+		lfslog_remove(&lfs, names[pass]);
+	}
+	return retval < LFS_ERR_OK ? retval : LFS_ERR_OK;
+}
+#endif // LFS_RING_LOG
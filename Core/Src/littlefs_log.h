@@ -0,0 +1,98 @@
+/*
+ * littlefs_log.h
+ *
+ *  Ring log of records, on top of LittleFS, for periodic data logging.
+ *
+ *  A log is a directory of segment files, named by an increasing hexadecimal sequence number
+ *  ("log/0000002a").  A segment holds one block of records, and a log keeps at most "segments" of them:
+ *  when the newest segment fills up, the next record starts a new one, and once there are too many
+ *  (or the file system is full) the oldest segment is removed.
+ *
+ *  Segments are opened with LFS_O_LOG, so each record is programmed straight into the erased rest of the
+ *  segment's block.  lfslog_sync() then only programs the records since the last sync, and commits the new
+ *  segment size, where a plain file copies its partly written last block to a new block on every append
+ *  after a sync.
+ *
+ *  Each record is stored with its size and a CRC-32, padded to the 8 byte program size:
+ *      uint16_t size, uint16_t ~size, uint32_t crc (lfs_crc() of the data), data, padding
+ *  Records appended since the last lfslog_sync() are lost on power loss, synced records are not.
+ */
+
+#ifndef _littlefs_log_h_
+#define _littlefs_log_h_
+
+#include <stdint.h>
+#include "lfs.h"
+
+// LFS_RING_LOG builds the ring log and its "logadd", "logcat" and "logbench" commands (about 3.5K of code)
+#ifndef LFS_RING_LOG
+#define LFS_RING_LOG            0
+#endif
+
+// Largest record, bytes
+#ifndef LFSLOG_RECORD_MAX
+#define LFSLOG_RECORD_MAX       256
+#endif
+
+// Segments (blocks) the "logadd" / "logcat" commands keep, the oldest records are dropped beyond this
+#ifndef LFSLOG_SEGMENTS
+#define LFSLOG_SEGMENTS         4
+#endif
+
+#define LFSLOG_NAME_MAX         32 // longest log (directory) name
+#define LFSLOG_HEADER_SIZE      8  // record header: size, ~size, crc
+#define LFSLOG_ALIGN            8  // records are padded to the program size
+
+// Log, open for appending
+typedef struct {
+	lfs_t * lfs;
+	lfs_file_t file;            // newest segment
+	uint32_t first;             // oldest segment's sequence number
+	uint32_t last;              // newest segment's sequence number
+	uint32_t segments;          // most segments kept
+	uint32_t size;              // bytes in the newest segment, including unsynced records
+	int flags;                  // open flags for segments
+	char name[LFSLOG_NAME_MAX+1];
+} LFSLOG;
+
+// Position of a record in a log
+typedef struct {
+	uint32_t segment;           // segment sequence number
+	uint32_t off;               // byte offset of the record in the segment
+} LFSLOG_POS;
+
+// Reads records in order, from a position
+typedef struct {
+	LFSLOG_POS pos;             // next record
+	lfs_file_t file;            // segment being read
+	uint8_t is_open;            // file is open on pos.segment
+} LFSLOG_READER;
+
+int lfslog_open(LFSLOG * log, lfs_t * lfs, const char * name, uint32_t segments); // open or create a log
+int lfslog_append(LFSLOG * log, const void * record, uint16_t size);             // append one record
+int lfslog_sync(LFSLOG * log);                                                    // make appended records durable
+int lfslog_drop(LFSLOG * log, uint32_t count);    // remove the oldest segments (never the newest)
+int lfslog_close(LFSLOG * log);                   // sync and close
+int lfslog_remove(lfs_t * lfs, const char * name); // remove a closed log, with all of its records
+void lfslog_tell(LFSLOG * log, LFSLOG_POS * pos);  // position the next record will be appended at
+
+// Read records from pos (NULL for the oldest record).  lfslog_read() returns the record's size, copying as much
+// of it as fits in buffer, 0 when there are no more records, or a negative error.  A record that fails its CRC
+// returns LFS_ERR_CORRUPT, and the next call continues after it.  Readers only see synced records, and a reader
+// whose position has been dropped continues from the oldest record.
+int lfslog_reader_open(LFSLOG * log, LFSLOG_READER * reader, const LFSLOG_POS * pos);
+int lfslog_read(LFSLOG * log, LFSLOG_READER * reader, void * buffer, uint16_t size);
+void lfslog_reader_close(LFSLOG * log, LFSLOG_READER * reader);
+
+// Command Line functions implemented within littlefs_log.c:
+int cl_logadd(void);
+int cl_logcat(void);
+int cl_logbench(void);
+
+// Records to add into command line interface (command_line.c):
+#define LITTLEFS_LOG_COMMANDS \
+{"logadd",     "Append a record <text> to ring log <log>",                  3, cl_logadd}, \
+{"logcat",     "Display the records in ring log <log>",                     2, cl_logcat}, \
+{"logbench",   "Records/s of a ring log vs a plain file [records] [bytes]", 1, cl_logbench} \
+
+#endif // _littlefs_log_h_
@@ -155,6 +155,7 @@ int main(void)
 //		HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
 //		HAL_Delay(500);
 		cl_loop();
+		lfs_idle(); // pre-erase FLASH while waiting for commands
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
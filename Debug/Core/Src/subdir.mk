@@ -8,6 +8,9 @@ C_SRCS += \
 ../Core/Src/command_line.c \
 ../Core/Src/crc16.c \
 ../Core/Src/littlefs_interface.c \
+../Core/Src/littlefs_log.c \
+../Core/Src/littlefs_kv.c \
+../Core/Src/littlefs_compress.c \
 ../Core/Src/main.c \
 ../Core/Src/stm32f1xx_hal_msp.c \
 ../Core/Src/stm32f1xx_it.c \
@@ -20,6 +23,9 @@ OBJS += \
 ./Core/Src/command_line.o \
 ./Core/Src/crc16.o \
 ./Core/Src/littlefs_interface.o \
+./Core/Src/littlefs_log.o \
+./Core/Src/littlefs_kv.o \
+./Core/Src/littlefs_compress.o \
 ./Core/Src/main.o \
 ./Core/Src/stm32f1xx_hal_msp.o \
 ./Core/Src/stm32f1xx_it.o \
@@ -32,6 +38,9 @@ C_DEPS += \
 ./Core/Src/command_line.d \
 ./Core/Src/crc16.d \
 ./Core/Src/littlefs_interface.d \
+./Core/Src/littlefs_log.d \
+./Core/Src/littlefs_kv.d \
+./Core/Src/littlefs_compress.d \
 ./Core/Src/main.d \
 ./Core/Src/stm32f1xx_hal_msp.d \
 ./Core/Src/stm32f1xx_it.d \
@@ -48,7 +57,7 @@ Core/Src/%.o Core/Src/%.su: ../Core/Src/%.c Core/Src/subdir.mk
 clean: clean-Core-2f-Src
 
 clean-Core-2f-Src:
-	-$(RM) ./Core/Src/command_line.d ./Core/Src/command_line.o ./Core/Src/command_line.su ./Core/Src/crc16.d ./Core/Src/crc16.o ./Core/Src/crc16.su ./Core/Src/littlefs_interface.d ./Core/Src/littlefs_interface.o ./Core/Src/littlefs_interface.su ./Core/Src/main.d ./Core/Src/main.o ./Core/Src/main.su ./Core/Src/stm32f1xx_hal_msp.d ./Core/Src/stm32f1xx_hal_msp.o ./Core/Src/stm32f1xx_hal_msp.su ./Core/Src/stm32f1xx_it.d ./Core/Src/stm32f1xx_it.o ./Core/Src/stm32f1xx_it.su ./Core/Src/syscalls.d ./Core/Src/syscalls.o ./Core/Src/syscalls.su ./Core/Src/sysmem.d ./Core/Src/sysmem.o ./Core/Src/sysmem.su ./Core/Src/system_stm32f1xx.d ./Core/Src/system_stm32f1xx.o ./Core/Src/system_stm32f1xx.su ./Core/Src/xmodem.d ./Core/Src/xmodem.o ./Core/Src/xmodem.su
+	-$(RM) ./Core/Src/command_line.d ./Core/Src/command_line.o ./Core/Src/command_line.su ./Core/Src/crc16.d ./Core/Src/crc16.o ./Core/Src/crc16.su ./Core/Src/littlefs_interface.d ./Core/Src/littlefs_interface.o ./Core/Src/littlefs_interface.su ./Core/Src/littlefs_log.d ./Core/Src/littlefs_log.o ./Core/Src/littlefs_log.su ./Core/Src/littlefs_kv.d ./Core/Src/littlefs_kv.o ./Core/Src/littlefs_kv.su ./Core/Src/littlefs_compress.d ./Core/Src/littlefs_compress.o ./Core/Src/littlefs_compress.su ./Core/Src/main.d ./Core/Src/main.o ./Core/Src/main.su ./Core/Src/stm32f1xx_hal_msp.d ./Core/Src/stm32f1xx_hal_msp.o ./Core/Src/stm32f1xx_hal_msp.su ./Core/Src/stm32f1xx_it.d ./Core/Src/stm32f1xx_it.o ./Core/Src/stm32f1xx_it.su ./Core/Src/syscalls.d ./Core/Src/syscalls.o ./Core/Src/syscalls.su ./Core/Src/sysmem.d ./Core/Src/sysmem.o ./Core/Src/sysmem.su ./Core/Src/system_stm32f1xx.d ./Core/Src/system_stm32f1xx.o ./Core/Src/system_stm32f1xx.su ./Core/Src/xmodem.d ./Core/Src/xmodem.o ./Core/Src/xmodem.su
 
 .PHONY: clean-Core-2f-Src
 
@@ -0,0 +1,109 @@
+/*
+ * main.h (host build)
+ *
+ *  Stands in for Core/Inc/main.h and the STM32 HAL when building on a Linux build machine.
+ *  Provides just the HAL, CMSIS, and register definitions used by command_line.c and littlefs_interface.c.
+ *  FLASH programming and erasing are simulated by Host/flash_sim.c.
+ */
+
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include <stdint.h>
+#include "flash_sim.h"
+
+// Memory map
+#define FLASH_BASE            0x08000000UL // FLASH base address
+#define FLASHSIZE_BASE        0x1FFFF7E0UL // FLASH size data register, KBytes
+#define UID_BASE              0x1FFFF7E8UL // Unique device ID register
+
+// The register program path (LFS_PROG_FAST) stores each half-word through the simulator, see flash_sim_store16()
+#define LFS_FLASH_STORE16(address,half) flash_sim_store16((uint32_t)(address),(half))
+
+// HAL
+typedef enum {
+	HAL_OK       = 0x00U,
+	HAL_ERROR    = 0x01U,
+	HAL_BUSY     = 0x02U,
+	HAL_TIMEOUT  = 0x03U
+} HAL_StatusTypeDef;
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+// FLASH (HAL_FLASH / HAL_FLASHEx)
+typedef struct {
+	uint32_t TypeErase;
+	uint32_t Banks;
+	uint32_t PageAddress;
+	uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+#define FLASH_TYPEERASE_PAGES         0x00U
+#define FLASH_TYPEERASE_MASSERASE     0x02U
+#define FLASH_TYPEPROGRAM_HALFWORD    0x01U
+#define FLASH_TYPEPROGRAM_WORD        0x02U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD  0x03U
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
+uint32_t HAL_FLASH_GetError(void);
+#define HAL_FLASH_ERROR_NONE          0x00U
+#define HAL_FLASH_ERROR_PROG          0x01U
+#define HAL_FLASH_ERROR_WRP           0x02U
+#define FLASH_TIMEOUT_VALUE           50000U // ms
+
+// FLASH registers, LOCK and PG are set by the firmware, SR by flash_sim_store16()
+typedef struct {
+	volatile uint32_t SR;
+	volatile uint32_t CR;
+} FLASH_TypeDef;
+extern FLASH_TypeDef flash_sim_regs;
+#define FLASH                 (&flash_sim_regs)
+#define FLASH_SR_BSY          0x00000001U
+#define FLASH_SR_PGERR        0x00000004U
+#define FLASH_SR_WRPRTERR     0x00000010U
+#define FLASH_SR_EOP          0x00000020U
+#define FLASH_CR_PG           0x00000001U
+#define FLASH_CR_LOCK         0x00000080U
+
+// TIM4, a free running 1us counter, and the DWT cycle counter (64MHz), both follow the modelled time
+typedef struct {
+	volatile uint32_t CNT;
+} TIM_TypeDef;
+extern TIM_TypeDef flash_sim_tim4;
+#define TIM4                  (&flash_sim_tim4)
+
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+extern DWT_Type flash_sim_dwt;
+#define DWT                   (&flash_sim_dwt)
+#define DWT_CTRL_CYCCNTENA_Msk 0x00000001U
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+extern CoreDebug_Type flash_sim_coredebug;
+#define CoreDebug             (&flash_sim_coredebug)
+#define CoreDebug_DEMCR_TRCENA_Msk 0x01000000U
+
+extern uint32_t SystemCoreClock; // 64MHz, DWT->CYCCNT rate
+
+// Benchmark commands time the host CPU, in 64MHz cycles
+#define LFS_BENCH_CYCLES()    flash_sim_host_cycles()
+
+// GPIO, the LED does nothing
+#define GPIO_PIN_RESET        0
+#define GPIO_PIN_SET          1
+#define LED_Pin               0x2000U
+#define LED_GPIO_Port         ((void *)0)
+#define HAL_GPIO_WritePin(port,pin,state) ((void)(port),(void)(pin),(void)(state))
+
+void NVIC_SystemReset(void); // Host/host_main.c
+void Error_Handler(void);
+
+#endif // __MAIN_H
@@ -0,0 +1,445 @@
+/*
+ * flash_sim.c
+ *
+ *  Simulated STM32-F103 FLASH and the few HAL functions that use it, for host builds.
+ *  See flash_sim.h
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create()
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "command_line.h" // argc, argv[]
+
+#define SIM_PAGE_SIZE     0x400  // F103 FLASH page
+#define SIM_INFO_BASE     0x1FFFF000UL // system memory page holding FLASHSIZE_BASE and UID_BASE
+
+// Latency model, STM32-F103 datasheet typical values
+FLASH_SIM_TIMING flash_sim_timing = {
+	.erase_us   = 20000, // tERASE 20 - 40ms
+	.program_ns = 52500, // tPROG 40 - 70us per half-word
+	.read_ns    = 15,    // 64MHz, 2 wait states, prefetch
+};
+
+// Register mirrors, see Host/Inc/main.h
+FLASH_TypeDef flash_sim_regs = { .CR = FLASH_CR_LOCK };
+TIM_TypeDef flash_sim_tim4;
+DWT_Type flash_sim_dwt;
+CoreDebug_Type flash_sim_coredebug;
+uint32_t SystemCoreClock = 64000000;
+
+static uint8_t * flash_rw;     // writable view of the simulated FLASH
+static uint32_t flash_size;    // bytes
+static FLASH_SIM_COUNTERS sim; // running totals
+static uint32_t read_bytes_seen; // lfs_flash_stats.read_bytes already added to sim
+static uint32_t hal_error;      // HAL_FLASH_GetError()
+static uint32_t hang_after;     // "simbusy", register half-word programs until the controller hangs, 0 for never
+static int hung;                // controller hung, BSY stays set
+
+uint64_t flash_sim_ops;
+uint64_t flash_sim_cut_at;
+uint32_t flash_sim_seed = 1;
+void (*flash_sim_powerloss)(void);
+
+// xorshift32, for torn operations
+static uint32_t sim_random(void)
+{
+	flash_sim_seed ^= flash_sim_seed << 13;
+	flash_sim_seed ^= flash_sim_seed >> 17;
+	flash_sim_seed ^= flash_sim_seed << 5;
+	return flash_sim_seed;
+}
+
+// Count a program or erase operation, return 1 if the power fails during it
+static int sim_cut(void)
+{
+	flash_sim_ops++;
+	return flash_sim_cut_at && flash_sim_ops == flash_sim_cut_at && flash_sim_powerloss;
+}
+
+// Advance modelled time, keeping the timer registers in step
+static void sim_advance(uint64_t ns)
+{
+	sim.time_ns += ns;
+	flash_sim_tim4.CNT = (uint32_t)(sim.time_ns / 1000) & 0xFFFF;
+	flash_sim_dwt.CYCCNT = (uint32_t)(sim.time_ns * (SystemCoreClock / 1000000) / 1000);
+}
+
+// lfs_read() copies straight out of the mapped FLASH.  Account for those reads from the interface's counters.
+static void sim_sync_reads(void)
+{
+	uint32_t bytes = lfs_flash_stats.read_bytes;
+	uint32_t delta = bytes >= read_bytes_seen ? bytes - read_bytes_seen : bytes; // "fsstat reset"
+	read_bytes_seen = bytes;
+	sim.read_bytes += delta;
+	sim_advance((uint64_t)delta * flash_sim_timing.read_ns);
+}
+
+// Map the FLASH at its STM32 address, read-only, with a second writable view for the simulator.
+// Load "image" if it exists, otherwise the FLASH starts out erased.
+int flash_sim_init(uint32_t flash_kb, const char * image)
+{
+	flash_size = flash_kb * 1024;
+	int fd = memfd_create("flash_sim", 0);
+	if(fd < 0 || ftruncate(fd, flash_size)) {
+		perror("flash_sim memfd");
+		return -1;
+	}
+	void * ro = mmap((void *)FLASH_BASE, flash_size, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	flash_rw = mmap(NULL, flash_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(ro != (void *)FLASH_BASE || flash_rw == MAP_FAILED) {
+		printf("%s: unable to map FLASH at 0x%08lX\n",__func__,FLASH_BASE);
+		return -1;
+	}
+	memset(flash_rw, 0xFF, flash_size);
+
+	// System memory: FLASH size and unique ID registers
+	uint8_t * info = mmap((void *)SIM_INFO_BASE, 0x1000, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if(info != (uint8_t *)SIM_INFO_BASE) {
+		printf("%s: unable to map system memory at 0x%08lX\n",__func__,SIM_INFO_BASE);
+		return -1;
+	}
+	*(uint16_t *)(info + (FLASHSIZE_BASE - SIM_INFO_BASE)) = (uint16_t)flash_kb;
+	memcpy(info + (UID_BASE - SIM_INFO_BASE), "FLASH_SIM\0\0\0", 12);
+	mprotect(info, 0x1000, PROT_READ);
+
+	if(image) {
+		FILE * f = fopen(image, "rb");
+		if(f) {
+			size_t n = fread(flash_rw, 1, flash_size, f);
+			fclose(f);
+			printf("%s: loaded %lu bytes from \"%s\"\n",__func__,(unsigned long)n,image);
+		}
+	}
+	return 0;
+}
+
+// Write the FLASH image to a file
+int flash_sim_save(const char * image)
+{
+	FILE * f = fopen(image, "wb");
+	if(!f || fwrite(flash_rw, 1, flash_size, f) != flash_size) {
+		printf("%s: unable to write \"%s\"\n",__func__,image);
+		if(f) fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+void flash_sim_counters(FLASH_SIM_COUNTERS * counters)
+{
+	sim_sync_reads();
+	*counters = sim;
+}
+
+uint64_t flash_sim_now_ns(void)
+{
+	sim_sync_reads();
+	return sim.time_ns;
+}
+
+void flash_sim_delay_ns(uint64_t ns)
+{
+	sim_advance(ns);
+}
+
+// Writable view of a FLASH address, NULL if outside the FLASH
+uint8_t * flash_sim_memory(uint32_t address)
+{
+	if(address < FLASH_BASE || address >= FLASH_BASE + flash_size) return NULL;
+	return flash_rw + (address - FLASH_BASE);
+}
+
+// Host CPU time, for benchmark commands
+uint32_t flash_sim_host_cycles(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) * (SystemCoreClock / 1000000) / 1000);
+}
+
+//=================================================================================================
+// Simulated HAL
+//=================================================================================================
+
+uint32_t HAL_GetTick(void)
+{
+	if(hung)
+		sim_advance(1000000); // hung controller, time passes while the firmware polls BSY
+	return (uint32_t)(flash_sim_now_ns() / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	sim_advance((uint64_t)Delay * 1000000);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	flash_sim_regs.CR &= ~FLASH_CR_LOCK;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	flash_sim_regs.CR |= FLASH_CR_LOCK;
+	return HAL_OK;
+}
+
+// Program one half-word.  As on the F103, a half-word that isn't erased (0xFFFF) can only be
+// programmed to 0x0000, anything else sets PGERR and leaves FLASH unchanged.
+static HAL_StatusTypeDef sim_program_halfword(uint32_t address, uint16_t data)
+{
+	uint8_t * p = flash_sim_memory(address);
+	if(!p || !flash_sim_memory(address + 1) || (address & 1) || (flash_sim_regs.CR & FLASH_CR_LOCK)) {
+		sim.prog_errors++;
+		flash_sim_regs.SR |= FLASH_SR_WRPRTERR;
+		hal_error |= HAL_FLASH_ERROR_WRP;
+		return HAL_ERROR;
+	}
+	uint16_t current = (uint16_t)(p[0] | (p[1] << 8));
+	sim_advance(flash_sim_timing.program_ns);
+	if(current != 0xFFFF && data != 0x0000) {
+		sim.prog_errors++;
+		flash_sim_regs.SR |= FLASH_SR_PGERR;
+		hal_error |= HAL_FLASH_ERROR_PROG;
+		return HAL_ERROR;
+	}
+	if(sim_cut()) {
+		data |= (uint16_t)sim_random(); // torn, only some of the bits are cleared
+		data &= current;
+		p[0] = (uint8_t)data;
+		p[1] = (uint8_t)(data >> 8);
+		flash_sim_powerloss();
+	}
+	data &= current; // programming only clears bits
+	p[0] = (uint8_t)data;
+	p[1] = (uint8_t)(data >> 8);
+	sim.prog_halfwords++;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	uint32_t halfwords = TypeProgram == FLASH_TYPEPROGRAM_DOUBLEWORD ? 4 :
+			TypeProgram == FLASH_TYPEPROGRAM_WORD ? 2 : 1;
+
+	sim_sync_reads();
+	hal_error = HAL_FLASH_ERROR_NONE;
+	if(hung) {
+		sim_advance((uint64_t)FLASH_TIMEOUT_VALUE * 1000000); // the HAL waits for BSY first
+		return HAL_TIMEOUT;
+	}
+	for(uint32_t i=0;i<halfwords;i++) {
+		HAL_StatusTypeDef rc = sim_program_halfword(Address + 2*i, (uint16_t)(Data >> (16*i)));
+		if(rc != HAL_OK) return rc;
+	}
+	return HAL_OK;
+}
+
+// Register program path: a half-word store to FLASH.  Programs only with FLASH_CR_PG set.
+// The program completes before the store returns, BSY is only set once the controller has been hung
+// with "simbusy".  FLASH->SR is plain memory here, so the firmware's write 1 to clear doesn't clear it:
+// each store replaces SR with the status of that program, which is all the firmware reads (it clears
+// the flags before programming and stops at the first error).
+void flash_sim_store16(uint32_t address, uint16_t half)
+{
+	sim_sync_reads();
+	if(hung) { // the store is lost
+		flash_sim_regs.SR = FLASH_SR_BSY;
+		return;
+	}
+	flash_sim_regs.SR = 0;
+	if(!(flash_sim_regs.CR & FLASH_CR_PG)) {
+		sim.prog_errors++;
+		flash_sim_regs.SR = FLASH_SR_PGERR;
+		return;
+	}
+	if(sim_program_halfword(address, half) == HAL_OK)
+		flash_sim_regs.SR = FLASH_SR_EOP;
+	if(hang_after && --hang_after == 0)
+		hung = 1;
+}
+
+uint32_t HAL_FLASH_GetError(void)
+{
+	return hal_error;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError)
+{
+	*PageError = 0xFFFFFFFF;
+	hal_error = HAL_FLASH_ERROR_NONE;
+	sim_sync_reads();
+	if(hung) {
+		sim_advance((uint64_t)FLASH_TIMEOUT_VALUE * 1000000); // the HAL waits for BSY first
+		return HAL_TIMEOUT;
+	}
+	if(pEraseInit->TypeErase != FLASH_TYPEERASE_PAGES || (flash_sim_regs.CR & FLASH_CR_LOCK)) {
+		flash_sim_regs.SR |= FLASH_SR_WRPRTERR;
+		hal_error |= HAL_FLASH_ERROR_WRP;
+		return HAL_ERROR;
+	}
+	for(uint32_t i=0;i<pEraseInit->NbPages;i++) {
+		uint32_t address = (pEraseInit->PageAddress + i * SIM_PAGE_SIZE) & ~(SIM_PAGE_SIZE - 1);
+		uint8_t * p = flash_sim_memory(address);
+		if(!p) {
+			*PageError = address;
+			flash_sim_regs.SR |= FLASH_SR_WRPRTERR;
+			hal_error |= HAL_FLASH_ERROR_WRP;
+			return HAL_ERROR;
+		}
+		sim_advance((uint64_t)flash_sim_timing.erase_us * 1000);
+		if(sim_cut()) {
+			for(uint32_t j=0;j<SIM_PAGE_SIZE;j++) // torn, only some of the bytes are erased
+				if(sim_random() & 1) p[j] = 0xFF;
+			flash_sim_powerloss();
+		}
+		memset(p, 0xFF, SIM_PAGE_SIZE);
+		sim.erases++;
+	}
+	return HAL_OK;
+}
+
+//=================================================================================================
+// Per API call totals
+//=================================================================================================
+
+#define SIM_API_MAX   48 // distinct API functions tracked
+#define SIM_NEST_MAX  4  // API calls in progress (lfs_xxx() calling lfs_xxx())
+
+typedef struct {
+	char name[24];
+	uint32_t calls;
+	FLASH_SIM_COUNTERS total;
+} SIM_API;
+
+static SIM_API sim_api[SIM_API_MAX];
+static FLASH_SIM_COUNTERS sim_entry[SIM_NEST_MAX];
+static int sim_depth;
+int flash_sim_verbose;
+
+// Find or add the table entry for an API name
+static SIM_API * sim_api_find(const char * name, size_t len)
+{
+	if(len >= sizeof(sim_api[0].name)) len = sizeof(sim_api[0].name) - 1;
+	for(int i=0;i<SIM_API_MAX;i++) {
+		if(!sim_api[i].name[0]) {
+			memcpy(sim_api[i].name, name, len);
+			return &sim_api[i];
+		}
+		if(strlen(sim_api[i].name) == len && memcmp(sim_api[i].name, name, len) == 0)
+			return &sim_api[i];
+	}
+	return NULL;
+}
+
+// LFS_TRACE() hook.  Each public lfs_xxx() function traces "lfs_xxx(args..)" on entry,
+// and "lfs_xxx -> result" on return.
+void flash_sim_trace(const char * fmt, ...)
+{
+	const char * arrow = strstr(fmt, " -> ");
+	FLASH_SIM_COUNTERS now;
+	flash_sim_counters(&now);
+
+	if(!arrow) {
+		// entry
+		if(sim_depth < SIM_NEST_MAX) sim_entry[sim_depth] = now;
+		sim_depth++;
+		return;
+	}
+	// return
+	if(sim_depth == 0) return;
+	sim_depth--;
+	if(sim_depth >= SIM_NEST_MAX) return;
+	SIM_API * api = sim_api_find(fmt, arrow - fmt);
+	if(!api) return;
+	FLASH_SIM_COUNTERS * entry = &sim_entry[sim_depth];
+	FLASH_SIM_COUNTERS delta = {
+		.read_bytes     = now.read_bytes - entry->read_bytes,
+		.prog_halfwords = now.prog_halfwords - entry->prog_halfwords,
+		.prog_errors    = now.prog_errors - entry->prog_errors,
+		.erases         = now.erases - entry->erases,
+		.time_ns        = now.time_ns - entry->time_ns,
+	};
+	api->calls++;
+	api->total.read_bytes     += delta.read_bytes;
+	api->total.prog_halfwords += delta.prog_halfwords;
+	api->total.prog_errors    += delta.prog_errors;
+	api->total.erases         += delta.erases;
+	api->total.time_ns        += delta.time_ns;
+
+	if(flash_sim_verbose) {
+		va_list args;
+		va_start(args, fmt);
+		printf("  [");
+		vprintf(fmt, args);
+		va_end(args);
+		printf("] read %llu, prog %llu, erase %llu, %llu.%03llu ms\n",
+			(unsigned long long)delta.read_bytes,(unsigned long long)delta.prog_halfwords*2,
+			(unsigned long long)delta.erases,(unsigned long long)(delta.time_ns/1000000),
+			(unsigned long long)(delta.time_ns/1000%1000));
+	}
+}
+
+// Display per API call totals, or clear them with "simstat reset"
+int cl_simstat(void)
+{
+	if(argc > 1 && strcmp(argv[1],"reset") == 0) {
+		memset(sim_api, 0, sizeof(sim_api));
+		return 0;
+	}
+	FLASH_SIM_COUNTERS now;
+	flash_sim_counters(&now);
+	printf("API                     calls    read B    prog B  erases  prog err   time ms\n");
+	for(int i=0;i<SIM_API_MAX && sim_api[i].name[0];i++) {
+		SIM_API * api = &sim_api[i];
+		printf("%-22s %6lu %9llu %9llu %7llu %9llu %9llu\n",api->name,(unsigned long)api->calls,
+			(unsigned long long)api->total.read_bytes,(unsigned long long)api->total.prog_halfwords*2,
+			(unsigned long long)api->total.erases,(unsigned long long)api->total.prog_errors,
+			(unsigned long long)(api->total.time_ns/1000000));
+	}
+	printf("%-22s %6s %9llu %9llu %7llu %9llu %9llu\n","total (since start)","",
+		(unsigned long long)now.read_bytes,(unsigned long long)now.prog_halfwords*2,
+		(unsigned long long)now.erases,(unsigned long long)now.prog_errors,
+		(unsigned long long)(now.time_ns/1000000));
+	return 0;
+}
+
+// Display or set the latency model
+int cl_simtime(void)
+{
+	if(argc > 3) {
+		flash_sim_timing.erase_us   = strtoul(argv[1],NULL,0);
+		flash_sim_timing.program_ns = strtoul(argv[2],NULL,0);
+		flash_sim_timing.read_ns    = strtoul(argv[3],NULL,0);
+	}
+	printf("Page erase: %lu us, half-word program: %lu ns, read: %lu ns/byte\n",
+		(unsigned long)flash_sim_timing.erase_us,(unsigned long)flash_sim_timing.program_ns,
+		(unsigned long)flash_sim_timing.read_ns);
+	return 0;
+}
+
+// Hang the FLASH controller after <n> more register half-word programs: BSY stays set, until "simbusy 0"
+int cl_simbusy(void)
+{
+	if(argc > 1) {
+		hang_after = strtoul(argv[1],NULL,0);
+		if(!hang_after) hung = 0;
+	}
+	printf("FLASH controller: %s",hung ? "hung (BSY)" : "ready");
+	if(hang_after) printf(", hangs after %lu half-word programs",(unsigned long)hang_after);
+	printf("\n");
+	return 0;
+}
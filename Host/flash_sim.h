@@ -0,0 +1,98 @@
+/*
+ * flash_sim.h
+ *
+ *  Simulated STM32-F103 FLASH, for running LittleFS and littlefs_interface.c on a Linux build machine.
+ *
+ *  The simulated FLASH is mapped at the STM32's FLASH address (0x08000000), read-only, so the interface's
+ *  direct reads and LittleFS's direct mapped reads work unchanged.  Programs and erases go through the
+ *  simulated HAL_FLASH_Program() / HAL_FLASHEx_Erase(), or the register program path's half-word stores
+ *  (flash_sim_store16(), see Host/Inc/main.h), which enforce NOR rules:
+ *    - programs are half-words, on half-word boundaries
+ *    - a half-word can only be programmed once after an erase (PGERR otherwise, as on the F103),
+ *      so programs can only clear bits
+ *    - erases set a whole 1K page to 0xFF
+ *  Every operation adds to a modelled time, using a simple latency model.  The modelled time drives
+ *  HAL_GetTick(), TIM4->CNT, and DWT->CYCCNT, so the timing the commands display is modelled time.
+ *
+ *  Flash operations and modelled time are also totalled per LittleFS API call, using the LFS_TRACE()
+ *  hook in the public lfs_xxx() functions (build lfs.c with -DLFS_TRACE=flash_sim_trace).
+ */
+
+#ifndef _flash_sim_h_
+#define _flash_sim_h_
+
+#include <stdint.h>
+
+#define FLASH_SIM 1 // building against the FLASH simulator
+#define LFS_PROFILE // profile every public LittleFS call, the "fsprof" command (littlefs_interface.c)
+#define LFS_TXN // LittleFS transactions, the "txnbench" command (lfs.c, littlefs_interface.c)
+#ifndef LFS_FLASH_KB_OVERRIDE
+#define LFS_FLASH_KB_OVERRIDE 0 // place the file system from the simulated FLASH size register (-k)
+#endif
+#ifndef LFS_RING_LOG
+#define LFS_RING_LOG 1 // ring log commands, for the power loss scripts (littlefs_log.c)
+#endif
+#ifndef LFS_KV_STORE
+#define LFS_KV_STORE 1 // key-value store commands (littlefs_kv.c)
+#endif
+#ifndef LFS_COMPRESS
+#define LFS_COMPRESS 1 // compressed files, the "zcopy" command (littlefs_compress.c)
+#endif
+
+// Latency model
+typedef struct {
+	uint32_t erase_us;      // page erase time, microseconds (F103: 20 - 40ms)
+	uint32_t program_ns;    // half-word program time, nanoseconds (F103: 40 - 70us)
+	uint32_t read_ns;       // read time, nanoseconds per byte
+} FLASH_SIM_TIMING;
+
+// Simulator counters
+typedef struct {
+	uint64_t read_bytes;    // bytes read through lfs_read() (direct mapped reads aren't seen)
+	uint64_t prog_halfwords;// half-words programmed
+	uint64_t prog_errors;   // programs refused (not erased, misaligned, locked)
+	uint64_t erases;        // pages erased
+	uint64_t time_ns;       // modelled time
+} FLASH_SIM_COUNTERS;
+
+extern FLASH_SIM_TIMING flash_sim_timing;
+
+int flash_sim_init(uint32_t flash_kb, const char * image); // map the FLASH, load image file if present
+int flash_sim_save(const char * image);                    // write the FLASH image to a file
+void flash_sim_counters(FLASH_SIM_COUNTERS * counters);    // current counters
+uint64_t flash_sim_now_ns(void);                           // modelled time
+void flash_sim_delay_ns(uint64_t ns);                      // advance modelled time (HAL_Delay())
+uint8_t * flash_sim_memory(uint32_t address);              // writable view of a FLASH address, or NULL
+uint32_t flash_sim_host_cycles(void);                      // host CPU time, in 64MHz cycles
+void flash_sim_store16(uint32_t address, uint16_t half);   // register program path half-word store (FLASH_CR_PG)
+
+// Power loss
+// Program (half-word) and erase (page) operations are numbered from 1.  When operation number
+// flash_sim_cut_at is reached, it is torn: a half-word program clears only some of its bits, a page erase
+// sets only some of its bytes to 0xFF.  flash_sim_powerloss() is then called, and must not return.
+extern uint64_t flash_sim_ops;        // program and erase operations so far
+extern uint64_t flash_sim_cut_at;     // operation the power fails in, 0 for never
+extern uint32_t flash_sim_seed;       // random source for torn operations
+extern void (*flash_sim_powerloss)(void);
+
+// Per API call totals
+void flash_sim_trace(const char * fmt, ...);               // LFS_TRACE() hook
+extern int flash_sim_verbose;                              // print each API call as it returns
+int cl_simstat(void);
+int cl_simtime(void);
+int cl_simbusy(void);
+int powerloss_run(const char * script, uint64_t every, int verbose); // powerloss.c
+int cl_wearsim(void);                                      // wear_sim.c
+int cl_coldsim(void);
+int cl_mapbench(void);                                     // map_bench.c
+
+// Records to add into command line interface (command_line.c), host builds only:
+#define FLASH_SIM_COMMANDS \
+{"simstat",    "FLASH simulator per API call totals, \"simstat reset\" to clear", 1, cl_simstat}, \
+{"simtime",    "FLASH simulator latency <erase us> <program ns> <read ns>", 1, cl_simtime}, \
+{"simbusy",    "FLASH simulator, hang the controller (BSY stays set) after <n> register half-word programs, 0 to recover", 1, cl_simbusy}, \
+{"wearsim",    "Compare block wear over [days] of logging, with and without erase counts", 1, cl_wearsim}, \
+{"coldsim",    "Compare write amplification of hot / cold data over [rounds], with and without LFS_O_COLD", 1, cl_coldsim}, \
+{"mapbench",   "Compare read callbacks and bytes copied per operation, with and without direct mapped reads [ops]", 1, cl_mapbench} \
+
+#endif // _flash_sim_h_
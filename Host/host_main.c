@@ -0,0 +1,123 @@
+/*
+ * host_main.c
+ *
+ *  Run the command line, LittleFS, and littlefs_interface.c on a Linux build machine, against the
+ *  simulated FLASH in flash_sim.c.  Commands are read from stdin, so a script of commands can be
+ *  piped in, and "simstat" displays the FLASH work and modelled time per LittleFS API call.
+ *
+ *  Build (from the repository root):
+ *    gcc -std=gnu11 -O2 -no-pie -D_GNU_SOURCE -DSTM32F103xB -DLFS_TRACE=flash_sim_trace -include flash_sim.h \
+ *        -IHost/Inc -IHost -ICore/Src -ICore/LittleFS \
+ *        Host/host_main.c Host/flash_sim.c Host/powerloss.c Host/wear_sim.c Host/map_bench.c \
+ *        Core/Src/command_line.c \
+ *        Core/Src/littlefs_interface.c Core/Src/littlefs_log.c Core/Src/littlefs_kv.c Core/Src/littlefs_compress.c \
+ *        Core/LittleFS/lfs.c Core/LittleFS/lfs_util.c \
+ *        -Wl,--defsym=_sidata=0x08008000,--defsym=_sdata=_edata -o lfs_host
+ *  Interface settings from littlefs_interface.h can be added, for example -DLFS_DIRECT_MAPPED=0.
+ *  -no-pie keeps the program within the 32-bit addresses the interface uses.  The --defsym options stand in
+ *  for the linker script symbols lfs_init() uses to check the firmware fits below the file system,
+ *  modelling a 32K firmware image (the host linker already defines _edata).
+ *
+ *  Usage:
+ *    lfs_host [-k <FLASH KBytes>] [-i <image file>] [-v] [-p <every>] < script
+ *      -k  FLASH size register value, default 64
+ *      -i  FLASH image, loaded at start (if it exists) and saved at exit
+ *      -v  display the FLASH work for each LittleFS API call
+ *      -p  power loss test, failing the power every <every> FLASH operations (see powerloss.c)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "command_line.h"
+
+static const char * image_file; // FLASH image, saved at exit
+static int input_done;          // stdin reached end of file
+
+int __io_putchar(int ch)
+{
+	return putchar(ch);
+}
+
+// The command line polls for characters, the host reads them from stdin
+int __io_getchar(void)
+{
+	int c = getchar();
+	if(c == EOF) input_done = 1;
+	return c;
+}
+
+static void host_exit(int status)
+{
+	if(image_file) flash_sim_save(image_file);
+	exit(status);
+}
+
+// "reset" ends the run, keeping the FLASH image
+void NVIC_SystemReset(void)
+{
+	printf("reset\n");
+	host_exit(0);
+}
+
+void Error_Handler(void)
+{
+	printf("%s\n",__func__);
+	host_exit(1);
+}
+
+int cl_xmodem_send(void)
+{
+	printf("XModem isn't available in the host build\n");
+	return -1;
+}
+
+int cl_xmodem_receive(void)
+{
+	return cl_xmodem_send();
+}
+
+int main(int ac, char ** av)
+{
+	uint32_t flash_kb = 64;
+	uint64_t powerloss_every = 0;
+	int opt;
+
+	while((opt = getopt(ac, av, "k:i:vp:")) != -1) {
+		switch(opt) {
+		case 'k': flash_kb = strtoul(optarg,NULL,0); break;
+		case 'i': image_file = optarg; break;
+		case 'v': flash_sim_verbose = 1; break;
+		case 'p': powerloss_every = strtoull(optarg,NULL,0); break;
+		default:
+			printf("usage: %s [-k <FLASH KBytes>] [-i <image file>] [-v] [-p <every>] < script\n",av[0]);
+			return 2;
+		}
+	}
+
+	if(flash_sim_init(flash_kb, image_file)) return 1;
+
+	if(powerloss_every) {
+		static char script[4096];
+		size_t n = fread(script, 1, sizeof(script) - 1, stdin);
+		script[n] = 0;
+		int failures = powerloss_run(script, powerloss_every, flash_sim_verbose);
+		flash_sim_verbose = 0;
+		host_exit(failures ? 1 : 0);
+	}
+	HAL_FLASH_Unlock();
+	if(lfs_init()) host_exit(1);
+
+	cl_setup();
+	while(!input_done) {
+		cl_loop();
+		lfs_idle(); // pre-erase FLASH while waiting for commands
+	}
+	printf("\n");
+	host_exit(0);
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * map_bench.c
+ *
+ *  Direct mapped read benchmark for host builds, run against a RAM FLASH image with the interface's geometry.
+ *
+ *  "mapbench [ops]" runs the same random file workload twice, reading through the read callback (direct_map
+ *  NULL, as with LFS_DIRECT_MAPPED 0) and with LittleFS reading the RAM image in place (direct_map set), and
+ *  compares the read callbacks made and bytes they copied per operation.  The workload, from a fixed seed:
+ *    - write: create or truncate one of 8 files (in "/" or "d/"), write 0 - 1.5K bytes, close
+ *    - read:  open one of the files, read it 256 bytes at a time, close
+ *    - stat:  lfs_stat() one of the files
+ *    - dir:   list "d"
+ *  and a mount of the result.  The program and erase counts of the two runs must match, direct mapped reads
+ *  only change how LittleFS reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "command_line.h"
+
+extern struct lfs_config lfs_cfg;
+
+#define MAP_BENCH_OPS      2000 // default run length
+#define MAP_BENCH_FILES    8
+#define MAP_BENCH_MAX      1536 // largest file written
+
+enum {MAP_OP_WRITE, MAP_OP_READ, MAP_OP_STAT, MAP_OP_DIR, MAP_OP_MOUNT, MAP_OPS};
+static const char * const map_op_name[MAP_OPS] = {"write", "read", "stat", "dir", "mount"};
+
+// Block device counters
+typedef struct {
+	uint64_t reads;      // read callbacks
+	uint64_t read_bytes; // bytes they copied
+	uint64_t progs;
+	uint64_t erases;
+} MAP_BENCH_COUNTS;
+
+// Totals of one run, per operation
+typedef struct {
+	uint32_t ops[MAP_OPS];
+	MAP_BENCH_COUNTS counts[MAP_OPS];
+} MAP_BENCH_RUN;
+
+static uint8_t map_bench_flash[LFS_MAX_BLOCKS * LFS_BLOCK_SIZE];
+static MAP_BENCH_COUNTS map_bench_counts;
+static struct lfs_config map_bench_cfg;
+
+static int map_bench_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	memcpy(buffer, &map_bench_flash[block * c->block_size + off], size);
+	map_bench_counts.reads++;
+	map_bench_counts.read_bytes += size;
+	return 0;
+}
+
+// NOR programming, bits can only be cleared
+static int map_bench_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	uint8_t * dst = &map_bench_flash[block * c->block_size + off];
+	for(lfs_size_t i=0;i<size;i++) dst[i] &= ((const uint8_t *)buffer)[i];
+	map_bench_counts.progs++;
+	return 0;
+}
+
+static int map_bench_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	memset(&map_bench_flash[block * c->block_size], 0xFF, c->block_size);
+	map_bench_counts.erases++;
+	return 0;
+}
+
+static int map_bench_sync(const struct lfs_config *c)
+{
+	(void)c;
+	return 0;
+}
+
+// Add the counts since *before to the operation's totals
+static void map_bench_account(MAP_BENCH_RUN * run, int op, const MAP_BENCH_COUNTS * before)
+{
+	run->ops[op]++;
+	run->counts[op].reads += map_bench_counts.reads - before->reads;
+	run->counts[op].read_bytes += map_bench_counts.read_bytes - before->read_bytes;
+	run->counts[op].progs += map_bench_counts.progs - before->progs;
+	run->counts[op].erases += map_bench_counts.erases - before->erases;
+}
+
+// Run the workload on a freshly formatted RAM FLASH, with LittleFS's reads direct mapped or not
+static int map_bench_run(uint32_t ops, int direct, MAP_BENCH_RUN * run)
+{
+	static uint32_t read_buffer[64/sizeof(uint32_t)], prog_buffer[64/sizeof(uint32_t)];
+	static uint32_t lookahead_buffer[8*((LFS_MAX_BLOCKS+31)/32)/sizeof(uint32_t)];
+	static uint8_t data[MAP_BENCH_MAX];
+	uint8_t buf[256];
+	char name[LFS_NAME_MAX+1];
+	lfs_t fs;
+
+	map_bench_cfg = (struct lfs_config){
+		.read = map_bench_read, .prog = map_bench_prog, .erase = map_bench_erase, .sync = map_bench_sync,
+		.read_size = lfs_cfg.read_size, .prog_size = lfs_cfg.prog_size,
+		.block_size = lfs_cfg.block_size, .block_count = lfs_cfg.block_count,
+		.block_cycles = lfs_cfg.block_cycles,
+		.cache_size = sizeof(read_buffer), .lookahead_size = sizeof(lookahead_buffer),
+		.read_buffer = read_buffer, .prog_buffer = prog_buffer, .lookahead_buffer = lookahead_buffer,
+		.direct_map = direct ? map_bench_flash : NULL,
+	};
+	memset(run, 0, sizeof(*run));
+	memset(map_bench_flash, 0xFF, sizeof(map_bench_flash));
+	srand(1);
+	for(uint32_t i=0;i<sizeof(data);i++) data[i] = (uint8_t)rand();
+
+	int err = lfs_format(&fs, &map_bench_cfg);
+	if(!err) err = lfs_mount(&fs, &map_bench_cfg);
+	if(!err) err = lfs_mkdir(&fs, "d");
+	if(err) {
+		printf("Workload setup failed: %d\n",err);
+		return err;
+	}
+
+	for(uint32_t i=0;i<ops && !err;i++) {
+		int op = rand() % 8;
+		op = (op < 3) ? MAP_OP_WRITE : (op < 6) ? MAP_OP_READ : (op < 7) ? MAP_OP_STAT : MAP_OP_DIR;
+		int file = rand() % MAP_BENCH_FILES;
+		lfs_size_t size = rand() % MAP_BENCH_MAX;
+		snprintf(name,sizeof(name),"%sf%d",(file & 1) ? "d/" : "",file / 2);
+
+		MAP_BENCH_COUNTS before = map_bench_counts;
+		lfs_file_t f;
+		struct lfs_info info;
+		lfs_dir_t dir;
+		switch(op) {
+		case MAP_OP_WRITE:
+			err = lfs_file_open(&fs, &f, name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+			if(!err) {
+				lfs_ssize_t written = lfs_file_write(&fs, &f, data, size);
+				err = lfs_file_close(&fs, &f);
+				if(written < 0) err = written;
+			}
+			if(err == LFS_ERR_NOSPC) err = lfs_remove(&fs, name); // full, start that file over
+			break;
+		case MAP_OP_READ:
+			err = lfs_file_open(&fs, &f, name, LFS_O_RDONLY);
+			if(err == LFS_ERR_NOENT) {
+				err = 0;
+				break;
+			}
+			if(!err) {
+				lfs_ssize_t n;
+				while((n = lfs_file_read(&fs, &f, buf, sizeof(buf))) > 0);
+				err = lfs_file_close(&fs, &f);
+				if(n < 0) err = n;
+			}
+			break;
+		case MAP_OP_STAT:
+			err = lfs_stat(&fs, name, &info);
+			if(err == LFS_ERR_NOENT) err = 0;
+			break;
+		case MAP_OP_DIR:
+			err = lfs_dir_open(&fs, &dir, "d");
+			if(!err) {
+				int n;
+				while((n = lfs_dir_read(&fs, &dir, &info)) > 0);
+				err = lfs_dir_close(&fs, &dir);
+				if(n < 0) err = n;
+			}
+			break;
+		}
+		map_bench_account(run, op, &before);
+		if(err) printf("Workload failed at op %" PRIu32 " (%s %s): %d\n",i,map_op_name[op],name,err);
+	}
+
+	if(!err) err = lfs_unmount(&fs);
+	MAP_BENCH_COUNTS before = map_bench_counts;
+	if(!err) err = lfs_mount(&fs, &map_bench_cfg);
+	map_bench_account(run, MAP_OP_MOUNT, &before);
+	if(!err) err = lfs_unmount(&fs);
+	return err;
+}
+
+// Compare read callbacks and bytes copied per operation, with and without direct mapped reads.
+// Optional argument: operations in the workload.
+int cl_mapbench(void)
+{
+	static MAP_BENCH_RUN runs[2]; // read callback, direct mapped
+	uint32_t ops = MAP_BENCH_OPS;
+	if(argc > 1) ops = strtoul(argv[1],NULL,0);
+	if(!ops || !lfs_cfg.block_count) {
+		printf("Nothing to run\n");
+		return -1;
+	}
+
+	for(int direct=0;direct<2;direct++) {
+		if(map_bench_run(ops, direct, &runs[direct])) return -1;
+	}
+
+	printf("%" PRIu32 " operations, %" PRIu32 " blocks of %" PRIu32 " bytes\n",ops,lfs_cfg.block_count,
+		lfs_cfg.block_size);
+	printf("               read callback / op    direct mapped / op\n");
+	printf("op      count  callbacks     bytes  callbacks     bytes\n");
+	MAP_BENCH_COUNTS totals[2] = {{0}};
+	for(int op=0;op<MAP_OPS;op++) {
+		uint32_t n = runs[0].ops[op];
+		if(!n) continue;
+		printf("%-6s %6" PRIu32,map_op_name[op],n);
+		for(int direct=0;direct<2;direct++) {
+			const MAP_BENCH_COUNTS * c = &runs[direct].counts[op];
+			printf(" %10.1f %9.1f",(double)c->reads / n,(double)c->read_bytes / n);
+			totals[direct].reads += c->reads;
+			totals[direct].read_bytes += c->read_bytes;
+			totals[direct].progs += c->progs;
+			totals[direct].erases += c->erases;
+		}
+		printf("\n");
+	}
+	for(int direct=0;direct<2;direct++) {
+		printf("%s: %llu read callbacks, %llu bytes copied, %llu programs, %llu erases\n",
+			direct ? "Direct mapped" : "Read callback",(unsigned long long)totals[direct].reads,
+			(unsigned long long)totals[direct].read_bytes,(unsigned long long)totals[direct].progs,
+			(unsigned long long)totals[direct].erases);
+	}
+	if(totals[0].progs != totals[1].progs || totals[0].erases != totals[1].erases) {
+		printf("Program / erase counts differ!\n");
+		return -1;
+	}
+	return 0;
+}
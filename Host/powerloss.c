@@ -0,0 +1,386 @@
+/*
+ * powerloss.c
+ *
+ *  Power loss testing for host builds (lfs_host -p <every>).
+ *
+ *  A workload script of command lines (mkdir, makefile, writespeed, copy, rename, remove, ...) is run once
+ *  to record the file system after each command, and the number of FLASH program and erase operations
+ *  it takes.  It is then run again from the same starting FLASH for every Nth operation, with the power
+ *  failing in that operation (see flash_sim.h, the operation is torn).  After each power failure the file
+ *  system is mounted from scratch, made consistent (lfs_fs_mkconsistent(), completing any interrupted
+ *  move and removing orphans), and checked:
+ *    - mount and lfs_fs_mkconsistent() succeed
+ *    - every file reads back without error, and matches its contents before or after the interrupted
+ *      command (or is empty, for a file being created)
+ *    - files the command didn't touch are unchanged, and no more or fewer files exist than before or
+ *      after the command
+ *    - a new file can be written, read back, and removed
+ *    - the free block bitmap (LFS_FREE_BITMAP) marks every block the file system uses
+ *  The time taken by the recovery mount and lfs_fs_mkconsistent() is modelled time from the simulator
+ *  (build with -DLFS_DIRECT_MAPPED=0 to include read time).
+ *
+ *  Each run and each recovery is a separate process, so every recovery starts with the RAM state of a
+ *  fresh boot.  The simulated FLASH is shared memory, so it survives the "power failure".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "command_line.h"
+
+extern lfs_t lfs;
+extern struct lfs_config lfs_cfg;
+
+#define PL_MAX_STEPS   64 // commands in a workload script
+#define PL_MAX_FILES   32 // files and directories in the file system
+#define PL_PATH_MAX    48
+#define PL_EXIT_CUT    3  // workload process exit status when the power failed
+
+// File system contents
+typedef struct {
+	char path[PL_PATH_MAX];
+	int32_t size;  // -1 for a directory
+	uint32_t crc;  // file contents
+} PL_ENTRY;
+
+typedef struct {
+	uint32_t count;
+	PL_ENTRY entry[PL_MAX_FILES];
+} PL_SNAPSHOT;
+
+// Shared between the harness and its child processes
+typedef struct {
+	uint64_t ops_after[PL_MAX_STEPS+1];   // FLASH operations after each command (0: after lfs_init())
+	PL_SNAPSHOT snap[PL_MAX_STEPS+1];     // file system after each command
+	uint64_t mount_ns;                    // recovery results
+	uint64_t consistent_ns;
+	uint64_t consistent_ops;              // FLASH operations by lfs_fs_mkconsistent()
+	char message[160];                    // reason a recovery failed
+} PL_SHARED;
+
+static PL_SHARED * shared;
+static char * steps[PL_MAX_STEPS];
+static int step_count;
+
+static void pl_powerloss(void)
+{
+	_exit(PL_EXIT_CUT);
+}
+
+// Record everything below "path" into the snapshot.  Returns a negative error code on failure.
+static int pl_walk(PL_SNAPSHOT * snap, const char * path)
+{
+	lfs_dir_t dir;
+	struct lfs_info info;
+	char child[PL_PATH_MAX];
+	int err = lfs_dir_open(&lfs, &dir, path);
+	if(err) return err;
+
+	while((err = lfs_dir_read(&lfs, &dir, &info)) > 0) {
+		if(strcmp(info.name,".") == 0 || strcmp(info.name,"..") == 0) continue;
+		if(snap->count >= PL_MAX_FILES) { err = LFS_ERR_NOSPC; break; }
+		if(snprintf(child, sizeof(child), "%s%s%s", path, strcmp(path,"/") ? "/" : "", info.name) >= (int)sizeof(child)) {
+			err = LFS_ERR_NAMETOOLONG; // deeper than the snapshot can record
+			break;
+		}
+		PL_ENTRY * e = &snap->entry[snap->count++];
+		memcpy(e->path, child, sizeof(e->path));
+		e->size = -1;
+		e->crc = 0;
+		if(info.type == LFS_TYPE_DIR) {
+			err = pl_walk(snap, child);
+			if(err) break;
+			continue;
+		}
+		// read the whole file
+		lfs_file_t file;
+		uint8_t buf[128];
+		lfs_ssize_t n;
+		uint32_t size = 0;
+		e->crc = 0xFFFFFFFF;
+		err = lfs_file_open(&lfs, &file, child, LFS_O_RDONLY);
+		if(err) break;
+		while((n = lfs_file_read(&lfs, &file, buf, sizeof(buf))) > 0) {
+			e->crc = lfs_crc(e->crc, buf, n);
+			size += n;
+		}
+		lfs_file_close(&lfs, &file);
+		if(n < 0) { err = n; break; }
+		if(size != info.size) { err = LFS_ERR_CORRUPT; break; }
+		e->size = (int32_t)size;
+	}
+	lfs_dir_close(&lfs, &dir);
+	return err < 0 ? err : 0;
+}
+
+static int pl_snapshot(PL_SNAPSHOT * snap)
+{
+	memset(snap, 0, sizeof(*snap));
+	return pl_walk(snap, "/");
+}
+
+static const PL_ENTRY * pl_find(const PL_SNAPSHOT * snap, const char * path)
+{
+	for(uint32_t i=0;i<snap->count;i++)
+		if(strcmp(snap->entry[i].path, path) == 0) return &snap->entry[i];
+	return NULL;
+}
+
+static int pl_same(const PL_ENTRY * a, const PL_ENTRY * b)
+{
+	return a && b && a->size == b->size && a->crc == b->crc;
+}
+
+// Check the recovered file system against the file system before and after the interrupted command.
+// Returns 0 if it's one of the allowed states, or fills in shared->message.
+static int pl_compare(const PL_SNAPSHOT * now, const PL_SNAPSHOT * before, const PL_SNAPSHOT * after)
+{
+	uint32_t lo = before->count < after->count ? before->count : after->count;
+	uint32_t hi = before->count > after->count ? before->count : after->count;
+
+	for(uint32_t i=0;i<now->count;i++) {
+		const PL_ENTRY * e = &now->entry[i];
+		const PL_ENTRY * b = pl_find(before, e->path);
+		const PL_ENTRY * a = pl_find(after, e->path);
+		if(!a && !b) {
+			snprintf(shared->message, sizeof(shared->message), "unexpected \"%s\"", e->path);
+			return -1;
+		}
+		if(!pl_same(e, b) && !pl_same(e, a) && e->size != 0) {
+			snprintf(shared->message, sizeof(shared->message), "\"%s\" has %ld bytes, crc 0x%08lX",
+				e->path, (long)e->size, (unsigned long)e->crc);
+			return -1;
+		}
+	}
+	for(uint32_t i=0;i<before->count;i++) {
+		const PL_ENTRY * b = &before->entry[i];
+		if(pl_same(b, pl_find(after, b->path)) && !pl_same(b, pl_find(now, b->path))) {
+			snprintf(shared->message, sizeof(shared->message), "untouched \"%s\" changed or lost", b->path);
+			return -1;
+		}
+	}
+	if(now->count < lo || now->count > hi) {
+		snprintf(shared->message, sizeof(shared->message), "%lu entries, expected %lu - %lu",
+			(unsigned long)now->count, (unsigned long)lo, (unsigned long)hi);
+		return -1;
+	}
+	return 0;
+}
+
+// Run a command line, as if typed
+static void pl_command(const char * line)
+{
+	strncpy(buffer, line, MAXSERIALBUF - 1);
+	buffer[MAXSERIALBUF - 1] = 0;
+	cl_process_buffer();
+	lfs_idle(); // the main loop runs lfs_idle() between commands
+}
+
+// Child process: run the workload, recording the file system after each command if "record"
+static void pl_workload(int record, int verbose)
+{
+	if(!verbose) dup2(open("/dev/null", O_WRONLY), STDOUT_FILENO);
+	HAL_FLASH_Unlock();
+	if(lfs_init()) _exit(1);
+	if(record) {
+		pl_snapshot(&shared->snap[0]);
+		shared->ops_after[0] = flash_sim_ops;
+	}
+	for(int i=0;i<step_count;i++) {
+		pl_command(steps[i]);
+		if(record) {
+			if(pl_snapshot(&shared->snap[i+1])) _exit(1);
+			shared->ops_after[i+1] = flash_sim_ops;
+		}
+	}
+	_exit(0);
+}
+
+// Child process: mount after a power failure, and check the file system
+static void pl_recover(const PL_SNAPSHOT * before, const PL_SNAPSHOT * after)
+{
+	static PL_SNAPSHOT now;
+	int err;
+
+	dup2(open("/dev/null", O_WRONLY), STDOUT_FILENO); // LittleFS reports the damage it finds
+	HAL_FLASH_Unlock();
+	if(lfs_flash_geometry()) _exit(1);
+
+	uint64_t start = flash_sim_now_ns();
+	err = lfs_mount(&lfs, &lfs_cfg);
+	shared->mount_ns = flash_sim_now_ns() - start;
+	if(err) {
+		snprintf(shared->message, sizeof(shared->message), "lfs_mount() %d", err);
+		_exit(1);
+	}
+	start = flash_sim_now_ns();
+	uint64_t ops = flash_sim_ops;
+	err = lfs_fs_mkconsistent(&lfs);
+	shared->consistent_ns = flash_sim_now_ns() - start;
+	shared->consistent_ops = flash_sim_ops - ops;
+	if(err) {
+		snprintf(shared->message, sizeof(shared->message), "lfs_fs_mkconsistent() %d", err);
+		_exit(1);
+	}
+
+	err = pl_snapshot(&now);
+	if(err) {
+		snprintf(shared->message, sizeof(shared->message), "reading files %d", err);
+		_exit(1);
+	}
+	if(pl_compare(&now, before, after)) _exit(1);
+
+	// Still writable?
+	lfs_file_t file;
+	const char text[] = "power loss check";
+	char check[sizeof(text)];
+	err = lfs_file_open(&lfs, &file, "pl_check", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+	if(!err) {
+		err = lfs_file_write(&lfs, &file, text, sizeof(text));
+		int close_err = lfs_file_close(&lfs, &file);
+		err = err < 0 ? err : close_err;
+	}
+	if(!err) err = lfs_file_open(&lfs, &file, "pl_check", LFS_O_RDONLY);
+	if(!err) {
+		err = lfs_file_read(&lfs, &file, check, sizeof(check));
+		lfs_file_close(&lfs, &file);
+		err = err == sizeof(text) && memcmp(text, check, sizeof(text)) == 0 ? 0 : LFS_ERR_CORRUPT;
+	}
+	if(!err) err = lfs_remove(&lfs, "pl_check");
+	if(err) {
+		snprintf(shared->message, sizeof(shared->message), "write after recovery %d", err);
+		_exit(1);
+	}
+	lfs_ssize_t leaked = lfs_fs_checkfree(&lfs);
+	if(leaked < 0) {
+		snprintf(shared->message, sizeof(shared->message), "free bitmap check %d", (int)leaked);
+		_exit(1);
+	}
+	lfs_unmount(&lfs);
+	_exit(0);
+}
+
+// Run a child process, returning its exit status
+static int pl_child(void (*fn)(void *), void * arg)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0) {
+		fn(arg);
+		_exit(0);
+	}
+	int status;
+	if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return -1;
+	return WEXITSTATUS(status);
+}
+
+static int pl_verbose;
+static void pl_run_format(void * arg) { (void)arg; pl_workload(0, pl_verbose); }
+static void pl_run_record(void * arg) { (void)arg; pl_workload(1, pl_verbose); }
+static void pl_run_cut(void * arg)
+{
+	flash_sim_cut_at = *(uint64_t *)arg;
+	flash_sim_seed = (uint32_t)flash_sim_cut_at * 2654435761u | 1;
+	flash_sim_powerloss = pl_powerloss;
+	pl_workload(0, 0);
+}
+static int pl_step; // command the power failed in
+static void pl_run_recover(void * arg)
+{
+	(void)arg;
+	pl_recover(&shared->snap[pl_step-1], &shared->snap[pl_step]);
+}
+
+// Run the script, cutting power every "every" FLASH operations.  Returns the number of failures.
+int powerloss_run(const char * script, uint64_t every, int verbose)
+{
+	static char lines[4096];
+	pl_verbose = verbose;
+
+	// Split the script into command lines, skipping blank lines and # comments
+	strncpy(lines, script, sizeof(lines) - 1);
+	for(char * line = strtok(lines, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+		while(*line == ' ' || *line == '\t') line++;
+		if(!*line || *line == '#') continue;
+		if(step_count >= PL_MAX_STEPS) {
+			printf("%s: more than %d commands\n",__func__,PL_MAX_STEPS);
+			return -1;
+		}
+		steps[step_count++] = line;
+	}
+
+	if(!step_count) return 0;
+	shared = mmap(NULL, sizeof(PL_SHARED), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(shared == MAP_FAILED) return -1;
+
+	// Format (if needed) and keep the starting FLASH contents
+	if(lfs_flash_geometry()) return -1;
+	int saved_steps = step_count;
+	step_count = 0;
+	if(pl_child(pl_run_format, NULL) != 0) {
+		printf("%s: unable to mount or format\n",__func__);
+		return -1;
+	}
+	step_count = saved_steps;
+	uint32_t fs_size = lfs_cfg.block_count * lfs_cfg.block_size;
+	uint8_t * flash = flash_sim_memory(lfs_flash_start);
+	uint8_t * start = malloc(fs_size);
+	memcpy(start, flash, fs_size);
+
+	// Record the file system after each command, without power loss
+	if(pl_child(pl_run_record, NULL) != 0) {
+		printf("%s: workload failed without power loss\n",__func__);
+		return -1;
+	}
+	uint64_t total = shared->ops_after[step_count];
+	printf("Power loss: %d commands, %llu FLASH operations, cutting power every %llu\n",
+		step_count,(unsigned long long)total,(unsigned long long)every);
+
+	uint32_t cuts = 0, failures = 0, deorphans = 0;
+	uint64_t mount_sum = 0, mount_max = 0, consistent_sum = 0, consistent_max = 0;
+	for(uint64_t cut = every; cut <= total; cut += every) {
+		memcpy(flash, start, fs_size);
+		int rc = pl_child(pl_run_cut, &cut);
+		if(rc != PL_EXIT_CUT) {
+			printf("operation %llu: workload exited with %d, expected a power failure\n",(unsigned long long)cut,rc);
+			failures++;
+			continue;
+		}
+		for(pl_step=1;pl_step<step_count && shared->ops_after[pl_step] < cut;pl_step++);
+		shared->message[0] = 0;
+		rc = pl_child(pl_run_recover, NULL);
+		cuts++;
+		if(rc != 0) {
+			printf("operation %llu, during \"%s\": %s\n",(unsigned long long)cut,steps[pl_step-1],
+				shared->message[0] ? shared->message : "recovery crashed");
+			failures++;
+			continue;
+		}
+		mount_sum += shared->mount_ns;
+		consistent_sum += shared->consistent_ns;
+		if(shared->mount_ns > mount_max) mount_max = shared->mount_ns;
+		if(shared->consistent_ns > consistent_max) consistent_max = shared->consistent_ns;
+		if(shared->consistent_ops) deorphans++;
+	}
+	memcpy(flash, start, fs_size);
+	free(start);
+
+	printf("%lu power failures, %lu failed recovery\n",(unsigned long)cuts,(unsigned long)failures);
+	if(cuts > failures) {
+		uint32_t ok = cuts - failures;
+		printf("Recovery mount:        avg %7llu us, max %7llu us\n",
+			(unsigned long long)(mount_sum / ok / 1000),(unsigned long long)(mount_max / 1000));
+		printf("lfs_fs_mkconsistent(): avg %7llu us, max %7llu us, %lu needed FLASH work\n",
+			(unsigned long long)(consistent_sum / ok / 1000),(unsigned long long)(consistent_max / 1000),
+			(unsigned long)deorphans);
+	}
+	munmap(shared, sizeof(PL_SHARED));
+	return (int)failures;
+}
@@ -0,0 +1,324 @@
+/*
+ * wear_sim.c
+ *
+ *  Wear simulations for host builds, run against a RAM copy of the file system's geometry.
+ *
+ *  "wearsim [days]" runs months of data logging twice, with and without LittleFS's erase counts (wear_type,
+ *  LFS_WEAR_TYPE), and compares how evenly the blocks wear.  The workload, a typical logger:
+ *    - 30% of the blocks hold files that never change
+ *    - a 32 byte record is appended to log/log.txt and synced every minute, rotating to log/old.txt when it
+ *      reaches 10% of the file system
+ *    - state.bin (200 bytes) is rewritten every hour, when lfs_idle()'s checkpoint and lfs_fs_gc() work is done
+ *    - the board resets once a day (unmount, mount)
+ *  Every erase is counted by the RAM block device, so the counts compared are the real ones, not LittleFS's.
+ *  Only erases after the setup are counted, and min / mean / max are over the blocks they wore: the static files'
+ *  blocks are never freed, so no allocator can level them.  Life is the days until the most worn block reaches
+ *  the F103's 10000 erase cycles.
+ *
+ *  "coldsim [rounds]" runs a mix of hot and cold data, with and without the cold files opened LFS_O_COLD, and
+ *  with and without erase counts, and compares the write amplification (bytes programmed per byte written) and
+ *  wear.  Each round rewrites four small hot files and appends a record to a log, and every 64 rounds one of
+ *  the cold files, four small settings files and a larger one, is rewritten.  They all share the root directory,
+ *  so without LFS_O_COLD the small cold files are inline, and copied by every compaction the hot files cause.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "main.h"
+#include "lfs.h"
+#include "littlefs_interface.h"
+#include "command_line.h"
+
+extern struct lfs_config lfs_cfg;
+
+#define WEAR_SIM_DAYS      90    // default run length
+#define WEAR_SIM_CYCLES    10000 // F103 FLASH endurance
+#define WEAR_SIM_RECORD    32    // log record size
+#define WEAR_SIM_ROTATE    10    // log size at rotation, percent of the file system
+#define COLD_SIM_ROUNDS    20000 // default run length
+#define COLD_SIM_HOT       4     // hot files, rewritten every round
+#define COLD_SIM_HOT_SIZE  48
+#define COLD_SIM_EVERY     64    // rounds between cold file rewrites
+#define COLD_SIM_ROTATE    5     // log size at rotation, percent of the file system
+
+static uint8_t wear_sim_flash[LFS_MAX_BLOCKS * LFS_BLOCK_SIZE];
+static uint32_t wear_sim_erases[LFS_MAX_BLOCKS];
+static uint64_t wear_sim_programmed; // bytes
+
+// cold file sizes
+static const lfs_size_t cold_sim_size[] = {60, 60, 60, 60, 1536};
+#define COLD_SIM_COLD      (sizeof(cold_sim_size)/sizeof(cold_sim_size[0]))
+static struct lfs_config wear_sim_cfg;
+
+static int wear_sim_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	memcpy(buffer, &wear_sim_flash[block * c->block_size + off], size);
+	return 0;
+}
+
+// NOR programming, bits can only be cleared
+static int wear_sim_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	uint8_t * dst = &wear_sim_flash[block * c->block_size + off];
+	for(lfs_size_t i=0;i<size;i++) dst[i] &= ((const uint8_t *)buffer)[i];
+	wear_sim_programmed += size;
+	return 0;
+}
+
+static int wear_sim_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	memset(&wear_sim_flash[block * c->block_size], 0xFF, c->block_size);
+	wear_sim_erases[block]++;
+	return 0;
+}
+
+static int wear_sim_sync(const struct lfs_config *c)
+{
+	(void)c;
+	return 0;
+}
+
+// Format and mount the RAM FLASH, with the interface's geometry and settings
+static int wear_sim_mount(lfs_t * fs, uint8_t wear_type)
+{
+	static uint32_t read_buffer[64/sizeof(uint32_t)], prog_buffer[64/sizeof(uint32_t)];
+	static uint32_t lookahead_buffer[8*((LFS_MAX_BLOCKS+31)/32)/sizeof(uint32_t)];
+	static uint8_t wear_buffer[2*LFS_MAX_BLOCKS];
+	wear_sim_cfg = (struct lfs_config){
+		.read = wear_sim_read, .prog = wear_sim_prog, .erase = wear_sim_erase, .sync = wear_sim_sync,
+		.read_size = lfs_cfg.read_size, .prog_size = lfs_cfg.prog_size,
+		.block_size = lfs_cfg.block_size, .block_count = lfs_cfg.block_count,
+		.block_cycles = lfs_cfg.block_cycles,
+		.cache_size = sizeof(read_buffer), .lookahead_size = sizeof(lookahead_buffer),
+		.read_buffer = read_buffer, .prog_buffer = prog_buffer, .lookahead_buffer = lookahead_buffer,
+		.free_bitmap = true, .checkpoint_type = lfs_cfg.checkpoint_type,
+		.wear_type = wear_type, .wear_buffer = wear_buffer,
+	};
+
+	memset(wear_sim_flash, 0xFF, sizeof(wear_sim_flash));
+	int err = lfs_format(fs, &wear_sim_cfg);
+	if(!err) err = lfs_mount(fs, &wear_sim_cfg);
+	return err;
+}
+
+// Write a whole file
+static int wear_sim_write(lfs_t * fs, const char * name, int flags, const void * data, lfs_size_t size)
+{
+	lfs_file_t file;
+	int err = lfs_file_open(fs, &file, name, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | flags);
+	if(err) return err;
+	lfs_ssize_t written = lfs_file_write(fs, &file, data, size);
+	err = lfs_file_close(fs, &file);
+	return (written < 0) ? written : err;
+}
+
+// Run the logging workload, returns 0 with wear_sim_erases[] filled in
+static int wear_sim_run(uint32_t days, uint8_t wear_type)
+{
+	lfs_t fs;
+	lfs_file_t log;
+	uint8_t record[WEAR_SIM_RECORD], data[LFS_BLOCK_SIZE - 100];
+	char name[LFS_NAME_MAX+1];
+	lfs_soff_t rotate = lfs_cfg.block_count * lfs_cfg.block_size * WEAR_SIM_ROTATE / 100;
+
+	memset(data, 0x5A, sizeof(data));
+	int err = wear_sim_mount(&fs, wear_type);
+	if(!err) err = lfs_mkdir(&fs, "log");
+	for(uint32_t i=0;!err && i<lfs_cfg.block_count*3/10;i++) {
+		// files that never change, one block each
+		snprintf(name,sizeof(name),"static%" PRIu32 ".bin",i);
+		err = wear_sim_write(&fs, name, 0, data, sizeof(data));
+	}
+	if(!err) err = lfs_file_open(&fs, &log, "log/log.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+	if(err) {
+		printf("Workload setup failed: %d\n",err);
+		return err;
+	}
+	memset(wear_sim_erases, 0, sizeof(wear_sim_erases));
+
+	for(uint32_t day=0;day<days;day++) {
+		for(uint32_t minute=0;minute<24*60;minute++) {
+			memset(record, '0' + minute % 10, sizeof(record));
+			err = lfs_file_write(&fs, &log, record, sizeof(record)) < 0;
+			if(!err) err = lfs_file_sync(&fs, &log);
+			if(!err && lfs_file_size(&fs, &log) >= rotate) {
+				err = lfs_file_close(&fs, &log);
+				if(!err) err = lfs_rename(&fs, "log/log.txt", "log/old.txt");
+				if(!err) err = lfs_file_open(&fs, &log, "log/log.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+			}
+
+			if(!err && minute % 60 == 59) {
+				err = wear_sim_write(&fs, "state.bin", 0, data, 200);
+				// lfs_idle()
+				while(!err && lfs_fs_gc(&fs) > 0);
+				if(!err) err = lfs_fs_checkpoint(&fs);
+			}
+			if(err) {
+				printf("Workload failed on day %" PRIu32 ": %d\n",day,err);
+				return err;
+			}
+		}
+
+		// daily reset
+		err = lfs_file_close(&fs, &log);
+		if(!err) err = lfs_unmount(&fs);
+		if(!err) err = lfs_mount(&fs, &wear_sim_cfg);
+		if(!err) err = lfs_file_open(&fs, &log, "log/log.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+		if(err) {
+			printf("Reset failed on day %" PRIu32 ": %d\n",day,err);
+			return err;
+		}
+	}
+
+	lfs_file_close(&fs, &log);
+	return lfs_unmount(&fs);
+}
+
+// Spread of the erases, over the blocks that were erased
+static void wear_sim_spread(uint32_t * worn, uint32_t * min, double * mean, uint32_t * max)
+{
+	uint64_t total = 0;
+	*worn = 0;
+	*min = UINT32_MAX;
+	*max = 0;
+	for(uint32_t block=0;block<lfs_cfg.block_count;block++) {
+		if(!wear_sim_erases[block]) continue;
+		if(wear_sim_erases[block] < *min) *min = wear_sim_erases[block];
+		if(wear_sim_erases[block] > *max) *max = wear_sim_erases[block];
+		total += wear_sim_erases[block];
+		*worn += 1;
+	}
+	*mean = *worn ? (double)total / *worn : 0.0;
+}
+
+static void wear_sim_report(const char * title, uint32_t days)
+{
+	uint32_t worn, min, max;
+	double mean;
+	wear_sim_spread(&worn, &min, &mean, &max);
+	if(!worn) return;
+	printf("%-13s %9.0f %6" PRIu32 " %7" PRIu32 " %9.1f %7" PRIu32 " %9.3f %9.0f\n",title,mean * worn,worn,min,mean,max,
+		max / mean,(double)WEAR_SIM_CYCLES * days / max);
+}
+
+// Compare block wear, with and without erase counts.  Optional argument: days of logging.
+int cl_wearsim(void)
+{
+	uint32_t days = WEAR_SIM_DAYS;
+	if(argc > 1) days = strtoul(argv[1],NULL,0);
+	if(!days || !lfs_cfg.block_count) {
+		printf("Nothing to simulate\n");
+		return -1;
+	}
+
+	printf("%" PRIu32 " days of logging, %" PRIu32 " blocks of %" PRIu32 " bytes, block_cycles %" PRId32 "\n",days,lfs_cfg.block_count,
+		lfs_cfg.block_size,lfs_cfg.block_cycles);
+	printf("                 erases blocks     min      mean     max  max/mean life days\n");
+	if(wear_sim_run(days, 0)) return -1;
+	wear_sim_report("Round-robin", days);
+	if(wear_sim_run(days, 0x7E)) return -1;
+	wear_sim_report("Least worn", days);
+	return 0;
+}
+
+// Run the hot / cold workload, returns 0 with wear_sim_erases[] and wear_sim_programmed filled in, and the
+// bytes written in *written
+static int cold_sim_run(uint32_t rounds, uint8_t wear_type, int cold_flags, uint64_t * written)
+{
+	lfs_t fs;
+	lfs_file_t log;
+	static uint8_t data[LFS_BLOCK_SIZE*2];
+	char name[LFS_NAME_MAX+1];
+	lfs_soff_t rotate = lfs_cfg.block_count * lfs_cfg.block_size * COLD_SIM_ROTATE / 100;
+
+	memset(data, 0xA5, sizeof(data));
+	int err = wear_sim_mount(&fs, wear_type);
+	for(uint32_t i=0;!err && i<COLD_SIM_COLD;i++) {
+		snprintf(name,sizeof(name),"cold%" PRIu32 ".bin",i);
+		err = wear_sim_write(&fs, name, cold_flags, data, cold_sim_size[i]);
+	}
+	if(!err) err = lfs_file_open(&fs, &log, "log.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+	if(err) {
+		printf("Workload setup failed: %d\n",err);
+		return err;
+	}
+	memset(wear_sim_erases, 0, sizeof(wear_sim_erases));
+	wear_sim_programmed = 0;
+	*written = 0;
+
+	for(uint32_t round=0;round<rounds;round++) {
+		for(uint32_t i=0;!err && i<COLD_SIM_HOT;i++) {
+			snprintf(name,sizeof(name),"hot%" PRIu32 ".bin",i);
+			data[0] = round;
+			err = wear_sim_write(&fs, name, 0, data, COLD_SIM_HOT_SIZE);
+			*written += COLD_SIM_HOT_SIZE;
+		}
+
+		if(!err) err = lfs_file_write(&fs, &log, data, WEAR_SIM_RECORD) < 0;
+		if(!err) err = lfs_file_sync(&fs, &log);
+		*written += WEAR_SIM_RECORD;
+		if(!err && lfs_file_size(&fs, &log) >= rotate) {
+			err = lfs_file_close(&fs, &log);
+			if(!err) err = lfs_rename(&fs, "log.txt", "old.txt");
+			if(!err) err = lfs_file_open(&fs, &log, "log.txt", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND);
+		}
+
+		if(!err && round % COLD_SIM_EVERY == COLD_SIM_EVERY - 1) {
+			uint32_t i = (round / COLD_SIM_EVERY) % COLD_SIM_COLD;
+			snprintf(name,sizeof(name),"cold%" PRIu32 ".bin",i);
+			err = wear_sim_write(&fs, name, cold_flags, data, cold_sim_size[i]);
+			*written += cold_sim_size[i];
+		}
+
+		if(!err && round % 60 == 59) {
+			// lfs_idle()
+			while(!err && lfs_fs_gc(&fs) > 0);
+			if(!err) err = lfs_fs_checkpoint(&fs);
+		}
+		if(err) {
+			printf("Workload failed in round %" PRIu32 ": %d\n",round,err);
+			return err;
+		}
+	}
+
+	lfs_file_close(&fs, &log);
+	return lfs_unmount(&fs);
+}
+
+// Compare write amplification and wear, with and without LFS_O_COLD.  Optional argument: rounds of the workload.
+int cl_coldsim(void)
+{
+	static const struct {
+		const char * title;
+		uint8_t wear_type;
+		int cold_flags;
+	} runs[] = {
+		{"Round-robin",           0, 0},
+		{"Round-robin, cold",     0, LFS_O_COLD},
+		{"Least worn",         0x7E, 0},
+		{"Least worn, cold",   0x7E, LFS_O_COLD},
+	};
+	uint32_t rounds = COLD_SIM_ROUNDS;
+	if(argc > 1) rounds = strtoul(argv[1],NULL,0);
+	if(!rounds || !lfs_cfg.block_count) {
+		printf("Nothing to simulate\n");
+		return -1;
+	}
+
+	printf("%" PRIu32 " rounds, %" PRIu32 " blocks of %" PRIu32 " bytes, block_cycles %" PRId32 "\n",rounds,lfs_cfg.block_count,
+		lfs_cfg.block_size,lfs_cfg.block_cycles);
+	printf("                   written KB  programmed KB  amplification  erases  max/mean     max\n");
+	for(uint32_t i=0;i<sizeof(runs)/sizeof(runs[0]);i++) {
+		uint64_t written;
+		if(cold_sim_run(rounds, runs[i].wear_type, runs[i].cold_flags, &written)) return -1;
+		uint32_t worn, min, max;
+		double mean;
+		wear_sim_spread(&worn, &min, &mean, &max);
+		printf("%-18s %11llu %14llu %14.3f %7.0f %9.3f %7" PRIu32 "\n",runs[i].title,(unsigned long long)(written / 1024),
+			(unsigned long long)(wear_sim_programmed / 1024),written ? (double)wear_sim_programmed / written : 0.0,
+			mean * worn,worn ? max / mean : 0.0,max);
+	}
+	return 0;
+}